@@ -1,250 +1,6597 @@
 #include <iostream>
 #include <algorithm>
+#include <array>
 #include <queue>
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
-// Node structure for the AVL Tree
-struct Node {
-    int data;
-    Node *left;
-    Node *right;
-    int height;
+// Aggregate policy of trees that keep no per-subtree aggregate
+struct NoAggregate {};
+
+// Compile-time options for AVLTree. Derive from this struct and override
+// members to turn on optional features; the defaults keep nodes minimal.
+struct AVLTreeOptions {
+    // Store the subtree size in every node to support rank and select
+    static constexpr bool order_statistics = false;
+    // Monoid folded over every subtree to support aggregate(lo, hi). A policy
+    // provides a value type, identity(), lift(element) and an associative
+    // combine(a, b); see SumAggregate for the shape.
+    using aggregate = NoAggregate;
+    // Keep one node per distinct key with an occurrence count (set mode only).
+    // Inserting a present key bumps its count and removing one drops it, and
+    // size, rank, select and count_range count every occurrence. Iterators
+    // and aggregates see each distinct key once.
+    static constexpr bool multiset = false;
+    // Cache the first eight bytes of every std::string key in its node, so
+    // that descents compare integers and only read the string on a tie.
+    // Pays off when keys tend to differ within their first eight bytes.
+    static constexpr bool key_prefix = false;
+};
+
+struct OrderStatisticsOptions : AVLTreeOptions {
+    static constexpr bool order_statistics = true;
+};
+
+struct MultisetOptions : AVLTreeOptions {
+    static constexpr bool multiset = true;
+};
+
+struct KeyPrefixOptions : AVLTreeOptions {
+    static constexpr bool key_prefix = true;
+};
+
+// The first eight bytes of s, big-endian and zero-padded. Comparing two
+// prefixes as integers orders the strings like std::string::compare does
+// whenever the prefixes differ.
+inline uint64_t keyPrefix(string_view s) {
+    uint64_t prefix = 0;
+    size_t n = s.size() < 8 ? s.size() : 8;
+    for (size_t i = 0; i < 8; ++i)
+        prefix = prefix << 8 | (i < n ? static_cast<unsigned char>(s[i]) : 0);
+    return prefix;
+}
+
+inline uint64_t keyPrefix(const string &key) {
+    return keyPrefix(string_view(key));
+}
+
+template <typename V>
+uint64_t keyPrefix(const pair<const string, V> &value) {
+    return keyPrefix(string_view(value.first));
+}
+
+// The operand an element contributes to an aggregate: its mapped value in
+// map mode and its key in set mode
+template <typename V>
+const V &aggregateOperand(const V &value) {
+    return value;
+}
+
+template <typename K, typename M>
+const M &aggregateOperand(const pair<const K, M> &value) {
+    return value.second;
+}
+
+// Sum of the operands in a subtree
+template <typename T>
+struct SumAggregate {
+    using type = T;
+
+    static type identity() {
+        return T();
+    }
+
+    template <typename V>
+    static type lift(const V &value) {
+        return aggregateOperand(value);
+    }
+
+    static type combine(const type &a, const type &b) {
+        return a + b;
+    }
+};
+
+// Smallest operand in a subtree
+template <typename T>
+struct MinAggregate {
+    using type = T;
+
+    static type identity() {
+        return numeric_limits<T>::max();
+    }
+
+    template <typename V>
+    static type lift(const V &value) {
+        return aggregateOperand(value);
+    }
+
+    static type combine(const type &a, const type &b) {
+        return b < a ? b : a;
+    }
+};
+
+// Largest operand in a subtree
+template <typename T>
+struct MaxAggregate {
+    using type = T;
+
+    static type identity() {
+        return numeric_limits<T>::lowest();
+    }
+
+    template <typename V>
+    static type lift(const V &value) {
+        return aggregateOperand(value);
+    }
+
+    static type combine(const type &a, const type &b) {
+        return a < b ? b : a;
+    }
+};
+
+// Set AVL_TREE_STATS to 1 to have AVLTree count rotations, comparisons,
+// descent depths and retrace lengths. At 0, the default, every hook compiles
+// to nothing.
+#ifndef AVL_TREE_STATS
+#define AVL_TREE_STATS 0
+#endif
+
+// Totals of the AVLTree hot-path counters, as returned by AVLTree::stats()
+struct AVLTreeStats {
+    static constexpr int kDepthBuckets = 64;
+
+    // Counter slots recorded per thread
+    enum Counter {
+        kInserts,
+        kRemoves,
+        kSearches,
+        kComparisons,
+        kRotationsLL,
+        kRotationsLR,
+        kRotationsRR,
+        kRotationsRL,
+        kRetraces,
+        kRetraceSteps,
+        kDepth,
+        kCounters = kDepth + kDepthBuckets
+    };
+
+    uint64_t inserts = 0;
+    uint64_t removes = 0;
+    uint64_t searches = 0;
+    // Key comparisons made while descending
+    uint64_t comparisons = 0;
+    // Rebalancing cases: a left-left imbalance takes one right rotation, a
+    // left-right imbalance a double rotation, and so on
+    uint64_t rotations_ll = 0;
+    uint64_t rotations_lr = 0;
+    uint64_t rotations_rr = 0;
+    uint64_t rotations_rl = 0;
+    // Retraces after inserts and removes, and the nodes they adjusted
+    uint64_t retraces = 0;
+    uint64_t retrace_steps = 0;
+    // Operations by the depth at which their descent stopped
+    uint64_t depth[kDepthBuckets] = {};
+
+    uint64_t operations() const {
+        return inserts + removes + searches;
+    }
+
+    uint64_t rotations() const {
+        return rotations_ll + rotations_lr + rotations_rr + rotations_rl;
+    }
+};
+
+#if AVL_TREE_STATS
+// Per-thread counter blocks behind AVLTree::stats(). Only the owning thread
+// writes a block, with a relaxed load and store instead of a locked
+// increment, so recording costs a few plain instructions; readers sum all
+// blocks. A thread's totals are folded into a shared block when it exits.
+class AVLTreeStatsRecorder {
+private:
+    static constexpr int kCounters = AVLTreeStats::kCounters;
+
+    struct Block {
+        atomic<uint64_t> counters[kCounters] = {};
+    };
+
+    struct Registry {
+        mutex lock;
+        vector<Block *> live;
+        Block exited;
+        // Totals at the last reset(), subtracted from every snapshot
+        uint64_t baseline[kCounters] = {};
+    };
+
+    static Registry &registry() {
+        static Registry *instance = new Registry();
+        return *instance;
+    }
+
+    // Registers the calling thread's block, and folds it into the exited
+    // totals when the thread ends
+    struct ThreadBlock {
+        Block block;
+
+        ThreadBlock() {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            r.live.push_back(&block);
+        }
+
+        ~ThreadBlock() {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            for (int i = 0; i < kCounters; ++i)
+                r.exited.counters[i].fetch_add(block.counters[i].load(memory_order_relaxed), memory_order_relaxed);
+            r.live.erase(find(r.live.begin(), r.live.end(), &block));
+        }
+    };
+
+    static Block &local() {
+        static thread_local ThreadBlock block;
+        return block.block;
+    }
+
+    // Sums every block into totals; the registry lock must be held
+    static void sum(Registry &r, uint64_t totals[]) {
+        for (int i = 0; i < kCounters; ++i)
+            totals[i] = r.exited.counters[i].load(memory_order_relaxed);
+        for (Block *block : r.live)
+            for (int i = 0; i < kCounters; ++i)
+                totals[i] += block->counters[i].load(memory_order_relaxed);
+    }
+
+public:
+    static void add(int counter, uint64_t n = 1) {
+        atomic<uint64_t> &c = local().counters[counter];
+        c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    static AVLTreeStats snapshot() {
+        Registry &r = registry();
+        uint64_t totals[kCounters];
+        {
+            lock_guard<mutex> guard(r.lock);
+            sum(r, totals);
+            for (int i = 0; i < kCounters; ++i)
+                totals[i] -= r.baseline[i];
+        }
+
+        AVLTreeStats stats;
+        stats.inserts = totals[AVLTreeStats::kInserts];
+        stats.removes = totals[AVLTreeStats::kRemoves];
+        stats.searches = totals[AVLTreeStats::kSearches];
+        stats.comparisons = totals[AVLTreeStats::kComparisons];
+        stats.rotations_ll = totals[AVLTreeStats::kRotationsLL];
+        stats.rotations_lr = totals[AVLTreeStats::kRotationsLR];
+        stats.rotations_rr = totals[AVLTreeStats::kRotationsRR];
+        stats.rotations_rl = totals[AVLTreeStats::kRotationsRL];
+        stats.retraces = totals[AVLTreeStats::kRetraces];
+        stats.retrace_steps = totals[AVLTreeStats::kRetraceSteps];
+        for (int i = 0; i < AVLTreeStats::kDepthBuckets; ++i)
+            stats.depth[i] = totals[AVLTreeStats::kDepth + i];
+        return stats;
+    }
+
+    static void reset() {
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        sum(r, r.baseline);
+    }
+};
+#endif
+
+// Optional subtree-size field; empty unless order statistics are enabled
+template <bool Enabled>
+struct AVLNodeSize {};
+
+template <>
+struct AVLNodeSize<true> {
+    size_t size = 1;
+};
+
+// Optional occurrence count; empty unless multiset mode is enabled
+template <bool Enabled>
+struct AVLNodeCount {};
+
+template <>
+struct AVLNodeCount<true> {
+    size_t count = 1;
+};
+
+// Optional cached key prefix; empty unless the prefix cache is enabled
+template <bool Enabled>
+struct AVLNodePrefix {};
+
+template <>
+struct AVLNodePrefix<true> {
+    uint64_t prefix = 0;
+};
+
+// Optional subtree aggregate; empty unless an aggregate policy is set
+template <typename Aggregate>
+struct AVLNodeAggregate {
+    typename Aggregate::type aggregate;
+};
+
+template <>
+struct AVLNodeAggregate<NoAggregate> {};
+
+// Node structure for the AVL Tree. Instead of its height, a node stores the
+// balance factor height(left) - height(right), which always fits in an
+// int8_t; with 32-bit keys and 64-bit pointers the node packs into 24 bytes.
+// The payload is constructed in place from whatever arguments the tree
+// forwards, so it is never copied or moved once the node exists.
+template <typename T, typename Options = AVLTreeOptions>
+struct AVLNode : AVLNodeSize<Options::order_statistics>,
+                 AVLNodeCount<Options::multiset>,
+                 AVLNodePrefix<Options::key_prefix>,
+                 AVLNodeAggregate<typename Options::aggregate> {
+    AVLNode *left;
+    AVLNode *right;
+    T value;
+    int8_t balance;
+
+    template <typename... Args>
+    explicit AVLNode(Args &&...args)
+        : left(nullptr), right(nullptr), value(std::forward<Args>(args)...), balance(0) {
+        if constexpr (Options::key_prefix)
+            this->prefix = keyPrefix(value);
+        if constexpr (!is_same<typename Options::aggregate, NoAggregate>::value)
+            this->aggregate = Options::aggregate::lift(value);
+    }
+};
+
+// Slab allocator for tree nodes. Nodes are carved out of contiguous chunks
+// obtained from an upstream memory resource, freed nodes are threaded onto
+// a free list and handed out again before any new chunk is requested, and
+// release() returns every chunk to the upstream resource at once.
+template <typename Node>
+class NodePool {
+private:
+    union Slot {
+        Slot *next;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    // Every chunk starts with this header, followed by its slots. Chunks
+    // remember their resource because merge() can move them between pools.
+    struct Chunk {
+        Chunk *next;
+        std::pmr::memory_resource *upstream;
+        size_t bytes;
+    };
+
+    static constexpr size_t kChunkAlign = alignof(Chunk) > alignof(Slot) ? alignof(Chunk) : alignof(Slot);
+    static constexpr size_t kHeaderSize = (sizeof(Chunk) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+    static constexpr size_t kMinChunkNodes = 64;
+    static constexpr size_t kMaxChunkNodes = 64 * 1024;
+
+    std::pmr::memory_resource *upstream;
+    Chunk *chunks;
+    Slot *freeList;
+    Slot *cursor;
+    Slot *limit;
+    size_t nextChunkNodes;
+    size_t reserved;
+    shared_ptr<NodePool> forward;
+    // Whole subtrees handed over by retire(). Their nodes still hold their
+    // links and are taken apart one slot at a time once the free list is
+    // empty.
+    vector<Node *> retired;
+
+    // Takes the next node out of the last retired subtree: left children are
+    // rotated onto its right spine until the top node has none, and that
+    // node is removed. Every node is rotated at most once, so a slot costs
+    // amortized O(1).
+    void *takeRetired() {
+        Node *&top = retired.back();
+        while (Node *left = top->left) {
+            top->left = left->right;
+            left->right = top;
+            top = left;
+        }
+        Node *node = top;
+        top = node->right;
+        if (top == nullptr)
+            retired.pop_back();
+        node->~Node();
+        return node;
+    }
+
+    // Requests a new chunk from upstream; chunk sizes double up to kMaxChunkNodes
+    void grow() {
+        size_t count = nextChunkNodes;
+        size_t bytes = kHeaderSize + count * sizeof(Slot);
+        Chunk *chunk = static_cast<Chunk *>(upstream->allocate(bytes, kChunkAlign));
+        chunk->next = chunks;
+        chunk->upstream = upstream;
+        chunk->bytes = bytes;
+        chunks = chunk;
+        reserved += bytes;
+
+        cursor = reinterpret_cast<Slot *>(reinterpret_cast<unsigned char *>(chunk) + kHeaderSize);
+        limit = cursor + count;
+        nextChunkNodes = min(count * 2, kMaxChunkNodes);
+    }
+
+    // Takes over every chunk and slot of other, leaving it empty
+    void steal(NodePool &other) {
+        upstream = other.upstream;
+        chunks = other.chunks;
+        freeList = other.freeList;
+        cursor = other.cursor;
+        limit = other.limit;
+        nextChunkNodes = other.nextChunkNodes;
+        reserved = other.reserved;
+        forward = std::move(other.forward);
+        retired = std::move(other.retired);
+
+        other.chunks = nullptr;
+        other.freeList = other.cursor = other.limit = nullptr;
+        other.nextChunkNodes = kMinChunkNodes;
+        other.reserved = 0;
+    }
+
+public:
+    /**
+     * @brief Constructs an empty pool that draws its chunks from upstream.
+     * @param upstream The memory resource that supplies chunks; any user-supplied
+     *        std::pmr::memory_resource can be passed here.
+     */
+    explicit NodePool(std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+        : upstream(upstream), chunks(nullptr), freeList(nullptr), cursor(nullptr),
+          limit(nullptr), nextChunkNodes(kMinChunkNodes), reserved(0) {}
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+
+    NodePool(NodePool &&other) noexcept {
+        steal(other);
+    }
+
+    NodePool &operator=(NodePool &&other) noexcept {
+        if (this != &other) {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    ~NodePool() {
+        release();
+    }
+
+    /**
+     * @brief Constructs a node in a free slot, reusing freed slots first.
+     * @param args Arguments forwarded to the node constructor.
+     * @note Time Complexity: Amortized O(1).
+     */
+    template <typename... Args>
+    Node *create(Args &&...args) {
+        void *slot;
+        if (freeList != nullptr) {
+            slot = freeList;
+            freeList = freeList->next;
+        } else if (!retired.empty()) {
+            slot = takeRetired();
+        } else {
+            if (cursor == limit)
+                grow();
+            slot = cursor++;
+        }
+
+        try {
+            return new (slot) Node(std::forward<Args>(args)...);
+        } catch (...) {
+            Slot *s = static_cast<Slot *>(slot);
+            s->next = freeList;
+            freeList = s;
+            throw;
+        }
+    }
+
+    /**
+     * @brief Returns uninitialized storage for count nodes laid out contiguously
+     *        in a dedicated chunk. Each slot must be constructed with placement
+     *        new, and is later returned through destroy() or deallocate().
+     * @note Time Complexity: O(1) plus the cost of the upstream allocation.
+     */
+    Node *allocateRun(size_t count) {
+        static_assert(sizeof(Slot) == sizeof(Node), "node slots must be contiguous nodes");
+        size_t bytes = kHeaderSize + count * sizeof(Slot);
+        Chunk *chunk = static_cast<Chunk *>(upstream->allocate(bytes, kChunkAlign));
+        chunk->next = chunks;
+        chunk->upstream = upstream;
+        chunk->bytes = bytes;
+        chunks = chunk;
+        reserved += bytes;
+        return reinterpret_cast<Node *>(reinterpret_cast<unsigned char *>(chunk) + kHeaderSize);
+    }
+
+    /**
+     * @brief Puts the slot of an already destroyed or never constructed node on
+     *        the free list.
+     * @note Time Complexity: O(1).
+     */
+    void deallocate(Node *node) {
+        Slot *slot = reinterpret_cast<Slot *>(node);
+        slot->next = freeList;
+        freeList = slot;
+    }
+
+    /**
+     * @brief Destroys a node and puts its slot on the free list.
+     * @note Time Complexity: O(1).
+     */
+    void destroy(Node *node) {
+        node->~Node();
+        deallocate(node);
+    }
+
+    /**
+     * @brief Hands over a whole subtree, linked through the left and right
+     *        members of its nodes, without visiting it. Its slots are reused
+     *        by later calls to create() when the free list is empty. The
+     *        payloads must be trivially destructible.
+     * @note Time Complexity: O(1).
+     */
+    void retire(Node *root) {
+        static_assert(is_trivially_destructible<Node>::value, "retired nodes are never destroyed one by one");
+        if (root != nullptr)
+            retired.push_back(root);
+    }
+
+    /**
+     * @brief Returns every chunk to the upstream resource. All nodes handed out
+     *        by this pool become invalid; their destructors are not run.
+     * @note Time Complexity: O(c), where c is the number of chunks.
+     */
+    void release() {
+        while (chunks != nullptr) {
+            Chunk *next = chunks->next;
+            chunks->upstream->deallocate(chunks, chunks->bytes, kChunkAlign);
+            chunks = next;
+        }
+        freeList = cursor = limit = nullptr;
+        retired.clear();
+        nextChunkNodes = kMinChunkNodes;
+        reserved = 0;
+    }
+
+    /**
+     * @brief Moves every chunk and free slot of from into into, and leaves
+     *        from forwarding to into. Trees whose nodes live in either pool
+     *        keep working, and into stays alive for as long as from does. Both
+     *        pools must be distinct and not forwarding themselves.
+     * @note Time Complexity: O(c + f + r) for the chunks, free slots and
+     *       retired subtrees of from.
+     *       The untouched tail of from's current chunk is not reused.
+     */
+    static void merge(const shared_ptr<NodePool> &into, const shared_ptr<NodePool> &from) {
+        NodePool &a = *into;
+        NodePool &b = *from;
+
+        if (b.chunks != nullptr) {
+            Chunk *tail = b.chunks;
+            while (tail->next != nullptr)
+                tail = tail->next;
+            tail->next = a.chunks;
+            a.chunks = b.chunks;
+        }
+        if (b.freeList != nullptr) {
+            Slot *tail = b.freeList;
+            while (tail->next != nullptr)
+                tail = tail->next;
+            tail->next = a.freeList;
+            a.freeList = b.freeList;
+        }
+        a.reserved += b.reserved;
+        a.retired.insert(a.retired.end(), b.retired.begin(), b.retired.end());
+        b.retired.clear();
+
+        b.chunks = nullptr;
+        b.freeList = b.cursor = b.limit = nullptr;
+        b.reserved = 0;
+        b.forward = into;
+    }
+
+    /**
+     * @brief Follows the forwarding left by merge(), updating p to point at
+     *        the pool that now owns the nodes, and returns that pool.
+     */
+    static NodePool &resolve(shared_ptr<NodePool> &p) {
+        while (p->forward)
+            p = p->forward;
+        return *p;
+    }
+
+    static const NodePool &resolve(const shared_ptr<NodePool> &p) {
+        const NodePool *pool = p.get();
+        while (pool->forward)
+            pool = pool->forward.get();
+        return *pool;
+    }
+
+    /**
+     * @brief Returns the number of bytes currently obtained from upstream.
+     */
+    size_t bytesReserved() const {
+        return reserved;
+    }
+};
+
+// Describes what a tree node stores for a given mapped type: std::pair<const
+// Key, Value> for maps, and the bare key when Value is void (set mode).
+template <typename Key, typename Value>
+struct AVLTreeValue {
+    using type = pair<const Key, Value>;
+
+    // Also accepts pair-like inputs such as std::pair<Key, Value>
+    template <typename P>
+    static const Key &key(const P &value) {
+        return value.first;
+    }
+};
+
+template <typename Key>
+struct AVLTreeValue<Key, void> {
+    using type = Key;
+
+    static const Key &key(const type &value) {
+        return value;
+    }
+};
+
+// Fork-join scheduler with one task deque per worker thread. A worker pushes
+// and pops forked tasks at the back of its own deque, idle workers steal from
+// the front of the others', and a thread waiting for a stolen task runs other
+// tasks meanwhile. Any type with the same parallel_invoke member can stand in
+// for it as the executor of the parallel set operations.
+class WorkStealingPool {
+private:
+    struct Task {
+        function<void()> run;
+        bool external = false;
+        atomic<bool> done{false};
+        exception_ptr error;
+    };
+
+    struct Queue {
+        mutex lock;
+        deque<Task *> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> workers;
+    atomic<size_t> queued;
+    mutex sleepLock;
+    condition_variable wake;
+    bool stopping;
+
+    static inline thread_local WorkStealingPool *currentPool = nullptr;
+    static inline thread_local size_t currentIndex = 0;
+
+    void push(size_t index, Task *task) {
+        {
+            lock_guard<mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back(task);
+        }
+        queued.fetch_add(1);
+        lock_guard<mutex> guard(sleepLock);
+        wake.notify_one();
+    }
+
+    // Takes task back from the end of the given deque if no thief got it
+    bool reclaim(size_t index, Task *task) {
+        lock_guard<mutex> guard(queues[index]->lock);
+        deque<Task *> &tasks = queues[index]->tasks;
+        if (tasks.empty() || tasks.back() != task)
+            return false;
+        tasks.pop_back();
+        queued.fetch_sub(1);
+        return true;
+    }
+
+    // Pops from the back of the worker's own deque, else steals from the
+    // front of another one
+    Task *findTask(size_t self, bool ownQueue) {
+        size_t n = queues.size();
+        for (size_t k = ownQueue ? 0 : 1; k < n; ++k) {
+            Queue &queue = *queues[(self + k) % n];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+
+            Task *task;
+            if (k == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            queued.fetch_sub(1);
+            return task;
+        }
+        return nullptr;
+    }
+
+    // Runs task and marks it done. A thread outside the pool sleeps until its
+    // task is done, so completion is published under sleepLock; the task may
+    // be gone as soon as done is set.
+    void execute(Task *task) {
+        bool external = task->external;
+        try {
+            task->run();
+        } catch (...) {
+            task->error = current_exception();
+        }
+        if (!external) {
+            task->done.store(true, memory_order_release);
+            return;
+        }
+        lock_guard<mutex> guard(sleepLock);
+        task->done.store(true, memory_order_release);
+        wake.notify_all();
+    }
+
+    void workerLoop(size_t index) {
+        currentPool = this;
+        currentIndex = index;
+        while (true) {
+            if (Task *task = findTask(index, true)) {
+                execute(task);
+                continue;
+            }
+
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [&] { return stopping || queued.load() > 0; });
+            if (stopping)
+                return;
+        }
+    }
+
+public:
+    /**
+     * @brief Starts a pool with the given number of worker threads.
+     */
+    explicit WorkStealingPool(size_t threads = thread::hardware_concurrency()) : queued(0), stopping(false) {
+        threads = max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i)
+            queues.push_back(make_unique<Queue>());
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    /**
+     * @brief Returns a process-wide pool with one worker per hardware thread.
+     */
+    static WorkStealingPool &shared() {
+        static WorkStealingPool pool;
+        return pool;
+    }
+
+    /**
+     * @brief Runs f on a worker of this pool and blocks until it returns,
+     *        rethrowing any exception it throws.
+     */
+    template <typename F>
+    void run(F &&f) {
+        if (currentPool == this) {
+            f();
+            return;
+        }
+
+        Task task;
+        task.run = [&f] { f(); };
+        task.external = true;
+        push(0, &task);
+        {
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [&] { return task.done.load(memory_order_acquire); });
+        }
+        if (task.error)
+            rethrow_exception(task.error);
+    }
+
+    /**
+     * @brief Runs f1 and f2, possibly in parallel, and returns once both have
+     *        finished. f2 is offered to thieves while the caller runs f1.
+     */
+    template <typename F1, typename F2>
+    void parallel_invoke(F1 &&f1, F2 &&f2) {
+        if (currentPool != this) {
+            run([&] { parallel_invoke(f1, f2); });
+            return;
+        }
+
+        Task task;
+        task.run = [&f2] { f2(); };
+        size_t self = currentIndex;
+        push(self, &task);
+
+        exception_ptr error;
+        try {
+            f1();
+        } catch (...) {
+            error = current_exception();
+        }
+
+        if (reclaim(self, &task)) {
+            execute(&task);
+        } else {
+            while (!task.done.load(memory_order_acquire)) {
+                if (Task *other = findTask(self, false))
+                    execute(other);
+                else
+                    this_thread::yield();
+            }
+        }
+
+        if (error)
+            rethrow_exception(error);
+        if (task.error)
+            rethrow_exception(task.error);
+    }
+};
+
+// Background thread that runs teardown jobs, such as the ones queued by
+// AVLTree::clear_async(), one at a time in submission order. The thread is
+// started by the first job, and jobs still queued at exit are finished before
+// the shared instance is destroyed.
+class BackgroundReclaimer {
+private:
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    deque<function<void()>> jobs;
+    bool busy = false;
+    bool stopping = false;
+    thread worker;
+
+    void workerLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            guard.unlock();
+            job();
+            // Captured state is released outside the lock too
+            job = nullptr;
+            guard.lock();
+            busy = false;
+            if (jobs.empty())
+                idle.notify_all();
+        }
+    }
+
+public:
+    BackgroundReclaimer() = default;
+    BackgroundReclaimer(const BackgroundReclaimer &) = delete;
+    BackgroundReclaimer &operator=(const BackgroundReclaimer &) = delete;
+
+    ~BackgroundReclaimer() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    /**
+     * @brief Returns the process-wide reclaimer used by AVLTree.
+     */
+    static BackgroundReclaimer &shared() {
+        static BackgroundReclaimer instance;
+        return instance;
+    }
+
+    /**
+     * @brief Queues job to run on the background thread.
+     * @note Time Complexity: O(1).
+     */
+    void submit(function<void()> job) {
+        lock_guard<mutex> guard(lock);
+        if (!worker.joinable())
+            worker = thread([this] { workerLoop(); });
+        jobs.push_back(std::move(job));
+        wake.notify_one();
+    }
+
+    /**
+     * @brief Waits until every job submitted so far has finished.
+     */
+    void drain() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [&] { return jobs.empty() && !busy; });
+    }
+};
+
+// Binary snapshot format shared by AVLTree::save(), AVLTree::load() and
+// MappedAVLTree. A fixed header is followed by one fixed-size record per node
+// in pre-order, so the root is record 0 and every child comes after its
+// parent. Children are referenced by record index and each record keeps its
+// node's balance factor, which makes the file directly searchable and lets
+// load() restore the saved shape without rebalancing. Records are stored in
+// host byte order; the header records enough to reject foreign files.
+struct AVLSnapshotFormat {
+    static constexpr char kMagic[8] = {'A', 'V', 'L', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kByteOrder = 0x01020304;
+    // Child index meaning "no child"
+    static constexpr uint32_t kNone = ~uint32_t(0);
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t recordSize;
+        uint64_t count;
+        // Checksum of the record bytes
+        uint64_t checksum;
+    };
+
+    // FNV-1a over 64-bit words, with the tail bytes folded in one by one
+    static uint64_t checksum(const void *data, size_t bytes) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        uint64_t hash = 14695981039346656037ull;
+        for (; bytes >= 8; p += 8, bytes -= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+        for (; bytes > 0; ++p, --bytes)
+            hash = (hash ^ *p) * 1099511628211ull;
+        return hash;
+    }
+
+    // Syncs the directory holding path, which makes a rename into it durable
+    static bool syncDirectory(const string &path) {
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            return false;
+        bool ok = ::fsync(fd) == 0;
+        return ::close(fd) == 0 && ok;
+    }
+
+    // Writes header and records to a temporary file that is synced and then
+    // renamed over path, so readers see either the old or the new snapshot.
+    // The directory is synced too, so the rename survives a crash.
+    static void writeFile(const string &path, const Header &header, const void *records, size_t bytes) {
+        string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw runtime_error("AVLTree::save: cannot create " + temp);
+        bool ok = writeAll(fd, &header, sizeof(header)) && writeAll(fd, records, bytes) && ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        if (!ok || ::rename(temp.c_str(), path.c_str()) != 0) {
+            ::unlink(temp.c_str());
+            throw runtime_error("AVLTree::save: cannot write " + path);
+        }
+        if (!syncDirectory(path))
+            throw runtime_error("AVLTree::save: cannot sync the directory of " + path);
+    }
+
+    static bool writeAll(int fd, const void *data, size_t bytes) {
+        const char *p = static_cast<const char *>(data);
+        while (bytes > 0) {
+            ssize_t written = ::write(fd, p, bytes);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            p += written;
+            bytes -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+};
+
+// One node of a binary snapshot: the key, the mapped value in map mode, the
+// record indices of both children and the node's balance factor
+template <typename Key, typename Value>
+struct AVLSnapshotRecord {
+    Key key;
+    Value mapped;
+    uint32_t left;
+    uint32_t right;
+    int8_t balance;
+};
+
+template <typename Key>
+struct AVLSnapshotRecord<Key, void> {
+    Key key;
+    uint32_t left;
+    uint32_t right;
+    int8_t balance;
+};
+
+template <typename Key, typename Value, typename Compare>
+class MappedAVLTree;
+
+template <typename Key, typename Value, typename Compare>
+class FrozenAVLTree;
+
+/**
+ * @brief AVL tree over keys ordered by Compare. With Value = void it is a set
+ *        of keys; otherwise every key carries a mapped Value stored in the same
+ *        node, so one lookup reaches both.
+ */
+template <typename Key = int, typename Value = void, typename Compare = std::less<Key>,
+          typename Options = AVLTreeOptions>
+class AVLTree {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = typename AVLTreeValue<Key, Value>::type;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+private:
+    using Node = AVLNode<value_type, Options>;
+    using Values = AVLTreeValue<Key, Value>;
+
+    using Aggregate = typename Options::aggregate;
+
+    static constexpr bool kOrderStatistics = Options::order_statistics;
+    static constexpr bool kAggregated = !is_same<Aggregate, NoAggregate>::value;
+    static constexpr bool kAugmented = kOrderStatistics || kAggregated;
+    // An aggregate may read the mapped value, so an aggregated map hands out
+    // its elements read-only; modify() and insert_or_assign() update a value
+    // and recompute the aggregates above it
+    static constexpr bool kReadOnlyMapped = kAggregated && !is_void<Value>::value;
+    using ElementPointer = conditional_t<kReadOnlyMapped, const value_type *, value_type *>;
+    static constexpr bool kMultiset = Options::multiset;
+    static_assert(!kMultiset || is_void<Value>::value, "multiset mode requires set mode");
+    static constexpr bool kKeyPrefix = Options::key_prefix;
+    static_assert(!kKeyPrefix || (is_same<Key, string>::value &&
+                                  (is_same<Compare, less<string>>::value || is_same<Compare, less<>>::value)),
+                  "the key prefix cache needs std::string keys in std::less order");
+
+    // Enables the heterogeneous lookup overloads for lookup types other than
+    // Key when the comparator declares is_transparent
+    template <typename C, typename = void>
+    struct IsTransparent : false_type {};
+    template <typename C>
+    struct IsTransparent<C, void_t<typename C::is_transparent>> : true_type {};
+    template <typename K>
+    using Transparent = typename enable_if<IsTransparent<Compare>::value && !is_same<K, Key>::value>::type;
+
+    // AVL height is below 1.44 log2(n + 2). Nodes take at least 24 bytes, so
+    // no tree in a 48-bit address space can be deeper than this.
+    static constexpr int kMaxHeight = 64;
+
+    // Ranges smaller than this are never handed to another thread
+    static constexpr size_t kParallelGrain = 1 << 16;
+
+    using Pool = NodePool<Node>;
+
+    // Trees carved out of one another by split() share their pool, so the
+    // pool lives as long as any of them
+    Node *root;
+    shared_ptr<Pool> pool;
+    // After split() the element count of each part is only computed on
+    // demand; sizeKnown tells whether nodeCount is current
+    mutable size_t nodeCount;
+    mutable bool sizeKnown;
+    Compare comp;
+    // Changes whenever nodes are added, removed or relinked; cursors use it
+    // to notice that their saved path may be stale
+    uint64_t version = 0;
+
+    // Right spine kept for append(): links[0] is the root link, each further
+    // link is the right link of the node behind the previous one, and
+    // links[depth] is the empty link past the maximum. Only valid while
+    // version matches the tree's. Allocated on the first append.
+    struct RightSpine {
+        Node **links[kMaxHeight + 1];
+        int depth;
+        uint64_t version;
+    };
+    unique_ptr<RightSpine> spine;
+
+    // Returns the pool that owns this tree's nodes, creating it on first use
+    Pool &nodePool() {
+        if (!pool)
+            pool = make_shared<Pool>();
+        return Pool::resolve(pool);
+    }
+
+    // Helper function to get the key stored in a node
+    static const Key &keyOf(const Node *node) {
+        return Values::key(node->value);
+    }
+
+    // Get balance factor of a node N
+    int getBalance(Node *N) {
+        if (N == nullptr)
+            return 0;
+        return N->balance;
+    }
+
+    // Helper function to get the number of nodes below and including N
+    static size_t subtreeSize(const Node *N) {
+        if constexpr (kOrderStatistics) {
+            return N ? N->size : 0;
+        } else {
+            return 0;
+        }
+    }
+
+    // Helper function to get how often the key of N occurs; always 1 unless
+    // in multiset mode
+    static size_t occurrences(const Node *N) {
+        if constexpr (kMultiset) {
+            return N->count;
+        } else {
+            return 1;
+        }
+    }
+
+    // Helper function to get the aggregate of the subtree rooted with N
+    template <typename A = Aggregate>
+    static typename A::type subtreeAggregate(const Node *N) {
+        return N ? N->aggregate : A::identity();
+    }
+
+    // Recomputes the augmented fields of N from its children; a no-op when no
+    // augmentation is enabled
+    static void updateAugment(Node *N) {
+        if constexpr (kOrderStatistics)
+            N->size = occurrences(N) + subtreeSize(N->left) + subtreeSize(N->right);
+        if constexpr (kAggregated)
+            N->aggregate = Aggregate::combine(Aggregate::combine(subtreeAggregate(N->left), Aggregate::lift(N->value)),
+                                              subtreeAggregate(N->right));
+    }
+
+    // Recomputes the aggregates of node, whose value changed in place, and of
+    // the depth nodes on the path above it
+    static void reaggregatePath(Node **const *path, int depth, Node *node) {
+        if constexpr (kAggregated) {
+            updateAugment(node);
+            while (depth > 0)
+                updateAugment(*path[--depth]);
+        } else {
+            (void)path;
+            (void)depth;
+            (void)node;
+        }
+    }
+
+    using Stat = AVLTreeStats;
+
+    // Adds n to a hot-path counter; compiles to nothing unless AVL_TREE_STATS
+    // is set
+    static void countStat(int counter, uint64_t n = 1) {
+#if AVL_TREE_STATS
+        AVLTreeStatsRecorder::add(counter, n);
+#else
+        (void)counter;
+        (void)n;
+#endif
+    }
+
+    // Records the comparisons and final depth of one descent
+    static void countDescent(int comparisons, int depth) {
+        countStat(Stat::kComparisons, comparisons);
+        countStat(Stat::kDepth + min(depth, Stat::kDepthBuckets - 1));
+    }
+
+    // Records one retrace that adjusted steps nodes
+    static void countRetrace(int steps) {
+        countStat(Stat::kRetraces);
+        countStat(Stat::kRetraceSteps, steps);
+    }
+
+    // Right rotate subtree rooted with y
+    //       y                               x
+    //      / \                             /   \
+    //     x   T3  -> Right Rotate (y) ->  T1    y
+    //    / \                                   / \
+    //   T1  T2                                T2  T3
+    // returns x, the new root of the subtree. The balance factors of x and y
+    // are derived from their old values, without looking at T1, T2 or T3.
+    Node *rightRotate(Node *y) {
+        Node *x = y->left;
+        Node *T2 = x->right;
+
+        x->right = y;
+        y->left = T2;
+
+        y->balance = y->balance - 1 - max<int>(x->balance, 0);
+        x->balance = x->balance - 1 + min<int>(y->balance, 0);
+
+        updateAugment(y);
+        updateAugment(x);
+
+        return x;
+    }
+
+    // Left rotate subtree rooted with x
+    //     x                               y
+    //    / \                             /   \
+    //   T1  y   -> Left Rotate (x) ->   x     T3
+    //      / \                         / \
+    //     T2  T3                      T1  T2
+    // returns y, the new root of the subtree. The balance factors of x and y
+    // are derived from their old values, without looking at T1, T2 or T3.
+    Node *leftRotate(Node *x) {
+        Node *y = x->right;
+        Node *T2 = y->left;
+
+        y->left = x;
+        x->right = T2;
+
+        x->balance = x->balance + 1 - min<int>(y->balance, 0);
+        y->balance = y->balance + 1 + max<int>(x->balance, 0);
+
+        updateAugment(x);
+        updateAugment(y);
+
+        return y;
+    }
+
+    // Rebalances a node whose balance factor reached +2 or -2 and returns
+    // the new root of the subtree. heightDropped is set when the subtree
+    // ends up one level shorter than it was before the rotation.
+    Node *rebalance(Node *node, bool &heightDropped) {
+        if (node->balance > 1) {
+            int childBalance = getBalance(node->left);
+            heightDropped = childBalance != 0;
+            countStat(childBalance < 0 ? Stat::kRotationsLR : Stat::kRotationsLL);
+            if (childBalance < 0)
+                node->left = leftRotate(node->left);
+            return rightRotate(node);
+        }
+
+        int childBalance = getBalance(node->right);
+        heightDropped = childBalance != 0;
+        countStat(childBalance > 0 ? Stat::kRotationsRL : Stat::kRotationsRR);
+        if (childBalance > 0)
+            node->right = rightRotate(node->right);
+        return leftRotate(node);
+    }
+
+    // Walks back up the recorded path after the subtree behind link changed
+    // height (grew by one on insertion, shrank by one on deletion), adjusting
+    // balance factors and rotating where needed. Stops as soon as a subtree
+    // keeps its height, and writes a link only when its subtree root changed.
+    // Augmented fields are still refreshed on the rest of the path above.
+    // Returns the index in path of the last link visited; links above it
+    // were left untouched.
+    int retrace(Node **path[], int depth, Node **changed, bool grew) {
+        int start = depth;
+        while (depth > 0) {
+            Node **link = path[--depth];
+            Node *node = *link;
+
+            bool fromLeft = changed == &node->left;
+            node->balance += fromLeft == grew ? 1 : -1;
+
+            bool heightChanged;
+            if (node->balance > 1 || node->balance < -1) {
+                bool heightDropped;
+                *link = rebalance(node, heightDropped);
+                heightChanged = !grew && heightDropped;
+            } else {
+                updateAugment(node);
+                heightChanged = grew ? node->balance != 0 : node->balance == 0;
+            }
+
+            if (!heightChanged)
+                break;
+            changed = link;
+        }
+        countRetrace(start - depth);
+        int stop = depth;
+
+        if constexpr (kAugmented) {
+            while (depth > 0)
+                updateAugment(*path[--depth]);
+        }
+        return stop;
+    }
+
+    // Orders key, whose cached prefix is given, against the key of node:
+    // negative, zero or positive. Only a tie of the prefixes reads the
+    // node's string, and then only past the bytes the prefixes cover.
+    static int orderByPrefix(string_view key, uint64_t prefix, const Node *node) {
+        if (prefix != node->prefix)
+            return prefix < node->prefix ? -1 : 1;
+        string_view other = keyOf(node);
+        if (key.size() >= 8 && other.size() >= 8)
+            return key.substr(8).compare(other.substr(8));
+        return key.compare(other);
+    }
+
+    // Iterative top-down descent towards key. Records the links on the path
+    // and returns the link that holds the node with that key, or the empty
+    // link where such a node belongs.
+    Node **descend(const Key &key, Node **path[], int &depth) {
+        Node **link = &root;
+        int comparisons = 0;
+        if constexpr (kKeyPrefix) {
+            uint64_t prefix = keyPrefix(key);
+            while (*link != nullptr) {
+                Node *node = *link;
+                ++comparisons;
+                int order = orderByPrefix(key, prefix, node);
+                if (order == 0)
+                    break;
+                path[depth++] = link;
+                link = order < 0 ? &node->left : &node->right;
+            }
+            countDescent(comparisons, depth);
+            return link;
+        }
+        while (*link != nullptr) {
+            Node *node = *link;
+            ++comparisons;
+            if (comp(key, keyOf(node))) {
+                path[depth++] = link;
+                link = &node->left;
+            } else if (++comparisons, comp(keyOf(node), key)) {
+                path[depth++] = link;
+                link = &node->right;
+            } else {
+                break;
+            }
+        }
+        countDescent(comparisons, depth);
+        return link;
+    }
+
+    // Hangs a freshly created node on the empty link found by descend and
+    // rebalances the path above it. Returns what retrace returns.
+    int linkNode(Node **path[], int depth, Node **link, Node *node) {
+        *link = node;
+        ++nodeCount;
+        ++version;
+        return retrace(path, depth, link, true);
+    }
+
+    // Counts one more occurrence of the key of node, found at the end of the
+    // descent recorded in path, and refreshes the subtree sizes on the path.
+    // The shape does not change, so cursors and the right spine stay valid.
+    void addOccurrence(Node **path[], int depth, Node *node) {
+        ++node->count;
+        ++nodeCount;
+        updateAugment(node);
+        while (depth > 0)
+            updateAugment(*path[--depth]);
+    }
+
+    // Inserts an already constructed node unless its key is present, in
+    // which case the node is destroyed again (or, in multiset mode, counted)
+    pair<value_type *, bool> emplaceNode(Node *node) {
+        Node **path[kMaxHeight];
+        int depth = 0;
+
+        countStat(Stat::kInserts);
+        Node **link = descend(keyOf(node), path, depth);
+        if (*link != nullptr) {
+            nodePool().destroy(node);
+            if constexpr (kMultiset) {
+                addOccurrence(path, depth, *link);
+                return {&(*link)->value, true};
+            }
+            return {&(*link)->value, false};
+        }
+
+        linkNode(path, depth, link, node);
+        return {&node->value, true};
+    }
+
+    // Rebuilds the cached right spine from the root
+    void refreshSpine() {
+        if (!spine)
+            spine = make_unique<RightSpine>();
+        spine->links[0] = &root;
+        extendSpine(0);
+    }
+
+    // Recomputes the spine below links[from], which must still be valid
+    void extendSpine(int from) {
+        RightSpine &s = *spine;
+        int depth = from;
+        for (Node **link = s.links[from]; *link != nullptr; link = &(*link)->right)
+            s.links[++depth] = &(*link)->right;
+        s.depth = depth;
+        s.version = version;
+    }
+
+    // Iterative insertion that only constructs a node when the key is
+    // absent. Returns the node holding key and whether it was inserted.
+    template <typename K, typename... Args>
+    pair<Node *, bool> insertNode(K &&key, Args &&...args) {
+        Node **path[kMaxHeight];
+        int depth = 0;
+
+        countStat(Stat::kInserts);
+        Node **link = descend(key, path, depth);
+        if (*link != nullptr) {
+            if constexpr (kMultiset) {
+                addOccurrence(path, depth, *link);
+                return {*link, true};
+            }
+            return {*link, false};
+        }
+
+        Node *node = nodePool().create(std::forward<Args>(args)...);
+        linkNode(path, depth, link, node);
+        return {node, true};
+    }
+
+    // Iterative top-down deletion. A node with two children is replaced by
+    // its in-order successor, which is relinked into its place so that no
+    // payload is ever copied. Returns false if the key is not present.
+    bool deleteNode(const Key &key) {
+        Node **path[kMaxHeight];
+        int depth = 0;
+
+        countStat(Stat::kRemoves);
+        Node **link = descend(key, path, depth);
+        Node *target = *link;
+        if (target == nullptr)
+            return false;
+        if constexpr (kMultiset) {
+            if (target->count > 1) {
+                --target->count;
+                --nodeCount;
+                updateAugment(target);
+                while (depth > 0)
+                    updateAugment(*path[--depth]);
+                return true;
+            }
+        }
+
+        if (target->left != nullptr && target->right != nullptr) {
+            int targetDepth = depth;
+            path[depth++] = link;
+
+            Node **successorLink = &target->right;
+            while ((*successorLink)->left != nullptr) {
+                path[depth++] = successorLink;
+                successorLink = &(*successorLink)->left;
+            }
+
+            Node *successor = *successorLink;
+            *successorLink = successor->right;
+
+            successor->left = target->left;
+            successor->right = target->right;
+            successor->balance = target->balance;
+            *link = successor;
+
+            // The successor now owns the links that used to be the target's
+            if (targetDepth + 1 < depth)
+                path[targetDepth + 1] = &successor->right;
+            else
+                successorLink = &successor->right;
+            link = successorLink;
+        } else {
+            *link = target->left ? target->left : target->right;
+        }
+
+        nodePool().destroy(target);
+        --nodeCount;
+        ++version;
+        retrace(path, depth, link, false);
+        return true;
+    }
+
+    // Iterative helper for searching a key, or anything the comparator
+    // orders against keys
+    template <typename K>
+    Node *searchNode(const K &key) const {
+        Node *node = root;
+        int comparisons = 0, depth = 0;
+        countStat(Stat::kSearches);
+        if constexpr (kKeyPrefix) {
+            string_view probe(key);
+            uint64_t prefix = keyPrefix(probe);
+            while (node != nullptr) {
+                ++comparisons;
+                int order = orderByPrefix(probe, prefix, node);
+                if (order == 0)
+                    break;
+                node = order < 0 ? node->left : node->right;
+                ++depth;
+            }
+            countDescent(comparisons, depth);
+            return node;
+        }
+        while (node != nullptr) {
+            ++comparisons;
+            if (comp(key, keyOf(node))) {
+                node = node->left;
+            } else if (++comparisons, comp(keyOf(node), key)) {
+                node = node->right;
+            } else {
+                break;
+            }
+            ++depth;
+        }
+        countDescent(comparisons, depth);
+        return node;
+    }
+
+    // Helper function to get the height of a perfectly balanced subtree with
+    // count nodes, i.e. the number of bits needed to represent count
+    static int heightOfSize(size_t count) {
+        int h = 0;
+        while (count != 0) {
+            ++h;
+            count >>= 1;
+        }
+        return h;
+    }
+
+    // Accessors that let linkBalanced work on a contiguous run of nodes as
+    // well as on an array of node pointers
+    static Node *nodeAt(Node *nodes, size_t i) {
+        return &nodes[i];
+    }
+
+    static Node *nodeAt(Node *const *nodes, size_t i) {
+        return nodes[i];
+    }
+
+    // Recursive helper that links nodes[lo, hi) into a perfectly balanced
+    // subtree and returns its root. Balance factors and sizes follow from the
+    // range lengths alone. The left half is linked on another thread while
+    // spawnDepth allows it.
+    template <typename Nodes>
+    static Node *linkBalanced(Nodes nodes, size_t lo, size_t hi, int spawnDepth) {
+        if (lo >= hi)
+            return nullptr;
+
+        size_t mid = lo + (hi - lo - 1) / 2;
+        Node *node = nodeAt(nodes, mid);
+        if (spawnDepth > 0 && hi - lo > kParallelGrain) {
+            future<Node *> left = async(launch::async, linkBalanced<Nodes>, nodes, lo, mid, spawnDepth - 1);
+            node->right = linkBalanced(nodes, mid + 1, hi, spawnDepth - 1);
+            node->left = left.get();
+        } else {
+            node->left = linkBalanced(nodes, lo, mid, 0);
+            node->right = linkBalanced(nodes, mid + 1, hi, 0);
+        }
+
+        node->balance = heightOfSize(mid - lo) - heightOfSize(hi - mid - 1);
+        updateAugment(node);
+        return node;
+    }
+
+    // Identity projection for constructRange
+    struct Forward {
+        template <typename T>
+        T &&operator()(T &&value) const {
+            return std::forward<T>(value);
+        }
+    };
+
+    // Dereferencing projection for ranges of iterators
+    struct Deref {
+        template <typename It>
+        decltype(auto) operator()(const It &it) const {
+            return *it;
+        }
+    };
+
+    // Constructs nodes[lo, hi) from proj applied to the elements starting at
+    // first. If a payload constructor throws, the nodes built so far are
+    // destroyed again.
+    template <typename It, typename Project = Forward>
+    static void constructRange(Node *nodes, size_t lo, size_t hi, It first, Project proj = Project()) {
+        size_t i = lo;
+        try {
+            for (; i < hi; ++i, ++first)
+                new (&nodes[i]) Node(proj(*first));
+        } catch (...) {
+            while (i > lo)
+                nodes[--i].~Node();
+            throw;
+        }
+    }
+
+    // Builds this empty tree from the count sorted elements starting at first,
+    // placing the nodes contiguously in key order
+    template <typename It>
+    void buildFromSorted(It first, size_t count, bool parallel) {
+        if (count == 0)
+            return;
+
+        Node *nodes = nodePool().allocateRun(count);
+        int spawnDepth = 0;
+
+        using Category = typename iterator_traits<It>::iterator_category;
+        if (parallel && is_base_of<random_access_iterator_tag, Category>::value && count > kParallelGrain) {
+            size_t threads = max<size_t>(1, thread::hardware_concurrency());
+            while ((size_t(1) << spawnDepth) < threads)
+                ++spawnDepth;
+
+            size_t parts = min(threads, count / kParallelGrain + 1);
+            vector<future<void>> tasks;
+            for (size_t p = 0; p < parts; ++p) {
+                size_t lo = count * p / parts, hi = count * (p + 1) / parts;
+                tasks.push_back(async(launch::async, [=] { constructRange(nodes, lo, hi, next(first, lo)); }));
+            }
+
+            exception_ptr error;
+            vector<bool> built(parts);
+            for (size_t p = 0; p < parts; ++p) {
+                try {
+                    tasks[p].get();
+                    built[p] = true;
+                } catch (...) {
+                    error = current_exception();
+                }
+            }
+            if (error) {
+                for (size_t p = 0; p < parts; ++p)
+                    for (size_t i = count * p / parts; i < count * (p + 1) / parts; ++i) {
+                        if (built[p])
+                            nodes[i].~Node();
+                        nodePool().deallocate(&nodes[i]);
+                    }
+                rethrow_exception(error);
+            }
+        } else {
+            try {
+                constructRange(nodes, 0, count, first);
+            } catch (...) {
+                for (size_t i = 0; i < count; ++i)
+                    nodePool().deallocate(&nodes[i]);
+                throw;
+            }
+        }
+
+        for (size_t i = 1; i < count; ++i)
+            assert(comp(keyOf(&nodes[i - 1]), keyOf(&nodes[i])) && "input must be strictly increasing");
+
+        root = linkBalanced(nodes, 0, count, spawnDepth);
+        nodeCount = count;
+    }
+
+    // Helper function to get the height of a subtree by walking down its
+    // taller side
+    static int subtreeHeight(const Node *node) {
+        int h = 0;
+        for (; node != nullptr; ++h)
+            node = node->balance < 0 ? node->right : node->left;
+        return h;
+    }
+
+    // Heights of the children of a node whose own height is h
+    static int leftHeight(const Node *node, int h) {
+        return h - (node->balance < 0 ? 2 : 1);
+    }
+
+    static int rightHeight(const Node *node, int h) {
+        return h - (node->balance > 0 ? 2 : 1);
+    }
+
+    // Sets the balance factor of node, whose children are AVL subtrees of
+    // heights hl and hr differing by at most two, rotating if they differ by
+    // two. Returns the new subtree root and stores its height in h.
+    Node *fixJoined(Node *node, int hl, int hr, int &h) {
+        node->balance = hl - hr;
+        if (node->balance > 1) {
+            h = node->left->balance >= 0 ? hl + 1 - node->left->balance : hl;
+        } else if (node->balance < -1) {
+            h = node->right->balance <= 0 ? hr + 1 + node->right->balance : hr;
+        } else {
+            updateAugment(node);
+            h = 1 + max(hl, hr);
+            return node;
+        }
+
+        bool heightDropped;
+        return rebalance(node, heightDropped);
+    }
+
+    // Joins the AVL subtrees l and r, of heights hl and hr, with the detached
+    // node k, whose key lies between them. Descends the spine of the taller
+    // tree until the heights match, so the cost is O(|hl - hr| + 1).
+    Node *joinNodes(Node *l, int hl, Node *k, Node *r, int hr, int &h) {
+        if (hl > hr + 1) {
+            int hll = leftHeight(l, hl), hlr = rightHeight(l, hl), hn;
+            l->right = joinNodes(l->right, hlr, k, r, hr, hn);
+            return fixJoined(l, hll, hn, h);
+        }
+        if (hr > hl + 1) {
+            int hrl = leftHeight(r, hr), hrr = rightHeight(r, hr), hn;
+            r->left = joinNodes(l, hl, k, r->left, hrl, hn);
+            return fixJoined(r, hn, hrr, h);
+        }
+
+        k->left = l;
+        k->right = r;
+        return fixJoined(k, hl, hr, h);
+    }
+
+    // Detaches the minimum node of the non-empty subtree t of height ht into
+    // first. Returns the remaining subtree and stores its height in h.
+    Node *splitFirst(Node *t, int ht, Node *&first, int &h) {
+        if (t->left == nullptr) {
+            first = t;
+            h = ht - 1;
+            return t->right;
+        }
+
+        int hr = rightHeight(t, ht), hn;
+        Node *rest = splitFirst(t->left, leftHeight(t, ht), first, hn);
+        return joinNodes(rest, hn, t, t->right, hr, h);
+    }
+
+    // Concatenates subtrees l and r, where every key of l is below every key
+    // of r. Stores the resulting height in h.
+    Node *joinTwo(Node *l, int hl, Node *r, int hr, int &h) {
+        if (l == nullptr) {
+            h = hr;
+            return r;
+        }
+        if (r == nullptr) {
+            h = hl;
+            return l;
+        }
+
+        Node *first;
+        int hn;
+        Node *rest = splitFirst(r, hr, first, hn);
+        return joinNodes(l, hl, first, rest, hn, h);
+    }
+
+    // Recursive helper that splits subtree t of height ht around key into the
+    // keys below it (l, height hl) and above it (r, height hr). A node with an
+    // equal key is detached into mid, or mid is set to nullptr. Every level
+    // costs one join, and the join costs telescope to O(log n) in total.
+    void splitNodes(Node *t, int ht, const Key &key, Node *&l, int &hl, Node *&mid, Node *&r, int &hr) {
+        if (t == nullptr) {
+            l = mid = r = nullptr;
+            hl = hr = 0;
+            return;
+        }
+
+        int htl = leftHeight(t, ht), htr = rightHeight(t, ht);
+        if (comp(key, keyOf(t))) {
+            Node *lr;
+            int hlr;
+            splitNodes(t->left, htl, key, l, hl, mid, lr, hlr);
+            r = joinNodes(lr, hlr, t, t->right, htr, hr);
+        } else if (comp(keyOf(t), key)) {
+            Node *rl;
+            int hrl;
+            splitNodes(t->right, htr, key, rl, hrl, mid, r, hr);
+            l = joinNodes(t->left, htl, t, rl, hrl, hl);
+        } else {
+            l = t->left;
+            hl = htl;
+            r = t->right;
+            hr = htr;
+            mid = t;
+            t->left = t->right = nullptr;
+            t->balance = 0;
+            updateAugment(t);
+        }
+    }
+
+    // Bookkeeping of one branch of a set operation: how many keys matched,
+    // and, when nodes cannot be freed right away because branches run on
+    // several threads, the detached nodes waiting to be destroyed
+    struct SetOpState {
+        bool deferred;
+        size_t matches = 0;
+        vector<Node *> garbage;
+
+        explicit SetOpState(bool deferred) : deferred(deferred) {}
+
+        void absorb(SetOpState &other) {
+            matches += other.matches;
+            garbage.insert(garbage.end(), other.garbage.begin(), other.garbage.end());
+        }
+    };
+
+    // Runs both branches of a set operation one after the other
+    struct SequentialFork {
+        template <typename F1, typename F2>
+        void operator()(int, F1 &&f1, F2 &&f2) const {
+            f1();
+            f2();
+        }
+    };
+
+    // Runs both branches through an executor while the subtrees are taller
+    // than kParallelHeight, and sequentially below that grain
+    template <typename Executor>
+    struct ExecutorFork {
+        Executor &executor;
+
+        template <typename F1, typename F2>
+        void operator()(int height, F1 &&f1, F2 &&f2) const {
+            if (height > kParallelHeight) {
+                executor.parallel_invoke(f1, f2);
+            } else {
+                f1();
+                f2();
+            }
+        }
+    };
+
+    // Subtrees at most this tall are combined sequentially by parallel set
+    // operations; they hold at most a few thousand nodes
+    static constexpr int kParallelHeight = 12;
+
+    // Destroys the nodes of subtree t, or queues it for later destruction
+    void disposeSubtree(Node *t, SetOpState &state) {
+        if (t == nullptr)
+            return;
+        if (state.deferred)
+            state.garbage.push_back(t);
+        else
+            destroySubtree(t);
+    }
+
+    // Detaches node from its children and disposes of it alone
+    void disposeNode(Node *node, SetOpState &state) {
+        node->left = node->right = nullptr;
+        disposeSubtree(node, state);
+    }
+
+    // Recursive helper for the union of subtrees a and b. Splits b around the
+    // root of a and recurses on both sides; nodes of b whose key is also in a
+    // are disposed of, so a's payloads win. Counts those duplicates in matches.
+    template <typename Fork>
+    Node *unionNodes(Node *a, int ha, Node *b, int hb, int &h, SetOpState &state, const Fork &fork) {
+        if (a == nullptr) {
+            h = hb;
+            return b;
+        }
+        if (b == nullptr) {
+            h = ha;
+            return a;
+        }
+
+        Node *bl, *dup, *br;
+        int hbl, hbr, hl, hr;
+        splitNodes(b, hb, keyOf(a), bl, hbl, dup, br, hbr);
+        if (dup != nullptr) {
+            disposeNode(dup, state);
+            ++state.matches;
+        }
+
+        int hal = leftHeight(a, ha), har = rightHeight(a, ha);
+        Node *l, *r;
+        SetOpState rightState(state.deferred);
+        fork(max(ha, hb), [&] { l = unionNodes(a->left, hal, bl, hbl, hl, state, fork); },
+             [&] { r = unionNodes(a->right, har, br, hbr, hr, rightState, fork); });
+        state.absorb(rightState);
+        return joinNodes(l, hl, a, r, hr, h);
+    }
+
+    // Recursive helper for the intersection of subtrees a and b, keeping a's
+    // payloads and disposing of every node that does not survive
+    template <typename Fork>
+    Node *intersectNodes(Node *a, int ha, Node *b, int hb, int &h, SetOpState &state, const Fork &fork) {
+        if (a == nullptr || b == nullptr) {
+            disposeSubtree(a, state);
+            disposeSubtree(b, state);
+            h = 0;
+            return nullptr;
+        }
+
+        Node *bl, *dup, *br;
+        int hbl, hbr, hl, hr;
+        splitNodes(b, hb, keyOf(a), bl, hbl, dup, br, hbr);
+
+        int hal = leftHeight(a, ha), har = rightHeight(a, ha);
+        Node *l, *r;
+        SetOpState rightState(state.deferred);
+        fork(max(ha, hb), [&] { l = intersectNodes(a->left, hal, bl, hbl, hl, state, fork); },
+             [&] { r = intersectNodes(a->right, har, br, hbr, hr, rightState, fork); });
+        state.absorb(rightState);
+
+        if (dup != nullptr) {
+            disposeNode(dup, state);
+            ++state.matches;
+            return joinNodes(l, hl, a, r, hr, h);
+        }
+
+        disposeNode(a, state);
+        return joinTwo(l, hl, r, hr, h);
+    }
+
+    // Recursive helper for the difference a - b. Splits a around the root of
+    // b, recurses, and concatenates what is left; all of b is disposed of.
+    template <typename Fork>
+    Node *differenceNodes(Node *a, int ha, Node *b, int hb, int &h, SetOpState &state, const Fork &fork) {
+        if (a == nullptr || b == nullptr) {
+            disposeSubtree(b, state);
+            h = ha;
+            return a;
+        }
+
+        Node *al, *dup, *ar;
+        int hal, har, hl, hr;
+        splitNodes(a, ha, keyOf(b), al, hal, dup, ar, har);
+        if (dup != nullptr) {
+            disposeNode(dup, state);
+            ++state.matches;
+        }
+
+        int hbl = leftHeight(b, hb), hbr = rightHeight(b, hb);
+        Node *bl = b->left, *br = b->right;
+        disposeNode(b, state);
+
+        Node *l, *r;
+        SetOpState rightState(state.deferred);
+        fork(max(ha, hb), [&] { l = differenceNodes(al, hal, bl, hbl, hl, state, fork); },
+             [&] { r = differenceNodes(ar, har, br, hbr, hr, rightState, fork); });
+        state.absorb(rightState);
+        return joinTwo(l, hl, r, hr, h);
+    }
+
+    // Set operations on this tree and other, which is consumed. Each runs one
+    // of the recursions above with the given fork policy and then destroys
+    // the nodes it deferred.
+    template <typename Fork>
+    void unionWith(AVLTree &other, const Fork &fork, bool deferred) {
+        static_assert(!kMultiset, "set operations are not defined in multiset mode");
+        bool known = sizeKnown && other.sizeKnown;
+        size_t count = nodeCount + other.nodeCount;
+
+        Node *b = adoptNodes(other);
+        SetOpState state(deferred);
+        int h;
+        root = unionNodes(root, subtreeHeight(root), b, subtreeHeight(b), h, state, fork);
+        finishSetOp(state, known, count - state.matches);
+    }
+
+    template <typename Fork>
+    void intersectWith(AVLTree &other, const Fork &fork, bool deferred) {
+        static_assert(!kMultiset, "set operations are not defined in multiset mode");
+        Node *b = adoptNodes(other);
+        SetOpState state(deferred);
+        int h;
+        root = intersectNodes(root, subtreeHeight(root), b, subtreeHeight(b), h, state, fork);
+        finishSetOp(state, true, state.matches);
+    }
+
+    template <typename Fork>
+    void differenceWith(AVLTree &other, const Fork &fork, bool deferred) {
+        static_assert(!kMultiset, "set operations are not defined in multiset mode");
+        bool known = sizeKnown;
+        size_t count = nodeCount;
+
+        Node *b = adoptNodes(other);
+        SetOpState state(deferred);
+        int h;
+        root = differenceNodes(root, subtreeHeight(root), b, subtreeHeight(b), h, state, fork);
+        finishSetOp(state, known, count - state.matches);
+    }
+
+    // Destroys the nodes a set operation deferred and records the new count
+    void finishSetOp(SetOpState &state, bool known, size_t count) {
+        for (Node *t : state.garbage)
+            destroySubtree(t);
+        setCountAfter(known, count);
+    }
+
+    // Makes the nodes of other owned by this tree's pool, so that they can be
+    // linked into this tree. Other is left empty.
+    Node *adoptNodes(AVLTree &other) {
+        Node *nodes = other.root;
+        if (nodes != nullptr) {
+            Pool &theirs = other.nodePool();
+            if (!pool)
+                pool = other.pool;
+            else if (&nodePool() != &theirs)
+                Pool::merge(pool, other.pool);
+        }
+        other.root = nullptr;
+        other.nodeCount = 0;
+        other.sizeKnown = true;
+        ++other.version;
+        return nodes;
+    }
+
+    // Sets the element count after a set operation when it can be derived
+    // from the counts of both inputs without a traversal
+    void setCountAfter(bool known, size_t count) {
+        nodeCount = count;
+        sizeKnown = known;
+        ++version;
+    }
+
+    // Sorts the elements of [first, last) by key and drops later duplicates.
+    // Returns iterators to the surviving elements.
+    template <typename It, typename KeyOfInput>
+    vector<It> sortBatch(It first, It last, KeyOfInput keyOfInput) const {
+        vector<It> batch;
+        for (; first != last; ++first)
+            batch.push_back(first);
+
+        auto less = [&](const It &a, const It &b) { return comp(keyOfInput(*a), keyOfInput(*b)); };
+        stable_sort(batch.begin(), batch.end(), less);
+        batch.erase(unique(batch.begin(), batch.end(), [&](const It &a, const It &b) { return !less(a, b); }),
+                    batch.end());
+        return batch;
+    }
+
+    // Builds a balanced subtree holding the elements behind the sorted,
+    // distinct iterators [first, last) and stores its height in h
+    template <typename It>
+    Node *buildBatch(const It *first, const It *last, int &h) {
+        size_t count = static_cast<size_t>(last - first);
+        Node *nodes = nodePool().allocateRun(count);
+        try {
+            constructRange(nodes, 0, count, first, Deref());
+        } catch (...) {
+            for (size_t i = 0; i < count; ++i)
+                nodePool().deallocate(&nodes[i]);
+            throw;
+        }
+        h = heightOfSize(count);
+        return linkBalanced(nodes, 0, count, 0);
+    }
+
+    // A subtree built for insertSorted, with its height
+    struct BuiltSubtree {
+        Node *node;
+        int height;
+    };
+
+    // Splits the sorted, distinct batch [first, last) around node t: the
+    // elements below t's key end at mid, and those above it start at
+    // rightFirst, which skips an element equal to t's key
+    template <typename It>
+    void splitBatch(const Node *t, const It *first, const It *last, const It *&mid, const It *&rightFirst) const {
+        mid = std::lower_bound(first, last, keyOf(t),
+                               [&](const It &it, const Key &key) { return comp(Values::key(*it), key); });
+        rightFirst = mid != last && !comp(keyOf(t), Values::key(**mid)) ? mid + 1 : mid;
+    }
+
+    // Appends to gaps, in key order, the runs of the sorted, distinct batch
+    // [first, last) that fall into empty subtrees below t. These are the runs
+    // insertSorted places as new subtrees; finding them does not modify the
+    // tree.
+    template <typename It>
+    void batchGaps(const Node *t, const It *first, const It *last, vector<pair<const It *, const It *>> &gaps) const {
+        if (first == last)
+            return;
+        if (t == nullptr) {
+            gaps.emplace_back(first, last);
+            return;
+        }
+        const It *mid, *rightFirst;
+        splitBatch(t, first, last, mid, rightFirst);
+        batchGaps(t->left, first, mid, gaps);
+        batchGaps(t->right, rightFirst, last, gaps);
+    }
+
+    // Recursive helper that inserts the sorted, distinct batch [first, last)
+    // into subtree t of height ht. The batch is split around each visited
+    // node, so every node is compared once per batch rather than once per
+    // key, and the two halves are joined back under it. Each run that reaches
+    // an empty subtree is replaced by the next of the prebuilt subtrees,
+    // which batchGaps produced in the same order. Stores the new height in h.
+    template <typename It>
+    Node *insertSorted(Node *t, int ht, const It *first, const It *last, int &h, const BuiltSubtree *&next) {
+        if (first == last) {
+            h = ht;
+            return t;
+        }
+        if (t == nullptr) {
+            h = next->height;
+            return (next++)->node;
+        }
+
+        const It *mid, *rightFirst;
+        splitBatch(t, first, last, mid, rightFirst);
+        int htl = leftHeight(t, ht), htr = rightHeight(t, ht), hl, hr;
+        Node *l = insertSorted(t->left, htl, first, mid, hl, next);
+        Node *r = insertSorted(t->right, htr, rightFirst, last, hr, next);
+        return joinNodes(l, hl, t, r, hr, h);
+    }
+
+    // Recursive helper that removes the keys of the sorted, distinct batch
+    // [first, last) from subtree t of height ht, joining the surviving parts
+    // back together. Stores the new height in h and counts removed nodes.
+    template <typename It>
+    Node *eraseSorted(Node *t, int ht, const It *first, const It *last, int &h, size_t &removed) {
+        if (t == nullptr || first == last) {
+            h = ht;
+            return t;
+        }
+
+        const It *mid = std::lower_bound(first, last, keyOf(t), [&](const It &it, const Key &key) { return comp(*it, key); });
+        bool found = mid != last && !comp(keyOf(t), **mid);
+
+        int htl = leftHeight(t, ht), htr = rightHeight(t, ht), hl, hr;
+        Node *l = eraseSorted(t->left, htl, first, mid, hl, removed);
+        Node *r = eraseSorted(t->right, htr, found ? mid + 1 : mid, last, hr, removed);
+        if (!found)
+            return joinNodes(l, hl, t, r, hr, h);
+
+        removed += occurrences(t);
+        nodePool().destroy(t);
+        return joinTwo(l, hl, r, hr, h);
+    }
+
+    // Appends the nodes of the subtree rooted with node to out in key order
+    static void collectNodes(Node *node, vector<Node *> &out) {
+        Node *stack[kMaxHeight];
+        int depth = 0;
+        while (node != nullptr || depth > 0) {
+            for (; node != nullptr; node = node->left)
+                stack[depth++] = node;
+            node = stack[--depth];
+            out.push_back(node);
+            node = node->right;
+        }
+    }
+
+    // Rebuilds the whole tree from the given nodes, already in key order
+    void relinkAll(const vector<Node *> &nodes) {
+        root = linkBalanced(nodes.data(), 0, nodes.size(), 0);
+        nodeCount = kMultiset ? countNodes(root) : nodes.size();
+        sizeKnown = true;
+        ++version;
+    }
+
+    // Large batches are merged by rebuilding the tree once they exceed this
+    // fraction of its size, since the O(m log(n / m)) walk stops paying off
+    static constexpr size_t kRebuildRatio = 4;
+
+    // Lookups of a batch descend together in groups of this many, which is
+    // about the number of misses a core keeps in flight
+    static constexpr size_t kLookupGroup = 16;
+
+    static void prefetch(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif
+    }
+
+    // Finds the lower bound of every key in keys[0, n) and passes it to
+    // done(i, node), node being nullptr past the end. A group of lookups
+    // moves down one level per round, and the child each one moves to is
+    // prefetched, so that the cache misses of the group overlap instead of
+    // being taken one after another.
+    template <typename Done>
+    void lowerBoundMany(const Key *keys, size_t n, Done done) const {
+        const Node *cursor[kLookupGroup];
+        const Node *best[kLookupGroup];
+        for (size_t base = 0; base < n; base += kLookupGroup) {
+            size_t count = min(kLookupGroup, n - base);
+            for (size_t j = 0; j < count; ++j) {
+                cursor[j] = root;
+                best[j] = nullptr;
+            }
+
+            bool active = root != nullptr;
+            while (active) {
+                active = false;
+                for (size_t j = 0; j < count; ++j) {
+                    const Node *node = cursor[j];
+                    if (node == nullptr)
+                        continue;
+                    if (comp(keyOf(node), keys[base + j])) {
+                        node = node->right;
+                    } else {
+                        best[j] = node;
+                        node = node->left;
+                    }
+                    cursor[j] = node;
+                    if (node != nullptr) {
+                        prefetch(node);
+                        active = true;
+                    }
+                }
+            }
+
+            for (size_t j = 0; j < count; ++j)
+                done(base + j, best[j]);
+        }
+    }
+
+    // Helper functions to find the nodes with minimum and maximum key
+    static Node *minNode(Node *node) {
+        while (node && node->left != nullptr)
+            node = node->left;
+        return node;
+    }
+
+    Node *maxNode() const {
+        Node *node = root;
+        while (node && node->right != nullptr)
+            node = node->right;
+        return node;
+    }
+
+    // Recursive helper for counting the nodes of a subtree
+    static size_t countNodes(const Node *node) {
+        return node ? occurrences(node) + countNodes(node->left) + countNodes(node->right) : 0;
+    }
+
+    // Runs the destructor of every node in the subtree, without recursion or
+    // a stack: left children are rotated onto the right spine until the
+    // current node has none, and then it is destroyed. Slots go back to
+    // recycle's free list; with no pool given they are left for release().
+    static void destroyNodes(Node *node, Pool *recycle) {
+        while (node != nullptr) {
+            if (Node *left = node->left) {
+                node->left = left->right;
+                left->right = node;
+                node = left;
+            } else {
+                Node *right = node->right;
+                if (recycle != nullptr)
+                    recycle->destroy(node);
+                else
+                    node->~Node();
+                node = right;
+            }
+        }
+    }
+
+    // Destroys a subtree and recycles its slots
+    void destroySubtree(Node *node) {
+        if (node != nullptr)
+            destroyNodes(node, &nodePool());
+    }
+
+    using Record = AVLSnapshotRecord<Key, Value>;
+
+    // Copies the payload of a node into a snapshot record
+    static void storeRecord(Record &record, const value_type &value) {
+        if constexpr (is_void<Value>::value) {
+            record.key = value;
+        } else {
+            record.key = value.first;
+            record.mapped = value.second;
+        }
+    }
+
+    static Node *constructFromRecord(Node *slot, const Record &record) {
+        if constexpr (is_void<Value>::value)
+            return new (slot) Node(record.key);
+        else
+            return new (slot) Node(record.key, record.mapped);
+    }
+
+    // Rebuilds this empty tree from count snapshot records in pre-order.
+    // Returns false, leaving the tree empty, unless the records form one tree
+    // with correct balance factors and keys in search order.
+    bool adoptRecords(const Record *records, size_t count) {
+        if (count == 0)
+            return true;
+
+        // Every child must come after its parent and have no other parent;
+        // with count - 1 links that makes record 0 the root of a tree
+        vector<bool> linked(count);
+        size_t links = 0;
+        for (size_t i = 0; i < count; ++i) {
+            for (uint32_t child : {records[i].left, records[i].right}) {
+                if (child == AVLSnapshotFormat::kNone)
+                    continue;
+                if (child <= i || child >= count || linked[child])
+                    return false;
+                linked[child] = true;
+                ++links;
+            }
+        }
+        if (links != count - 1)
+            return false;
+
+        Node *nodes = nodePool().allocateRun(count);
+        for (size_t i = 0; i < count; ++i)
+            constructFromRecord(&nodes[i], records[i]);
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t left = records[i].left, right = records[i].right;
+            nodes[i].left = left == AVLSnapshotFormat::kNone ? nullptr : &nodes[left];
+            nodes[i].right = right == AVLSnapshotFormat::kNone ? nullptr : &nodes[right];
+            nodes[i].balance = records[i].balance;
+        }
+        root = &nodes[0];
+        nodeCount = count;
+        sizeKnown = true;
+
+        // Children follow their parents, so a backward pass sees them first
+        vector<uint8_t> heights(count);
+        bool balanced = true;
+        for (size_t i = count; i-- > 0 && balanced;) {
+            int hl = nodes[i].left ? heights[nodes[i].left - nodes] : 0;
+            int hr = nodes[i].right ? heights[nodes[i].right - nodes] : 0;
+            balanced = nodes[i].balance == hl - hr && abs(hl - hr) <= 1;
+            heights[i] = static_cast<uint8_t>(1 + max(hl, hr));
+            updateAugment(&nodes[i]);
+        }
+        if (!balanced || checkSubtree(root, nullptr, nullptr) < 0) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Recursive helper for validating the subtree rooted with node. Returns
+    // the subtree height, or -1 if an invariant is violated.
+    int checkSubtree(const Node *node, const Key *lower, const Key *upper) const {
+        if (node == nullptr)
+            return 0;
+        if ((lower && !comp(*lower, keyOf(node))) || (upper && !comp(keyOf(node), *upper)))
+            return -1;
+
+        int leftHeight = checkSubtree(node->left, lower, &keyOf(node));
+        int rightHeight = checkSubtree(node->right, &keyOf(node), upper);
+        if (leftHeight < 0 || rightHeight < 0 || abs(leftHeight - rightHeight) > 1)
+            return -1;
+
+        if (leftHeight - rightHeight != node->balance)
+            return -1;
+        if (occurrences(node) == 0)
+            return -1;
+        if (kOrderStatistics && subtreeSize(node) != occurrences(node) + subtreeSize(node->left) + subtreeSize(node->right))
+            return -1;
+        return 1 + max(leftHeight, rightHeight);
+    }
+
+public:
+    /**
+     * @brief Bidirectional in-order iterator. Nodes keep no parent links, so
+     *        the iterator carries the path from the root to its node; a step
+     *        costs amortized O(1) and never allocates. Any modification of
+     *        the tree invalidates all iterators.
+     */
+    template <bool Const>
+    class Iterator {
+    public:
+        using iterator_category = bidirectional_iterator_tag;
+        using value_type = typename AVLTree::value_type;
+        using difference_type = ptrdiff_t;
+        using pointer = conditional_t<Const, const value_type *, value_type *>;
+        using reference = conditional_t<Const, const value_type &, value_type &>;
+
+        Iterator() : root(nullptr), depth(0) {}
+
+        template <bool C = Const, typename = enable_if_t<C>>
+        Iterator(const Iterator<false> &other) : root(other.root), depth(other.depth) {
+            copy(other.path, other.path + depth, path);
+        }
+
+        reference operator*() const {
+            return path[depth - 1]->value;
+        }
+
+        pointer operator->() const {
+            return &path[depth - 1]->value;
+        }
+
+        Iterator &operator++() {
+            Node *node = path[depth - 1];
+            if (node->right != nullptr) {
+                descendLeftmost(node->right);
+            } else {
+                // Climb until we leave a left subtree; its parent is next
+                Node *child;
+                do {
+                    child = path[--depth];
+                } while (depth > 0 && path[depth - 1]->right == child);
+            }
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        Iterator &operator--() {
+            if (depth == 0) {
+                descendRightmost(root);
+            } else if (path[depth - 1]->left != nullptr) {
+                descendRightmost(path[depth - 1]->left);
+            } else {
+                Node *child;
+                do {
+                    child = path[--depth];
+                } while (depth > 0 && path[depth - 1]->left == child);
+            }
+            return *this;
+        }
+
+        Iterator operator--(int) {
+            Iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        friend bool operator==(const Iterator &a, const Iterator &b) {
+            return a.node() == b.node();
+        }
+
+        friend bool operator!=(const Iterator &a, const Iterator &b) {
+            return !(a == b);
+        }
+
+    private:
+        friend class AVLTree;
+        template <bool>
+        friend class Iterator;
+
+        Node *root;
+        // path[0] is the root and path[depth - 1] the current node; depth is
+        // zero at end()
+        Node *path[kMaxHeight];
+        int depth;
+
+        explicit Iterator(Node *root) : root(root), depth(0) {}
+
+        Node *node() const {
+            return depth ? path[depth - 1] : nullptr;
+        }
+
+        void descendLeftmost(Node *node) {
+            for (; node != nullptr; node = node->left)
+                path[depth++] = node;
+        }
+
+        void descendRightmost(Node *node) {
+            for (; node != nullptr; node = node->right)
+                path[depth++] = node;
+        }
+    };
+
+    // Sets are iterated read-only, like std::set, since the element is the
+    // key, and so are aggregated maps
+    using iterator = Iterator<is_void<Value>::value || kReadOnlyMapped>;
+    using const_iterator = Iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    /**
+     * @brief Finger into the tree for key streams with locality. A cursor
+     *        keeps the path to its last position together with the key range
+     *        of every subtree on it, and starts each seek or insert_near by
+     *        climbing only to the lowest subtree whose range holds the new
+     *        key. For keys d positions apart that is O(log d) levels unless a
+     *        subtree boundary high up lies between them.
+     *
+     * After an insert through the cursor it keeps the part of its path that
+     * rebalancing left intact. Any other change to the tree, including one
+     * through another cursor, is detected through the tree's version, and the
+     * next call then starts again from the root.
+     */
+    class Cursor {
+    public:
+        explicit Cursor(AVLTree &tree) : tree(&tree) {
+            restart();
+        }
+
+        /**
+         * @brief Moves the finger to key.
+         * @return The element with that key, or nullptr if it is absent.
+         * @note Time Complexity: O(log d), see above; O(log n) at worst.
+         */
+        ElementPointer seek(const Key &key) {
+            Node *node = *locate(key);
+            return node ? &node->value : nullptr;
+        }
+
+        /**
+         * @brief Inserts key near the finger, with the mapped value built in
+         *        place from args in map mode, unless key is already present.
+         * @return The element with that key and whether it was inserted.
+         * @note Time Complexity: O(log d) for the descent plus the amortized
+         *       O(1) retrace.
+         */
+        template <typename K, typename... Args>
+        pair<ElementPointer, bool> insert_near(K &&key, Args &&...args) {
+            Node **link = locate(key);
+            if (*link != nullptr) {
+                if constexpr (kMultiset) {
+                    // path[0..level) holds the links above the found node
+                    tree->addOccurrence(path, level, *link);
+                    version = tree->version;
+                    return {&(*link)->value, true};
+                }
+                return {&(*link)->value, false};
+            }
+
+            Node *node;
+            if constexpr (is_void<Value>::value)
+                node = tree->nodePool().create(std::forward<K>(key), std::forward<Args>(args)...);
+            else
+                node = tree->nodePool().create(piecewise_construct, forward_as_tuple(std::forward<K>(key)),
+                                               forward_as_tuple(std::forward<Args>(args)...));
+            // Links above the highest node the retrace rotated are untouched
+            level = tree->linkNode(path, level, link, node);
+            version = tree->version;
+            return {&node->value, true};
+        }
+
+    private:
+        AVLTree *tree;
+        uint64_t version;
+        // path[0] is the root link and path[level] the link at the finger.
+        // The subtree behind path[i] holds exactly the keys strictly between
+        // *lower[i] and *upper[i], where nullptr means unbounded.
+        Node **path[kMaxHeight];
+        const Key *lower[kMaxHeight];
+        const Key *upper[kMaxHeight];
+        int level;
+
+        void restart() {
+            version = tree->version;
+            path[0] = &tree->root;
+            lower[0] = upper[0] = nullptr;
+            level = 0;
+        }
+
+        bool contains(int i, const Key &key) const {
+            return (!lower[i] || tree->comp(*lower[i], key)) && (!upper[i] || tree->comp(key, *upper[i]));
+        }
+
+        // Climbs to the lowest subtree on the path whose range holds key and
+        // descends from there. Returns the link holding key, or the empty
+        // link where it belongs.
+        Node **locate(const Key &key) {
+            if (version != tree->version)
+                restart();
+            while (level > 0 && !contains(level, key))
+                --level;
+
+            Node **link = path[level];
+            while (*link != nullptr) {
+                Node *node = *link;
+                const Key &nodeKey = keyOf(node);
+                if (tree->comp(key, nodeKey)) {
+                    link = &node->left;
+                    lower[level + 1] = lower[level];
+                    upper[level + 1] = &nodeKey;
+                } else if (tree->comp(nodeKey, key)) {
+                    link = &node->right;
+                    lower[level + 1] = &nodeKey;
+                    upper[level + 1] = upper[level];
+                } else {
+                    break;
+                }
+                path[++level] = link;
+            }
+            return link;
+        }
+    };
+
+    /**
+     * @brief Returns a cursor positioned at the root.
+     */
+    Cursor cursor() {
+        return Cursor(*this);
+    }
+
+private:
+    // Positions it at the first node whose key is not before key, or, with
+    // upper set, at the first node whose key is after key
+    template <typename It, typename K>
+    It boundAt(const K &key, bool upper) const {
+        It it(root);
+        int found = 0;
+        uint64_t prefix = 0;
+        if constexpr (kKeyPrefix)
+            prefix = keyPrefix(string_view(key));
+        for (Node *node = root; node != nullptr;) {
+            it.path[it.depth++] = node;
+            bool goLeft;
+            if constexpr (kKeyPrefix) {
+                int order = orderByPrefix(key, prefix, node);
+                goLeft = upper ? order < 0 : order <= 0;
+            } else {
+                goLeft = upper ? comp(key, keyOf(node)) : !comp(keyOf(node), key);
+            }
+            if (goLeft) {
+                found = it.depth;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        it.depth = found;
+        return it;
+    }
+
+public:
+    /**
+     * @brief Constructs an empty AVLTree.
+     * @note Space Complexity: O(n), where n is the number of nodes in the tree.
+     */
+    AVLTree() : root(nullptr), nodeCount(0), sizeKnown(true) {}
+
+    /**
+     * @brief Constructs an empty AVLTree whose node pool draws from upstream.
+     * @param upstream A user-supplied memory resource for node chunks.
+     * @param comp The key comparator.
+     */
+    explicit AVLTree(std::pmr::memory_resource *upstream, const Compare &comp = Compare())
+        : root(nullptr), pool(make_shared<Pool>(upstream)), nodeCount(0), sizeKnown(true), comp(comp) {}
+
+    AVLTree(const AVLTree &) = delete;
+    AVLTree &operator=(const AVLTree &) = delete;
+
+    /**
+     * @brief Moves the nodes of other into a new tree, leaving other empty.
+     * @note Time Complexity: O(1).
+     */
+    AVLTree(AVLTree &&other) noexcept
+        : root(other.root), pool(std::move(other.pool)), nodeCount(other.nodeCount),
+          sizeKnown(other.sizeKnown), comp(other.comp) {
+        other.root = nullptr;
+        other.nodeCount = 0;
+        other.sizeKnown = true;
+        ++other.version;
+    }
+
+    AVLTree &operator=(AVLTree &&other) noexcept {
+        if (this != &other) {
+            clear();
+            root = other.root;
+            pool = std::move(other.pool);
+            nodeCount = other.nodeCount;
+            sizeKnown = other.sizeKnown;
+            comp = other.comp;
+            ++version;
+            other.root = nullptr;
+            other.nodeCount = 0;
+            other.sizeKnown = true;
+            ++other.version;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Builds a tree from elements that are already sorted by strictly
+     *        increasing key, without any comparisons or rotations. Every node is
+     *        placed in one contiguous block in key order and the tree is
+     *        perfectly height-balanced.
+     * @param first, last The sorted input range; pass move iterators to move
+     *        payloads instead of copying them.
+     * @param parallel If true and the input is random access, nodes are
+     *        constructed and linked on several threads.
+     * @param comp The key comparator the input is sorted by.
+     * @note Time Complexity: O(n).
+     */
+    template <typename It>
+    static AVLTree build_from_sorted(It first, It last, bool parallel = false, const Compare &comp = Compare()) {
+        AVLTree tree;
+        tree.comp = comp;
+        tree.buildFromSorted(first, static_cast<size_t>(distance(first, last)), parallel);
+        return tree;
+    }
+
+    /**
+     * @brief Destroys the AVLTree, freeing all allocated memory.
+     * @note Time Complexity: O(c), where c is the number of pool chunks, when
+     *       the payload is trivially destructible and the pool is not shared
+     *       with another tree, since nodes are then released chunk by chunk
+     *       rather than one by one. O(n) otherwise.
+     */
+    ~AVLTree() {
+        clear();
+    }
+
+    /**
+     * @brief Removes every element from the tree. Nodes are visited
+     *        iteratively, and not at all for trivially destructible payloads
+     *        in an unshared pool; an unshared pool then returns its chunks
+     *        without freeing nodes one by one.
+     * @note Time Complexity: O(c) for trivially destructible payloads in an
+     *       unshared pool, O(n) otherwise.
+     */
+    void clear() {
+        if (pool) {
+            Pool &p = nodePool();
+            if (pool.use_count() > 1) {
+                destroySubtree(root);
+            } else {
+                if (!is_trivially_destructible<Node>::value)
+                    destroyNodes(root, nullptr);
+                p.release();
+            }
+        }
+        root = nullptr;
+        nodeCount = 0;
+        sizeKnown = true;
+        ++version;
+    }
+
+    /**
+     * @brief Empties the tree at once and leaves running the destructors and
+     *        returning the memory to the shared BackgroundReclaimer thread.
+     *        That needs the node pool to belong to this tree alone; after
+     *        split() or a set operation that shared it, this is clear().
+     *        The pool's memory resource must tolerate the other thread.
+     * @note Time Complexity: O(1) for the caller when the pool is unshared.
+     */
+    void clear_async() {
+        if (pool)
+            nodePool();
+        if (root == nullptr || pool.use_count() > 1) {
+            clear();
+            return;
+        }
+
+        shared_ptr<Pool> detached = std::move(pool);
+        Node *nodes = root;
+        root = nullptr;
+        nodeCount = 0;
+        sizeKnown = true;
+        ++version;
+        BackgroundReclaimer::shared().submit([detached, nodes] {
+            if (!is_trivially_destructible<Node>::value)
+                destroyNodes(nodes, nullptr);
+            detached->release();
+        });
+    }
+
+    /**
+     * @brief Returns the number of elements in the tree.
+     * @note Time Complexity: O(1), except for the first call after split() or
+     *       a set operation on a tree without order statistics, which counts
+     *       the nodes in O(n).
+     */
+    size_t size() const {
+        if constexpr (kOrderStatistics) {
+            return subtreeSize(root);
+        } else {
+            if (!sizeKnown) {
+                nodeCount = countNodes(root);
+                sizeKnown = true;
+            }
+            return nodeCount;
+        }
+    }
+
+    /**
+     * @brief Returns true if the tree holds no elements.
+     */
+    bool empty() const {
+        return root == nullptr;
+    }
+
+    /**
+     * @brief Returns the bytes the node pool holds, free slots included. Trees
+     *        that share a pool after split() all report the whole pool.
+     * @note Time Complexity: O(1).
+     */
+    size_t memory_usage() const {
+        return pool ? Pool::resolve(pool).bytesReserved() : 0;
+    }
+
+    /**
+     * @brief Inserts a new element into the AVL tree.
+     * @param value The key (set mode) or key/value pair (map mode) to insert.
+     * @return True if the element was inserted, false if its key was already present.
+     * @note Time Complexity: O(log n) due to tree traversal and rebalancing operations.
+     */
+    bool insert(const value_type &value) {
+        return emplace(value).second;
+    }
+
+    bool insert(value_type &&value) {
+        return emplace(std::move(value)).second;
+    }
+
+    /**
+     * @brief Constructs an element in place from args and inserts it unless an
+     *        element with the same key exists, in which case it is discarded.
+     * @return A pointer to the element with that key and whether it was inserted.
+     * @note Time Complexity: O(log n).
+     */
+    template <typename... Args>
+    pair<ElementPointer, bool> emplace(Args &&...args) {
+        return emplaceNode(nodePool().create(std::forward<Args>(args)...));
+    }
+
+    /**
+     * @brief Constructs an element in place from args and appends it after
+     *        the current maximum. The right spine is cached between calls, so
+     *        a run of increasing keys costs amortized O(1) per append: one
+     *        comparison with the maximum and the short retrace above the new
+     *        leaf. A key that is not above the maximum takes the emplace path.
+     * @return A pointer to the element with that key and whether it was inserted.
+     * @note Time Complexity: Amortized O(1) for increasing keys, O(log n)
+     *       otherwise.
+     */
+    template <typename... Args>
+    pair<ElementPointer, bool> append(Args &&...args) {
+        Node *node = nodePool().create(std::forward<Args>(args)...);
+        if (!spine || spine->version != version)
+            refreshSpine();
+
+        RightSpine &s = *spine;
+        if (s.depth > 0 && !comp(keyOf(*s.links[s.depth - 1]), keyOf(node)))
+            return emplaceNode(node);
+
+        countStat(Stat::kInserts);
+        int stop = linkNode(s.links, s.depth, s.links[s.depth], node);
+        extendSpine(stop);
+        return {&node->value, true};
+    }
+
+    /**
+     * @brief Inserts an element built from args, using hint where it helps.
+     *        A hint of end() goes through append(); other hints are ignored.
+     * @return A pointer to the element with that key and whether it was inserted.
+     * @note Time Complexity: As for append() or emplace().
+     */
+    template <typename... Args>
+    pair<ElementPointer, bool> insert_hint(const_iterator hint, Args &&...args) {
+        if (hint == cend())
+            return append(std::forward<Args>(args)...);
+        return emplace(std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Inserts key with a mapped value constructed in place from args, but
+     *        only if key is absent; otherwise nothing is constructed or moved.
+     * @return A pointer to the element with that key and whether it was inserted.
+     * @note Time Complexity: O(log n). Map mode only.
+     */
+    template <typename K, typename... Args>
+    pair<ElementPointer, bool> try_emplace(K &&key, Args &&...args) {
+        static_assert(!is_void<Value>::value, "try_emplace requires a mapped type");
+        pair<Node *, bool> result = insertNode(key, piecewise_construct,
+                                               forward_as_tuple(std::forward<K>(key)),
+                                               forward_as_tuple(std::forward<Args>(args)...));
+        return {&result.first->value, result.second};
+    }
+
+    /**
+     * @brief Inserts key with the given mapped value, or move-assigns the value
+     *        of the existing element with that key.
+     * @return A pointer to the element with that key and whether it was inserted.
+     * @note Time Complexity: O(log n). Map mode only.
+     */
+    template <typename K, typename M>
+    pair<ElementPointer, bool> insert_or_assign(K &&key, M &&mapped) {
+        static_assert(!is_void<Value>::value, "insert_or_assign requires a mapped type");
+        Node **path[kMaxHeight];
+        int depth = 0;
+
+        countStat(Stat::kInserts);
+        Node **link = descend(key, path, depth);
+        if (*link != nullptr) {
+            (*link)->value.second = std::forward<M>(mapped);
+            reaggregatePath(path, depth, *link);
+            return {&(*link)->value, false};
+        }
+
+        Node *node = nodePool().create(piecewise_construct, forward_as_tuple(std::forward<K>(key)),
+                                 forward_as_tuple(std::forward<M>(mapped)));
+        linkNode(path, depth, link, node);
+        return {&node->value, true};
+    }
+
+    /**
+     * @brief Calls fn on the mapped value of key, if present, and then
+     *        recomputes the subtree aggregates above it. This is the way to
+     *        update a value in place in an aggregated map, whose elements are
+     *        otherwise read-only.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log n). Map mode only.
+     */
+    template <typename Fn>
+    bool modify(const Key &key, Fn &&fn) {
+        static_assert(!is_void<Value>::value, "modify requires a mapped type");
+        Node **path[kMaxHeight];
+        int depth = 0;
+
+        countStat(Stat::kSearches);
+        Node **link = descend(key, path, depth);
+        if (*link == nullptr)
+            return false;
+        try {
+            fn((*link)->value.second);
+        } catch (...) {
+            reaggregatePath(path, depth, *link);
+            throw;
+        }
+        reaggregatePath(path, depth, *link);
+        return true;
+    }
+
+    /**
+     * @brief Inserts a batch of elements. The batch is sorted once and then
+     *        merged into the tree top-down, so nodes shared by the search paths
+     *        of many keys are visited once. Batches larger than a quarter of
+     *        the tree fall back to one linear merge and rebuild. Elements whose
+     *        key is already present, or repeated in the batch, are skipped.
+     * @return The number of elements actually inserted.
+     * @note Time Complexity: O(m log m + m log(n / m + 1)) for m elements.
+     */
+    template <typename It>
+    size_t insert_batch(It first, It last) {
+        static_assert(!kMultiset, "insert_batch is not defined in multiset mode");
+        vector<It> batch = sortBatch(first, last, [](const auto &value) -> const Key & { return Values::key(value); });
+        if (batch.empty())
+            return 0;
+
+        size_t inserted = 0;
+        if (batch.size() * kRebuildRatio > size()) {
+            vector<Node *> existing, merged;
+            existing.reserve(size());
+            collectNodes(root, existing);
+            merged.reserve(existing.size() + batch.size());
+
+            // The tree is left linked as it is until every new node exists, so
+            // a throwing constructor only has to undo the fresh nodes
+            vector<Node *> fresh;
+            size_t i = 0;
+            try {
+                for (const It &it : batch) {
+                    const Key &key = Values::key(*it);
+                    for (; i < existing.size() && comp(keyOf(existing[i]), key); ++i)
+                        merged.push_back(existing[i]);
+                    if (i < existing.size() && !comp(key, keyOf(existing[i])))
+                        continue;
+                    fresh.push_back(nodePool().create(*it));
+                    merged.push_back(fresh.back());
+                }
+            } catch (...) {
+                for (Node *node : fresh)
+                    nodePool().destroy(node);
+                throw;
+            }
+            inserted = fresh.size();
+            merged.insert(merged.end(), existing.begin() + i, existing.end());
+            relinkAll(merged);
+            return inserted;
+        }
+
+        // As above, every new node is constructed before the tree is
+        // restructured, so a throw leaves the tree as it was
+        const It *batchFirst = batch.data(), *batchLast = batchFirst + batch.size();
+        vector<pair<const It *, const It *>> gaps;
+        batchGaps(root, batchFirst, batchLast, gaps);
+        vector<BuiltSubtree> built;
+        built.reserve(gaps.size());
+        try {
+            for (const auto &gap : gaps) {
+                int height;
+                Node *node = buildBatch(gap.first, gap.second, height);
+                built.push_back({node, height});
+                inserted += static_cast<size_t>(gap.second - gap.first);
+            }
+        } catch (...) {
+            for (const BuiltSubtree &subtree : built)
+                destroySubtree(subtree.node);
+            throw;
+        }
+
+        int h;
+        const BuiltSubtree *next = built.data();
+        root = insertSorted(root, subtreeHeight(root), batchFirst, batchLast, h, next);
+        nodeCount += inserted;
+        ++version;
+        return inserted;
+    }
+
+    /**
+     * @brief Removes a batch of keys, sorting it once and walking the tree
+     *        top-down like insert_batch; large batches fall back to a linear
+     *        filter and rebuild. In multiset mode every occurrence of a listed
+     *        key is removed, like std::multiset::erase(key), whereas remove()
+     *        drops a single occurrence.
+     * @return The number of elements actually removed, counting occurrences.
+     * @note Time Complexity: O(m log m + m log n) for m keys.
+     */
+    template <typename It>
+    size_t erase_batch(It first, It last) {
+        vector<It> batch = sortBatch(first, last, [](const Key &key) -> const Key & { return key; });
+        if (batch.empty() || root == nullptr)
+            return 0;
+
+        size_t removed = 0;
+        if (batch.size() * kRebuildRatio > size()) {
+            vector<Node *> existing, kept;
+            existing.reserve(size());
+            collectNodes(root, existing);
+            kept.reserve(existing.size());
+
+            size_t j = 0;
+            for (Node *node : existing) {
+                for (; j < batch.size() && comp(*batch[j], keyOf(node)); ++j) {
+                }
+                if (j < batch.size() && !comp(keyOf(node), *batch[j])) {
+                    removed += occurrences(node);
+                    nodePool().destroy(node);
+                } else {
+                    kept.push_back(node);
+                }
+            }
+            relinkAll(kept);
+            return removed;
+        }
+
+        int h;
+        root = eraseSorted(root, subtreeHeight(root), batch.data(), batch.data() + batch.size(), h, removed);
+        nodeCount -= removed;
+        ++version;
+        return removed;
+    }
+
+    /**
+     * @brief Splits the tree around key. This tree keeps the keys below key,
+     *        and the keys from key upwards are moved to the returned tree. Both
+     *        trees share the node pool, so no node is copied or reallocated.
+     * @note Time Complexity: O(log n).
+     */
+    AVLTree split(const Key &key) {
+        Node *l, *mid, *r;
+        int hl, hr, h;
+        splitNodes(root, subtreeHeight(root), key, l, hl, mid, r, hr);
+
+        AVLTree right;
+        right.pool = pool;
+        right.comp = comp;
+        right.root = mid ? joinNodes(nullptr, 0, mid, r, hr, h) : r;
+        right.sizeKnown = false;
+
+        root = l;
+        sizeKnown = false;
+        ++version;
+        return right;
+    }
+
+    /**
+     * @brief Concatenates two trees, where every key of left must be below
+     *        every key of right. The nodes of right move into left's pool.
+     * @note Time Complexity: O(log n + c), where c counts right's chunks when
+     *       the trees do not already share a pool.
+     */
+    static AVLTree join(AVLTree &&left, AVLTree &&right) {
+        bool known = left.sizeKnown && right.sizeKnown;
+        size_t count = left.nodeCount + right.nodeCount;
+
+        Node *r = left.adoptNodes(right);
+        assert(!left.root || !r || left.comp(keyOf(left.maxNode()), keyOf(left.minNode(r))));
+        int h;
+        left.root = left.joinTwo(left.root, subtreeHeight(left.root), r, subtreeHeight(r), h);
+        left.setCountAfter(known, count);
+        return std::move(left);
+    }
+
+    /**
+     * @brief Joins left, a new element mid and right into one tree, where the
+     *        key of mid lies strictly between the keys of left and of right.
+     * @note Time Complexity: O(log n + c), as for the two-tree join.
+     */
+    static AVLTree join(AVLTree &&left, value_type mid, AVLTree &&right) {
+        bool known = left.sizeKnown && right.sizeKnown;
+        size_t count = left.nodeCount + right.nodeCount + 1;
+
+        Node *r = left.adoptNodes(right);
+        Node *k = left.nodePool().create(std::move(mid));
+        assert(!left.root || left.comp(keyOf(left.maxNode()), keyOf(k)));
+        assert(!r || left.comp(keyOf(k), keyOf(left.minNode(r))));
+        int h;
+        left.root = left.joinNodes(left.root, subtreeHeight(left.root), k, r, subtreeHeight(r), h);
+        left.setCountAfter(known, count);
+        return std::move(left);
+    }
+
+    /**
+     * @brief Moves every element with a key in [lo, hi) into the returned
+     *        tree with two splits and one join, without touching the elements
+     *        one by one. Both trees share the node pool afterwards.
+     * @note Time Complexity: O(log n). Without order statistics, the next
+     *       size() of either tree counts its nodes once, as after split().
+     */
+    AVLTree extract_range(const Key &lo, const Key &hi) {
+        if (!comp(lo, hi)) {
+            AVLTree none;
+            none.comp = comp;
+            return none;
+        }
+        AVLTree middle = split(lo);
+        AVLTree tail = middle.split(hi);
+        AVLTree kept = join(std::move(*this), std::move(tail));
+        *this = std::move(kept);
+        return middle;
+    }
+
+    /**
+     * @brief Removes every element with a key in [lo, hi). The interval is
+     *        detached as one subtree; for trivially destructible payloads it
+     *        goes back to the node pool in one piece and its slots are reused
+     *        by later inserts, otherwise the payloads are destroyed here.
+     * @note Time Complexity: O(log n) for trivially destructible payloads,
+     *       O(log n + k) for k removed elements otherwise.
+     */
+    void erase_range(const Key &lo, const Key &hi) {
+        AVLTree middle = extract_range(lo, hi);
+        if constexpr (is_trivially_destructible<Node>::value) {
+            if (middle.root != nullptr) {
+                middle.nodePool().retire(middle.root);
+                middle.root = nullptr;
+            }
+        }
+    }
+
+    /**
+     * @brief Adds every element of other to this tree. Where both trees hold a
+     *        key, this tree's element is kept. Other is left empty.
+     * @note Time Complexity: O(m log(n / m + 1)) for trees of sizes m <= n.
+     */
+    void union_with(AVLTree &&other) {
+        unionWith(other, SequentialFork(), false);
+    }
+
+    /**
+     * @brief Keeps only the elements whose key is also in other. Other is left
+     *        empty.
+     * @note Time Complexity: O(m log(n / m + 1)) plus the cost of destroying
+     *       the discarded nodes.
+     */
+    void intersect_with(AVLTree &&other) {
+        intersectWith(other, SequentialFork(), false);
+    }
+
+    /**
+     * @brief Removes every element whose key is in other. Other is left empty.
+     * @note Time Complexity: O(m log(n / m + 1)) plus the cost of destroying
+     *       the discarded nodes.
+     */
+    void difference_with(AVLTree &&other) {
+        differenceWith(other, SequentialFork(), false);
+    }
+
+    /**
+     * @brief Parallel version of union_with. The two halves of every split are
+     *        combined concurrently through executor, which must provide
+     *        parallel_invoke(f1, f2); subtrees below a fixed grain are combined
+     *        sequentially. The comparator must be safe to call concurrently.
+     * @note Work: O(m log(n / m + 1)). Span: O(log^2 n).
+     */
+    template <typename Executor = WorkStealingPool>
+    void parallel_union(AVLTree &&other, Executor &executor = WorkStealingPool::shared()) {
+        unionWith(other, ExecutorFork<Executor>{executor}, true);
+    }
+
+    /**
+     * @brief Parallel version of intersect_with; see parallel_union.
+     */
+    template <typename Executor = WorkStealingPool>
+    void parallel_intersect(AVLTree &&other, Executor &executor = WorkStealingPool::shared()) {
+        intersectWith(other, ExecutorFork<Executor>{executor}, true);
+    }
+
+    /**
+     * @brief Parallel version of difference_with; see parallel_union.
+     */
+    template <typename Executor = WorkStealingPool>
+    void parallel_difference(AVLTree &&other, Executor &executor = WorkStealingPool::shared()) {
+        differenceWith(other, ExecutorFork<Executor>{executor}, true);
+    }
+
+    /**
+     * @brief Removes a key from the AVL tree.
+     * @param key The key to remove.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log n) due to tree traversal and rebalancing operations.
+     */
+    bool remove(const Key &key) {
+        return deleteNode(key);
+    }
+
+    /**
+     * @brief Searches for a key in the AVL tree.
+     * @param key The key to search for.
+     * @return True if the key is found, false otherwise.
+     * @note Time Complexity: O(log n) due to tree traversal.
+     */
+    bool search(const Key &key) const {
+        return searchNode(key) != nullptr;
+    }
+
+    /**
+     * @brief Searches for anything the transparent comparator orders against
+     *        keys, such as a std::string_view probe into std::string keys,
+     *        without constructing a Key.
+     * @note Time Complexity: O(log n).
+     */
+    template <typename K, typename = Transparent<K>>
+    bool search(const K &key) const {
+        return searchNode(key) != nullptr;
+    }
+
+    /**
+     * @brief Counts the occurrences of key: its multiplicity in multiset
+     *        mode, otherwise 0 or 1.
+     * @note Time Complexity: O(log n).
+     */
+    size_t count(const Key &key) const {
+        const Node *node = searchNode(key);
+        return node ? occurrences(node) : 0;
+    }
+
+    template <typename K, typename = Transparent<K>>
+    size_t count(const K &key) const {
+        const Node *node = searchNode(key);
+        return node ? occurrences(node) : 0;
+    }
+
+    /**
+     * @brief Searches for a batch of keys, overlapping the cache misses of
+     *        groups of lookups through software prefetching.
+     * @param keys The keys to search for.
+     * @param n The number of keys.
+     * @param out Receives, for each key, whether it is present.
+     * @note Time Complexity: O(n log size()). Pays off once the tree no longer
+     *       fits in cache.
+     */
+    void search_many(const Key *keys, size_t n, bool *out) const {
+        lowerBoundMany(keys, n, [&](size_t i, const Node *node) { out[i] = node && !comp(keys[i], keyOf(node)); });
+    }
+
+    /**
+     * @brief Batched lower_bound: stores in out[i] a pointer to the first
+     *        element whose key is not less than keys[i], or nullptr if there
+     *        is none.
+     * @note Time Complexity: O(n log size()).
+     */
+    void lower_bound_many(const Key *keys, size_t n, const value_type **out) const {
+        lowerBoundMany(keys, n, [&](size_t i, const Node *node) { out[i] = node ? &node->value : nullptr; });
+    }
+
+    /**
+     * @brief Looks up the element with the given key.
+     * @return A pointer to the element, or nullptr if the key is absent.
+     * @note Time Complexity: O(log n).
+     */
+    ElementPointer find(const Key &key) {
+        Node *node = searchNode(key);
+        return node ? &node->value : nullptr;
+    }
+
+    const value_type *find(const Key &key) const {
+        Node *node = searchNode(key);
+        return node ? &node->value : nullptr;
+    }
+
+    template <typename K, typename = Transparent<K>>
+    ElementPointer find(const K &key) {
+        Node *node = searchNode(key);
+        return node ? &node->value : nullptr;
+    }
+
+    template <typename K, typename = Transparent<K>>
+    const value_type *find(const K &key) const {
+        Node *node = searchNode(key);
+        return node ? &node->value : nullptr;
+    }
+
+    /**
+     * @brief Returns the mapped value of key, throwing std::out_of_range if absent.
+     * @note Time Complexity: O(log n). Map mode only.
+     */
+    template <typename V = Value>
+    conditional_t<kReadOnlyMapped, const V &, V &> at(const Key &key) {
+        Node *node = searchNode(key);
+        if (node == nullptr)
+            throw out_of_range("AVLTree::at: key not found");
+        return node->value.second;
+    }
+
+    /**
+     * @brief Returns an iterator to the smallest element, or end() if empty.
+     * @note Time Complexity: O(log n).
+     */
+    iterator begin() {
+        iterator it(root);
+        it.descendLeftmost(root);
+        return it;
+    }
+
+    const_iterator begin() const {
+        const_iterator it(root);
+        it.descendLeftmost(root);
+        return it;
+    }
+
+    iterator end() {
+        return iterator(root);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    /**
+     * @brief Returns an iterator to the first element whose key is not less
+     *        than key, or end() if there is none.
+     * @note Time Complexity: O(log n).
+     */
+    iterator lower_bound(const Key &key) {
+        return boundAt<iterator>(key, false);
+    }
+
+    const_iterator lower_bound(const Key &key) const {
+        return boundAt<const_iterator>(key, false);
+    }
+
+    template <typename K, typename = Transparent<K>>
+    iterator lower_bound(const K &key) {
+        return boundAt<iterator>(key, false);
+    }
+
+    template <typename K, typename = Transparent<K>>
+    const_iterator lower_bound(const K &key) const {
+        return boundAt<const_iterator>(key, false);
+    }
+
+    /**
+     * @brief Returns an iterator to the first element whose key is greater
+     *        than key, or end() if there is none.
+     * @note Time Complexity: O(log n).
+     */
+    iterator upper_bound(const Key &key) {
+        return boundAt<iterator>(key, true);
+    }
+
+    const_iterator upper_bound(const Key &key) const {
+        return boundAt<const_iterator>(key, true);
+    }
+
+    template <typename K, typename = Transparent<K>>
+    iterator upper_bound(const K &key) {
+        return boundAt<iterator>(key, true);
+    }
+
+    template <typename K, typename = Transparent<K>>
+    const_iterator upper_bound(const K &key) const {
+        return boundAt<const_iterator>(key, true);
+    }
+
+    /**
+     * @brief Returns the range of elements with the given key.
+     * @note Time Complexity: O(log n).
+     */
+    pair<iterator, iterator> equal_range(const Key &key) {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    pair<const_iterator, const_iterator> equal_range(const Key &key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    template <typename K, typename = Transparent<K>>
+    pair<iterator, iterator> equal_range(const K &key) {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    template <typename K, typename = Transparent<K>>
+    pair<const_iterator, const_iterator> equal_range(const K &key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    /**
+     * @brief Calls fn on every element whose key is in the half-open range
+     *        [lo, hi), in key order, without allocating.
+     * @note Time Complexity: O(log n + k) for k visited elements.
+     */
+    template <typename Fn>
+    void for_each_in_range(const Key &lo, const Key &hi, Fn &&fn) {
+        for (iterator it = lower_bound(lo); it != end() && comp(keyOf(it.node()), hi); ++it)
+            fn(*it);
+    }
+
+    template <typename Fn>
+    void for_each_in_range(const Key &lo, const Key &hi, Fn &&fn) const {
+        for (const_iterator it = lower_bound(lo); it != end() && comp(keyOf(it.node()), hi); ++it)
+            fn(*it);
+    }
+
+    /**
+     * @brief Counts the keys that compare less than key.
+     * @note Time Complexity: O(log n). Requires order statistics.
+     */
+    size_t rank(const Key &key) const {
+        static_assert(kOrderStatistics, "rank requires OrderStatisticsOptions");
+        size_t result = 0;
+        const Node *node = root;
+        while (node != nullptr) {
+            if (comp(keyOf(node), key)) {
+                result += subtreeSize(node->left) + occurrences(node);
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Returns the k-th smallest element, counting from zero.
+     * @return A pointer to the element, or nullptr if k >= size().
+     * @note Time Complexity: O(log n). Requires order statistics.
+     */
+    const value_type *select(size_t k) const {
+        static_assert(kOrderStatistics, "select requires OrderStatisticsOptions");
+        const Node *node = root;
+        while (node != nullptr) {
+            size_t leftSize = subtreeSize(node->left);
+            if (k < leftSize) {
+                node = node->left;
+            } else if (k < leftSize + occurrences(node)) {
+                return &node->value;
+            } else {
+                k -= leftSize + occurrences(node);
+                node = node->right;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Counts the keys in the half-open range [lo, hi).
+     * @note Time Complexity: O(log n). Requires order statistics.
+     */
+    size_t count_range(const Key &lo, const Key &hi) const {
+        if (!comp(lo, hi))
+            return 0;
+        return rank(hi) - rank(lo);
+    }
+
+    /**
+     * @brief Folds the aggregate policy over the elements with keys in the
+     *        half-open range [lo, hi), in key order. Below the node where the
+     *        searches for lo and hi part, every subtree lying wholly inside
+     *        the range contributes its stored aggregate. Under an aggregate
+     *        policy, mapped values are read-only through find(), at() and
+     *        iterators; change them with modify() or insert_or_assign(),
+     *        which keep the stored aggregates current.
+     * @return The combined value, or the policy's identity for an empty range.
+     * @note Time Complexity: O(log n). Requires an aggregate policy.
+     */
+    template <typename A = Aggregate>
+    typename A::type aggregate(const Key &lo, const Key &hi) const {
+        static_assert(kAggregated, "aggregate requires an aggregate policy in the options");
+        if (!comp(lo, hi))
+            return A::identity();
+
+        const Node *split = root;
+        while (split != nullptr) {
+            if (comp(keyOf(split), lo))
+                split = split->right;
+            else if (!comp(keyOf(split), hi))
+                split = split->left;
+            else
+                break;
+        }
+        if (split == nullptr)
+            return A::identity();
+
+        // Keys from lo upwards in the left subtree, gathered right to left
+        typename A::type low = A::identity();
+        for (const Node *node = split->left; node != nullptr;) {
+            if (comp(keyOf(node), lo)) {
+                node = node->right;
+            } else {
+                low = A::combine(A::combine(A::lift(node->value), subtreeAggregate(node->right)), low);
+                node = node->left;
+            }
+        }
+
+        // Keys below hi in the right subtree, gathered left to right
+        typename A::type high = A::identity();
+        for (const Node *node = split->right; node != nullptr;) {
+            if (comp(keyOf(node), hi)) {
+                high = A::combine(high, A::combine(subtreeAggregate(node->left), A::lift(node->value)));
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+        return A::combine(A::combine(low, A::lift(split->value)), high);
+    }
+
+    /**
+     * @brief Calls fn in key order on every element whose key is not above hi
+     *        and whose lifted aggregate satisfies keep. Subtrees whose stored
+     *        aggregate fails keep are skipped whole, so keep must hold for a
+     *        combined value whenever it holds for one of its parts, as with
+     *        "maximum at least x".
+     * @note Time Complexity: O(min(n, (k + 1) log n)) for k visited elements.
+     *       Requires an aggregate policy.
+     */
+    template <typename Keep, typename Fn>
+    void for_each_pruned(const Key &hi, Keep &&keep, Fn &&fn) const {
+        static_assert(kAggregated, "for_each_pruned requires an aggregate policy in the options");
+        const Node *stack[kMaxHeight];
+        int depth = 0;
+        const Node *node = root;
+        while (true) {
+            for (; node != nullptr && keep(node->aggregate); node = node->left)
+                stack[depth++] = node;
+            if (depth == 0)
+                return;
+            node = stack[--depth];
+            if (comp(hi, keyOf(node)))
+                return;
+            if (keep(Aggregate::lift(node->value)))
+                fn(node->value);
+            node = node->right;
+        }
+    }
+
+    /**
+     * @brief Moves every element into an immutable FrozenAVLTree laid out in
+     *        van Emde Boas order, leaving this tree empty.
+     * @note Time Complexity: O(n log log n).
+     */
+    FrozenAVLTree<Key, Value, Compare> freeze() {
+        static_assert(!kMultiset, "frozen trees keep no occurrence counts");
+        vector<Node *> nodes;
+        nodes.reserve(size());
+        collectNodes(root, nodes);
+        vector<value_type> sorted;
+        sorted.reserve(nodes.size());
+        for (Node *node : nodes)
+            sorted.push_back(std::move(node->value));
+
+        FrozenAVLTree<Key, Value, Compare> frozen(std::move(sorted), comp);
+        clear();
+        return frozen;
+    }
+
+    /**
+     * @brief Writes the tree to path as a checksummed binary snapshot with one
+     *        record per node in pre-order. The file is replaced atomically.
+     * @throws std::runtime_error if the file cannot be written.
+     * @note Time Complexity: O(n).
+     */
+    void save(const string &path) const {
+        static_assert(is_trivially_copyable<Record>::value, "save() needs trivially copyable keys and values");
+        static_assert(!kMultiset, "snapshots keep no occurrence counts");
+        size_t n = size();
+        if (n >= AVLSnapshotFormat::kNone)
+            throw runtime_error("AVLTree::save: too many elements");
+
+        // Value-initialized, so padding bytes are zero and the checksum is
+        // deterministic
+        vector<Record> records(n);
+        // Right subtrees still to be written, with the record to point at them
+        struct Pending {
+            const Node *node;
+            uint32_t parent;
+        };
+        Pending stack[kMaxHeight];
+        int depth = 0;
+        uint32_t next = 0;
+        if (root != nullptr)
+            stack[depth++] = {root, AVLSnapshotFormat::kNone};
+        while (depth > 0) {
+            Pending pending = stack[--depth];
+            if (pending.parent != AVLSnapshotFormat::kNone)
+                records[pending.parent].right = next;
+            for (const Node *node = pending.node; node != nullptr; node = node->left, ++next) {
+                Record &record = records[next];
+                storeRecord(record, node->value);
+                record.balance = node->balance;
+                record.left = node->left ? next + 1 : AVLSnapshotFormat::kNone;
+                record.right = AVLSnapshotFormat::kNone;
+                if (node->right != nullptr)
+                    stack[depth++] = {node->right, next};
+            }
+        }
+
+        AVLSnapshotFormat::Header header = {};
+        memcpy(header.magic, AVLSnapshotFormat::kMagic, sizeof(header.magic));
+        header.version = AVLSnapshotFormat::kVersion;
+        header.byteOrder = AVLSnapshotFormat::kByteOrder;
+        header.recordSize = sizeof(Record);
+        header.count = n;
+        header.checksum = AVLSnapshotFormat::checksum(records.data(), n * sizeof(Record));
+        AVLSnapshotFormat::writeFile(path, header, records.data(), n * sizeof(Record));
+    }
+
+    /**
+     * @brief Reads a snapshot written by save(). Nodes are placed in one
+     *        contiguous block and linked into exactly the saved shape, so no
+     *        rotation happens; the checksum, the links, the balance factors
+     *        and the key order are all verified.
+     * @throws std::runtime_error if the file is missing or fails any check.
+     * @note Time Complexity: O(n).
+     */
+    static AVLTree load(const string &path, const Compare &comp = Compare()) {
+        MappedAVLTree<Key, Value, Compare> mapped(path, true, comp);
+        AVLTree tree;
+        tree.comp = comp;
+        if (!tree.adoptRecords(mapped.data(), mapped.size()))
+            throw runtime_error("AVLTree::load: " + path + " is corrupt");
+        return tree;
+    }
+
+    /**
+     * @brief Maps a snapshot written by save() for searching in place.
+     * @throws std::runtime_error if the file cannot be mapped.
+     * @note Time Complexity: O(1).
+     */
+    static MappedAVLTree<Key, Value, Compare> open_mmap(const string &path, const Compare &comp = Compare()) {
+        return MappedAVLTree<Key, Value, Compare>(path, false, comp);
+    }
+
+#if AVL_TREE_STATS
+    /**
+     * @brief Returns the hot-path counters since the last reset_stats(),
+     *        summed over all threads. The counters are shared by every AVLTree
+     *        in the process. Only available when AVL_TREE_STATS is set.
+     * @note Time Complexity: O(t) for t threads that have used a tree.
+     */
+    static AVLTreeStats stats() {
+        return AVLTreeStatsRecorder::snapshot();
+    }
+
+    /**
+     * @brief Starts a new measurement interval for stats().
+     */
+    static void reset_stats() {
+        AVLTreeStatsRecorder::reset();
+    }
+#endif
+
+    /**
+     * @brief Checks the search-order and balance-factor invariants of the tree.
+     * @return True if every invariant holds.
+     * @note Time Complexity: O(n). Intended for tests.
+     */
+    bool isValid() const {
+        return checkSubtree(root, nullptr, nullptr) >= 0;
+    }
+};
+
+/**
+ * @brief Immutable search tree stored in one contiguous array in van Emde
+ *        Boas order. Each subtree of roughly sqrt(n) nodes is contiguous, so a
+ *        root-to-leaf walk touches O(log_B n) cache lines for any line size B
+ *        instead of about one per level. Children are found through 32-bit
+ *        indices into the array.
+ *
+ * Built by AVLTree::freeze() or directly from sorted, unique elements, and
+ * turned back into a mutable tree by thaw().
+ */
+template <typename Key, typename Value, typename Compare>
+class FrozenAVLTree {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = typename AVLTreeValue<Key, Value>::type;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+private:
+    using Values = AVLTreeValue<Key, Value>;
+
+    static constexpr uint32_t kNone = ~uint32_t(0);
+    // The balanced shape has at most 32 levels for 32-bit indices
+    static constexpr int kMaxHeight = 33;
+
+    struct Slot {
+        value_type value;
+        uint32_t left;
+        uint32_t right;
+
+        Slot(value_type &&value, uint32_t left, uint32_t right) : value(std::move(value)), left(left), right(right) {}
+    };
+
+    // The root is slots[0]
+    vector<Slot> slots;
+    Compare comp;
+
+    static const Key &keyOf(const Slot &slot) {
+        return Values::key(slot.value);
+    }
+
+    // Height of the tree over n sorted elements split at their middle
+    static int heightOf(size_t n) {
+        int h = 0;
+        for (; n != 0; n >>= 1)
+            ++h;
+        return h;
+    }
+
+    // Numbers the top `levels` levels of the subtree over sorted [lo, hi) in
+    // van Emde Boas order: the upper half of the levels first, then each
+    // subtree hanging below them, left to right, each laid out the same way
+    static void layout(size_t lo, size_t hi, int levels, vector<uint32_t> &position, uint32_t &next) {
+        if (lo >= hi || levels == 0)
+            return;
+        if (levels == 1) {
+            position[lo + (hi - lo) / 2] = next++;
+            return;
+        }
+        int top = levels / 2;
+        layout(lo, hi, top, position, next);
+        layoutBelow(lo, hi, top, levels - top, position, next);
+    }
+
+    // Lays out, left to right, the subtrees depth levels below the subtree
+    // over [lo, hi), with the given number of levels each
+    static void layoutBelow(size_t lo, size_t hi, int depth, int levels, vector<uint32_t> &position,
+                            uint32_t &next) {
+        if (lo >= hi)
+            return;
+        if (depth == 0) {
+            layout(lo, hi, levels, position, next);
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        layoutBelow(lo, mid, depth - 1, levels, position, next);
+        layoutBelow(mid + 1, hi, depth - 1, levels, position, next);
+    }
+
+    // Records the positions of the children of every element of [lo, hi).
+    // Returns the position of the subtree root.
+    static uint32_t link(size_t lo, size_t hi, const vector<uint32_t> &position, vector<uint32_t> &left,
+                         vector<uint32_t> &right) {
+        if (lo >= hi)
+            return kNone;
+        size_t mid = lo + (hi - lo) / 2;
+        left[mid] = link(lo, mid, position, left, right);
+        right[mid] = link(mid + 1, hi, position, left, right);
+        return position[mid];
+    }
+
+    // In-order walk with a fixed-depth stack, passing each slot to fn
+    template <typename Self, typename Fn>
+    static void inOrder(Self &self, Fn &fn) {
+        uint32_t stack[kMaxHeight];
+        int depth = 0;
+        uint32_t i = self.slots.empty() ? kNone : 0;
+        while (i != kNone || depth > 0) {
+            for (; i != kNone; i = self.slots[i].left)
+                stack[depth++] = i;
+            i = stack[--depth];
+            fn(self.slots[i]);
+            i = self.slots[i].right;
+        }
+    }
+
+    template <typename Fn>
+    void inOrder(Fn &&fn) {
+        inOrder(*this, fn);
+    }
+
+    template <typename Fn>
+    void inOrder(Fn &&fn) const {
+        inOrder(*this, fn);
+    }
+
+public:
+    FrozenAVLTree() = default;
+
+    /**
+     * @brief Lays out elements, which must be sorted by key without
+     *        duplicates.
+     * @note Time Complexity: O(n log log n).
+     */
+    explicit FrozenAVLTree(vector<value_type> &&sorted, const Compare &comp = Compare()) : comp(comp) {
+        size_t n = sorted.size();
+        if (n >= kNone)
+            throw length_error("FrozenAVLTree: too many elements");
+
+        vector<uint32_t> position(n), left(n), right(n);
+        uint32_t next = 0;
+        layout(0, n, heightOf(n), position, next);
+        link(0, n, position, left, right);
+
+        vector<uint32_t> ranked(n);
+        for (size_t i = 0; i < n; ++i)
+            ranked[position[i]] = static_cast<uint32_t>(i);
+        slots.reserve(n);
+        for (uint32_t i : ranked)
+            slots.emplace_back(std::move(sorted[i]), left[i], right[i]);
+    }
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    bool empty() const {
+        return slots.empty();
+    }
+
+    /**
+     * @brief Searches for a key.
+     * @note Time Complexity: O(log n), with O(log_B n) cache misses.
+     */
+    bool search(const Key &key) const {
+        return find(key) != nullptr;
+    }
+
+    /**
+     * @brief Looks up the element with the given key.
+     * @return A pointer to the element, or nullptr if the key is absent.
+     */
+    const value_type *find(const Key &key) const {
+        uint32_t i = slots.empty() ? kNone : 0;
+        while (i != kNone) {
+            const Slot &slot = slots[i];
+            if (comp(key, keyOf(slot)))
+                i = slot.left;
+            else if (comp(keyOf(slot), key))
+                i = slot.right;
+            else
+                return &slot.value;
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Returns the first element whose key is not less than key.
+     * @return A pointer to the element, or nullptr if there is none.
+     */
+    const value_type *lower_bound(const Key &key) const {
+        const value_type *best = nullptr;
+        uint32_t i = slots.empty() ? kNone : 0;
+        while (i != kNone) {
+            const Slot &slot = slots[i];
+            if (comp(keyOf(slot), key)) {
+                i = slot.right;
+            } else {
+                best = &slot.value;
+                i = slot.left;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * @brief Calls fn on every element in key order.
+     * @note Time Complexity: O(n).
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const {
+        inOrder([&](const Slot &slot) { fn(slot.value); });
+    }
+
+    /**
+     * @brief Moves the elements back into a mutable AVLTree, leaving this one
+     *        empty.
+     * @note Time Complexity: O(n).
+     */
+    template <typename Options = AVLTreeOptions>
+    AVLTree<Key, Value, Compare, Options> thaw() {
+        vector<value_type> sorted;
+        sorted.reserve(slots.size());
+        inOrder([&](Slot &slot) { sorted.push_back(std::move(slot.value)); });
+        slots.clear();
+        return AVLTree<Key, Value, Compare, Options>::build_from_sorted(
+            make_move_iterator(sorted.begin()), make_move_iterator(sorted.end()), false, comp);
+    }
+
+    /**
+     * @brief Returns the bytes used by the array.
+     */
+    size_t bytesUsed() const {
+        return slots.capacity() * sizeof(Slot);
+    }
+};
+
+/**
+ * @brief Read-only search tree over N keys fixed at compile time. The keys
+ *        are sorted and placed in Eytzinger order by a constexpr constructor:
+ *        slot 1 is the root and slot k has its children in slots 2k and
+ *        2k + 1. That shape is a complete binary tree, so it is AVL balanced,
+ *        and the tree lives in a std::array. A constexpr instance therefore
+ *        needs neither a heap allocation nor a static initializer, and its
+ *        lookups can run at compile time too.
+ *
+ * Duplicate keys make the constructor throw, which fails compilation when it
+ * is evaluated as a constant expression.
+ */
+template <typename Key, size_t N, typename Compare = std::less<Key>>
+class StaticAVLTree {
+public:
+    using key_type = Key;
+    using value_type = Key;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+private:
+    // slots[0] is unused so that the children of slot k are 2k and 2k + 1
+    array<Key, N + 1> slots{};
+    Compare comp{};
+
+    // Fills the subtree rooted at slot k from sorted, in order, advancing next
+    constexpr void place(const array<Key, N> &sorted, size_t k, size_t &next) {
+        if (k > N)
+            return;
+        place(sorted, 2 * k, next);
+        slots[k] = sorted[next++];
+        place(sorted, 2 * k + 1, next);
+    }
+
+    // Index of the slot holding key, or 0 if there is none
+    constexpr size_t slotOf(const Key &key) const {
+        size_t k = 1;
+        while (k <= N) {
+            if (comp(key, slots[k]))
+                k = 2 * k;
+            else if (comp(slots[k], key))
+                k = 2 * k + 1;
+            else
+                return k;
+        }
+        return 0;
+    }
+
+    // Index of the slot holding the first key not less than key, or 0. The
+    // descent always runs to a leaf without branching on the outcome; the
+    // answer is the last node where it went left, found by dropping the
+    // trailing right turns from the final index.
+    constexpr size_t lowerSlot(const Key &key) const {
+        size_t k = 1;
+        while (k <= N)
+            k = 2 * k + static_cast<size_t>(comp(slots[k], key));
+        while (k & 1)
+            k >>= 1;
+        return k >> 1;
+    }
+
+    template <typename Fn>
+    constexpr void inOrder(size_t k, Fn &fn) const {
+        if (k > N)
+            return;
+        inOrder(2 * k, fn);
+        fn(slots[k]);
+        inOrder(2 * k + 1, fn);
+    }
+
+public:
+    /**
+     * @brief Builds the tree from keys in any order.
+     * @throws std::invalid_argument if a key repeats.
+     * @note Time Complexity: O(N^2) comparisons, normally paid by the compiler.
+     */
+    constexpr explicit StaticAVLTree(array<Key, N> keys, const Compare &comp = Compare()) : comp(comp) {
+        // Insertion sort, since std::sort is not constexpr before C++20
+        for (size_t i = 1; i < N; ++i) {
+            Key key = keys[i];
+            size_t j = i;
+            for (; j > 0 && comp(key, keys[j - 1]); --j)
+                keys[j] = keys[j - 1];
+            keys[j] = key;
+        }
+        for (size_t i = 1; i < N; ++i)
+            if (!comp(keys[i - 1], keys[i]))
+                throw invalid_argument("StaticAVLTree: duplicate key");
+        size_t next = 0;
+        place(keys, 1, next);
+    }
+
+    constexpr size_t size() const {
+        return N;
+    }
+
+    constexpr bool empty() const {
+        return N == 0;
+    }
+
+    /**
+     * @brief Searches for a key.
+     * @note Time Complexity: O(log N).
+     */
+    constexpr bool search(const Key &key) const {
+        return slotOf(key) != 0;
+    }
+
+    /**
+     * @brief Returns a pointer to the stored key equal to key, or nullptr.
+     * @note Time Complexity: O(log N).
+     */
+    constexpr const Key *find(const Key &key) const {
+        size_t k = slotOf(key);
+        return k == 0 ? nullptr : &slots[k];
+    }
+
+    /**
+     * @brief Returns the first key not less than key, or nullptr if there is
+     *        none.
+     * @note Time Complexity: O(log N), without data-dependent branches in
+     *       the descent.
+     */
+    constexpr const Key *lower_bound(const Key &key) const {
+        size_t k = lowerSlot(key);
+        return k == 0 ? nullptr : &slots[k];
+    }
+
+    /**
+     * @brief Calls fn on every key in order.
+     * @note Time Complexity: O(N).
+     */
+    template <typename Fn>
+    constexpr void for_each(Fn &&fn) const {
+        inOrder(1, fn);
+    }
+};
+
+template <typename Key, size_t N>
+StaticAVLTree(array<Key, N>) -> StaticAVLTree<Key, N>;
+
+/**
+ * @brief Read-only view of a binary snapshot written by AVLTree::save(),
+ *        searched in place through a shared memory mapping of the file.
+ *        Opening costs O(1) regardless of size; pages are faulted in as
+ *        searches reach them, and children are followed by record index, so
+ *        no pointer ever has to be fixed up.
+ *
+ * Every step of a search checks that the next index lies inside the file and
+ * after the current record, so a damaged file can make lookups fail but can
+ * never make them read out of bounds or loop.
+ */
+template <typename Key, typename Value, typename Compare>
+class MappedAVLTree {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using record_type = AVLSnapshotRecord<Key, Value>;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+private:
+    using Format = AVLSnapshotFormat;
+
+    static_assert(is_trivially_copyable<record_type>::value, "snapshots need trivially copyable keys and values");
+    static_assert(alignof(record_type) <= alignof(Format::Header), "records must stay aligned behind the header");
+
+    void *base = nullptr;
+    size_t bytes = 0;
+    const record_type *records = nullptr;
+    size_t count = 0;
+    Compare comp;
+
+    // Unmaps the file, leaving the view empty
+    void unmap() {
+        if (base != nullptr)
+            ::munmap(base, bytes);
+        base = nullptr;
+        bytes = 0;
+        records = nullptr;
+        count = 0;
+    }
+
+public:
+    /**
+     * @brief Maps the snapshot at path.
+     * @param verify If true, the checksum of every record is checked, which
+     *        reads the whole file.
+     * @throws std::runtime_error if the file cannot be mapped or its header
+     *         does not describe a snapshot of this key and value type.
+     * @note Time Complexity: O(1), or O(n) with verify.
+     */
+    explicit MappedAVLTree(const string &path, bool verify = false, const Compare &comp = Compare()) : comp(comp) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("MappedAVLTree: cannot open " + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Format::Header)) {
+            ::close(fd);
+            throw runtime_error("MappedAVLTree: " + path + " is not a snapshot");
+        }
+        bytes = static_cast<size_t>(info.st_size);
+        base = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            throw runtime_error("MappedAVLTree: cannot map " + path);
+        }
+
+        Format::Header header;
+        memcpy(&header, base, sizeof(header));
+        size_t available = (bytes - sizeof(header)) / sizeof(record_type);
+        bool ok = memcmp(header.magic, Format::kMagic, sizeof(header.magic)) == 0 &&
+                  header.version == Format::kVersion && header.byteOrder == Format::kByteOrder &&
+                  header.recordSize == sizeof(record_type) && header.count < Format::kNone &&
+                  header.count == available && sizeof(header) + available * sizeof(record_type) == bytes;
+        records = reinterpret_cast<const record_type *>(static_cast<const char *>(base) + sizeof(header));
+        count = static_cast<size_t>(header.count);
+        if (ok && verify)
+            ok = Format::checksum(records, count * sizeof(record_type)) == header.checksum;
+        if (!ok) {
+            unmap();
+            throw runtime_error("MappedAVLTree: " + path + " is not a valid snapshot");
+        }
+    }
+
+    MappedAVLTree(const MappedAVLTree &) = delete;
+    MappedAVLTree &operator=(const MappedAVLTree &) = delete;
+
+    MappedAVLTree(MappedAVLTree &&other) noexcept
+        : base(other.base), bytes(other.bytes), records(other.records), count(other.count), comp(other.comp) {
+        other.base = nullptr;
+        other.records = nullptr;
+        other.bytes = other.count = 0;
+    }
+
+    MappedAVLTree &operator=(MappedAVLTree &&other) noexcept {
+        if (this != &other) {
+            unmap();
+            swap(base, other.base);
+            swap(bytes, other.bytes);
+            swap(records, other.records);
+            swap(count, other.count);
+            comp = other.comp;
+        }
+        return *this;
+    }
+
+    ~MappedAVLTree() {
+        unmap();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    /**
+     * @brief Returns the record holding key, or nullptr if it is absent.
+     * @note Time Complexity: O(log n).
+     */
+    const record_type *find(const Key &key) const {
+        size_t i = 0;
+        if (count == 0)
+            return nullptr;
+        while (true) {
+            const record_type &record = records[i];
+            size_t next;
+            if (comp(key, record.key))
+                next = record.left;
+            else if (comp(record.key, key))
+                next = record.right;
+            else
+                return &record;
+            // Also stops at kNone, which is never below count
+            if (next <= i || next >= count)
+                return nullptr;
+            i = next;
+        }
+    }
+
+    /**
+     * @brief Searches for a key.
+     * @note Time Complexity: O(log n).
+     */
+    bool search(const Key &key) const {
+        return find(key) != nullptr;
+    }
+
+    /**
+     * @brief Returns the records in file order, which is pre-order.
+     */
+    const record_type *data() const {
+        return records;
+    }
+};
+
+/**
+ * @brief AVLTree made durable by a binary snapshot plus an append-only
+ *        write-ahead log. Every insert and remove appends one compact record
+ *        to a buffer; commit() writes the buffer and issues a single fsync, so
+ *        the cost of durability follows the write rate rather than the tree
+ *        size. compact() folds the log into a fresh snapshot.
+ *
+ * Files are path + ".snapshot" and path + ".wal". Opening loads the snapshot,
+ * if any, and replays the log over it. Records only ever set or erase one
+ * key, so replaying a log over a snapshot that already contains some of its
+ * effects yields the same tree, which is what makes compaction crash-safe;
+ * multiset counts would not survive that, so multiset mode is rejected.
+ * A torn record at the end of the log, left by a crash during a write, is
+ * cut off on replay.
+ *
+ * Record framing: varint payload length, payload, 32-bit checksum of the
+ * payload. The payload is an operation byte followed by the key and, for
+ * inserts in map mode, the mapped value; integers are zigzag varints and
+ * other trivially copyable types are stored as raw bytes.
+ */
+template <typename Key = int, typename Value = void, typename Compare = std::less<Key>,
+          typename Options = AVLTreeOptions>
+class DurableAVLTree {
+    // Replaying a log over a snapshot that already holds some of its inserts
+    // would count those occurrences twice
+    static_assert(!Options::multiset, "DurableAVLTree does not support multiset mode");
+
+public:
+    using Tree = AVLTree<Key, Value, Compare, Options>;
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = typename Tree::value_type;
+
+private:
+    enum Op : uint8_t { kInsert = 1, kRemove = 2 };
+
+    Tree items;
+    string snapshotPath;
+    string logPath;
+    int logFd = -1;
+    // Length of the committed log; a failed commit truncates back to it
+    off_t logEnd = 0;
+    // Set when a failed commit could not be rolled back, after which the log
+    // refuses further commits
+    bool logBroken = false;
+    // Records appended since the last commit
+    string pending;
+    size_t pendingRecords = 0;
+    size_t groupSize;
+
+    template <typename T>
+    static void encode(string &out, const T &value) {
+        if constexpr (is_integral<T>::value) {
+            using U = make_unsigned_t<T>;
+            // Zigzag keeps small negative numbers short
+            uint64_t bits = static_cast<U>(value);
+            if constexpr (is_signed<T>::value)
+                bits = (bits << 1) ^ (value < 0 ? ~uint64_t(0) : 0);
+            bits &= numeric_limits<U>::max();
+            encodeVarint(out, bits);
+        } else {
+            static_assert(is_trivially_copyable<T>::value, "logged types must be trivially copyable");
+            out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+    }
+
+    // Decodes a value written by encode() from [p, end), advancing p.
+    // Returns false if the input ends early.
+    template <typename T>
+    static bool decode(const char *&p, const char *end, T &value) {
+        if constexpr (is_integral<T>::value) {
+            uint64_t bits;
+            if (!decodeVarint(p, end, bits))
+                return false;
+            if constexpr (is_signed<T>::value)
+                bits = (bits >> 1) ^ (~(bits & 1) + 1);
+            value = static_cast<T>(bits);
+            return true;
+        } else {
+            if (end - p < static_cast<ptrdiff_t>(sizeof(T)))
+                return false;
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return true;
+        }
+    }
+
+    static void encodeVarint(string &out, uint64_t bits) {
+        for (; bits >= 0x80; bits >>= 7)
+            out.push_back(static_cast<char>(bits | 0x80));
+        out.push_back(static_cast<char>(bits));
+    }
+
+    static bool decodeVarint(const char *&p, const char *end, uint64_t &bits) {
+        bits = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*p++);
+            bits |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    static uint32_t frameChecksum(const char *payload, size_t bytes) {
+        uint64_t hash = AVLSnapshotFormat::checksum(payload, bytes);
+        return static_cast<uint32_t>(hash ^ (hash >> 32));
+    }
+
+    // Frames payload as one log record and queues it, committing once a
+    // full group is pending
+    void append(const string &payload) {
+        encodeVarint(pending, payload.size());
+        pending += payload;
+        uint32_t check = frameChecksum(payload.data(), payload.size());
+        pending.append(reinterpret_cast<const char *>(&check), sizeof(check));
+        if (++pendingRecords >= groupSize)
+            commit();
+    }
+
+    // Applies one record payload to the tree. Returns false if it is
+    // malformed.
+    bool apply(const char *p, const char *end) {
+        if (p == end)
+            return false;
+        uint8_t op = static_cast<uint8_t>(*p++);
+        Key key;
+        if (!decode(p, end, key))
+            return false;
+        if (op == kRemove) {
+            items.remove(key);
+        } else if (op != kInsert) {
+            return false;
+        } else if constexpr (is_void<Value>::value) {
+            items.insert(key);
+        } else {
+            Value mapped;
+            if (!decode(p, end, mapped))
+                return false;
+            items.insert_or_assign(key, mapped);
+        }
+        return p == end;
+    }
+
+    // Replays every intact record of the log and returns the length of the
+    // intact prefix
+    off_t replay(int fd) {
+        string log;
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = ::read(fd, buffer, sizeof(buffer))) != 0) {
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                throw runtime_error("DurableAVLTree: cannot read " + logPath);
+            log.append(buffer, static_cast<size_t>(got));
+        }
+
+        const char *p = log.data(), *end = p + log.size(), *intact = p;
+        while (p < end) {
+            uint64_t bytes;
+            uint32_t check;
+            // Compared without adding, so a corrupt length near 2^64 cannot wrap
+            if (!decodeVarint(p, end, bytes) || static_cast<uint64_t>(end - p) < sizeof(check) ||
+                bytes > static_cast<uint64_t>(end - p) - sizeof(check))
+                break;
+            memcpy(&check, p + bytes, sizeof(check));
+            if (check != frameChecksum(p, bytes) || !apply(p, p + bytes))
+                break;
+            p += bytes + sizeof(check);
+            intact = p;
+        }
+        return intact - log.data();
+    }
+
+public:
+    /**
+     * @brief Opens the durable tree stored under path, creating it if needed.
+     * @param groupSize Number of records buffered before an automatic
+     *        commit(). 1 makes every operation durable before it returns.
+     * @throws std::runtime_error if the files cannot be read or created.
+     * @note Time Complexity: O(n + m) for n snapshot elements and m log
+     *       records.
+     */
+    explicit DurableAVLTree(const string &path, size_t groupSize = 64)
+        : snapshotPath(path + ".snapshot"), logPath(path + ".wal"), groupSize(max<size_t>(groupSize, 1)) {
+        if (::access(snapshotPath.c_str(), F_OK) == 0)
+            items = Tree::load(snapshotPath);
+        logFd = ::open(logPath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (logFd < 0)
+            throw runtime_error("DurableAVLTree: cannot open " + logPath);
+        try {
+            logEnd = replay(logFd);
+            if (::ftruncate(logFd, logEnd) != 0 || ::lseek(logFd, logEnd, SEEK_SET) < 0)
+                throw runtime_error("DurableAVLTree: cannot repair " + logPath);
+        } catch (...) {
+            ::close(logFd);
+            throw;
+        }
+    }
+
+    DurableAVLTree(const DurableAVLTree &) = delete;
+    DurableAVLTree &operator=(const DurableAVLTree &) = delete;
+
+    /**
+     * @brief Commits pending records and closes the log. Errors are ignored
+     *        here; call commit() first to observe them.
+     */
+    ~DurableAVLTree() {
+        try {
+            commit();
+        } catch (const runtime_error &) {
+        }
+        ::close(logFd);
+    }
+
+    /**
+     * @brief Inserts a key and logs the operation.
+     * @return True if the key was not present.
+     * @note Time Complexity: O(log n) plus an amortized share of commit().
+     *       Set mode only.
+     */
+    template <typename V = Value, typename = enable_if_t<is_void<V>::value>>
+    bool insert(const Key &key) {
+        bool inserted = items.insert(key);
+        if (inserted) {
+            string payload(1, static_cast<char>(kInsert));
+            encode(payload, key);
+            append(payload);
+        }
+        return inserted;
+    }
+
+    /**
+     * @brief Sets the mapped value of key and logs the operation.
+     * @return True if the key was not present.
+     * @note Time Complexity: O(log n) plus an amortized share of commit().
+     *       Map mode only.
+     */
+    template <typename M, typename V = Value, typename = enable_if_t<!is_void<V>::value>>
+    bool insert_or_assign(const Key &key, M &&mapped) {
+        bool inserted = items.insert_or_assign(key, std::forward<M>(mapped)).second;
+        string payload(1, static_cast<char>(kInsert));
+        encode(payload, key);
+        encode(payload, items.find(key)->second);
+        append(payload);
+        return inserted;
+    }
+
+    /**
+     * @brief Removes a key and logs the operation.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log n) plus an amortized share of commit().
+     */
+    bool remove(const Key &key) {
+        bool removed = items.remove(key);
+        if (removed) {
+            string payload(1, static_cast<char>(kRemove));
+            encode(payload, key);
+            append(payload);
+        }
+        return removed;
+    }
+
+    /**
+     * @brief Writes all pending records to the log with a single fsync.
+     *        On failure the log is truncated back to its last committed
+     *        length and the records stay pending, so a later commit() retries
+     *        them; if even the truncation fails, every later commit() throws.
+     * @throws std::runtime_error if the write or the sync fails.
+     * @note Time Complexity: O(p) for p pending bytes.
+     */
+    void commit() {
+        if (logBroken)
+            throw runtime_error("DurableAVLTree: " + logPath + " is unrecoverable after a failed commit");
+        if (pending.empty())
+            return;
+        if (!AVLSnapshotFormat::writeAll(logFd, pending.data(), pending.size()) || ::fdatasync(logFd) != 0) {
+            // A torn frame left in place would hide every record committed
+            // after it on the next replay
+            logBroken = ::ftruncate(logFd, logEnd) != 0 || ::lseek(logFd, logEnd, SEEK_SET) < 0;
+            throw runtime_error("DurableAVLTree: cannot write " + logPath);
+        }
+        logEnd += static_cast<off_t>(pending.size());
+        pending.clear();
+        pendingRecords = 0;
+    }
+
+    /**
+     * @brief Saves a snapshot of the tree and empties the log. A crash at any
+     *        point leaves either the old state or the new one recoverable.
+     * @throws std::runtime_error if the snapshot or the log cannot be written.
+     * @note Time Complexity: O(n).
+     */
+    void compact() {
+        commit();
+        items.save(snapshotPath);
+        if (::ftruncate(logFd, 0) != 0 || ::lseek(logFd, 0, SEEK_SET) < 0 || ::fsync(logFd) != 0)
+            throw runtime_error("DurableAVLTree: cannot truncate " + logPath);
+        logEnd = 0;
+    }
+
+    /**
+     * @brief Returns the bytes written to the log since the last compaction,
+     *        including pending ones.
+     */
+    size_t log_bytes() const {
+        off_t written = ::lseek(logFd, 0, SEEK_CUR);
+        return static_cast<size_t>(max<off_t>(written, 0)) + pending.size();
+    }
+
+    bool search(const Key &key) const {
+        return items.search(key);
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    /**
+     * @brief Read-only access to the in-memory tree.
+     */
+    const Tree &tree() const {
+        return items;
+    }
+};
+
+/**
+ * @brief Set of ints kept as an AVL tree of sorted key blocks. Each block
+ *        holds up to kBlockKeys keys, a cache line's worth, and is searched
+ *        with one vector compare and movemask where SSE2, AVX2 or NEON is
+ *        available. The last levels of an AVLTree<int> cost a miss each; here
+ *        they are resolved inside one block, and a key takes a few bytes
+ *        instead of a 24-byte node.
+ *
+ * A block with fence f holds keys from f up to the next block's fence. The
+ * first block's fence is INT_MIN, so every key has a block. Full blocks split
+ * in halves on insertion; blocks that drop below a quarter full merge with a
+ * neighbour that has room.
+ */
+class BlockedAVLTree {
+public:
+    static constexpr int kBlockKeys = 16;
+
+private:
+    static constexpr int kMergeBelow = kBlockKeys / 4;
+    // Sorts after every key, so unused slots never count towards a rank
+    static constexpr int kPadding = numeric_limits<int>::max();
+
+    struct Block {
+        int keys[kBlockKeys];
+        int count;
+
+        Block() : count(0) {
+            fill(keys, keys + kBlockKeys, kPadding);
+        }
+    };
+
+    using Index = AVLTree<int, Block>;
+
+    Index index;
+    size_t keyCount = 0;
+
+    // Number of keys in block that are less than key
+    static int rankInBlock(const Block &block, int key) {
+#if defined(__AVX2__)
+        __m256i needle = _mm256_set1_epi32(key);
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block.keys));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block.keys + 8));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, low))) |
+                        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, high))) << 8;
+        return static_cast<int>(bitset<kBlockKeys>(mask).count());
+#elif defined(__SSE2__)
+        __m128i needle = _mm_set1_epi32(key);
+        unsigned mask = 0;
+        for (int i = 0; i < kBlockKeys; i += 4) {
+            __m128i keys = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block.keys + i));
+            mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(keys, needle)))) << i;
+        }
+        return static_cast<int>(bitset<kBlockKeys>(mask).count());
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        int32x4_t needle = vdupq_n_s32(key);
+        uint32x4_t total = vdupq_n_u32(0);
+        // Matching lanes are all ones, so subtracting them counts them
+        for (int i = 0; i < kBlockKeys; i += 4)
+            total = vsubq_u32(total, vcltq_s32(vld1q_s32(block.keys + i), needle));
+        return static_cast<int>(vaddvq_u32(total));
+#else
+        int rank = 0;
+        while (rank < block.count && block.keys[rank] < key)
+            ++rank;
+        return rank;
+#endif
+    }
+
+    static void insertAt(Block &block, int pos, int key) {
+        copy_backward(block.keys + pos, block.keys + block.count, block.keys + block.count + 1);
+        block.keys[pos] = key;
+        ++block.count;
+    }
+
+    static void eraseAt(Block &block, int pos) {
+        copy(block.keys + pos + 1, block.keys + block.count, block.keys + pos);
+        block.keys[--block.count] = kPadding;
+    }
+
+    // Moves all keys of from to the end of into
+    static void append(Block &into, Block &from) {
+        copy(from.keys, from.keys + from.count, into.keys + into.count);
+        into.count += from.count;
+    }
+
+    // Returns the block whose key range holds key. The tree must not be
+    // empty.
+    Index::iterator blockFor(int key) {
+        return prev(index.upper_bound(key));
+    }
+
+    Index::const_iterator blockFor(int key) const {
+        return prev(index.upper_bound(key));
+    }
+
+    // Merges the underfull block at it into a neighbour if one has room,
+    // dropping the block entirely once the set is empty
+    void mergeBlock(Index::iterator it) {
+        Block &block = it->second;
+        Index::iterator next = std::next(it);
+        if (next != index.end() && block.count + next->second.count <= kBlockKeys) {
+            append(block, next->second);
+            int fence = next->first;
+            index.remove(fence);
+            return;
+        }
+        if (it != index.begin()) {
+            Index::iterator before = prev(it);
+            if (before->second.count + block.count <= kBlockKeys) {
+                append(before->second, block);
+                int fence = it->first;
+                index.remove(fence);
+                return;
+            }
+        }
+        if (block.count == 0)
+            index.clear();
+    }
+
+public:
+    /**
+     * @brief Inserts a key.
+     * @return True if the key was not present.
+     * @note Time Complexity: O(log(n / kBlockKeys) + kBlockKeys).
+     */
+    bool insert(int key) {
+        if (index.empty()) {
+            Block block;
+            insertAt(block, 0, key);
+            index.insert_or_assign(numeric_limits<int>::min(), block);
+            keyCount = 1;
+            return true;
+        }
+
+        Block &block = blockFor(key)->second;
+        int pos = rankInBlock(block, key);
+        if (pos < block.count && block.keys[pos] == key)
+            return false;
+
+        if (block.count < kBlockKeys) {
+            insertAt(block, pos, key);
+        } else {
+            // Split off the upper half under a fence equal to its first key
+            Block upper;
+            int half = kBlockKeys / 2;
+            copy(block.keys + half, block.keys + kBlockKeys, upper.keys);
+            fill(block.keys + half, block.keys + kBlockKeys, kPadding);
+            upper.count = block.count = half;
+            if (pos >= half)
+                insertAt(upper, pos - half, key);
+            else
+                insertAt(block, pos, key);
+            index.insert_or_assign(upper.keys[0], upper);
+        }
+        ++keyCount;
+        return true;
+    }
+
+    /**
+     * @brief Removes a key.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log(n / kBlockKeys) + kBlockKeys).
+     */
+    bool remove(int key) {
+        if (index.empty())
+            return false;
+
+        Index::iterator it = blockFor(key);
+        Block &block = it->second;
+        int pos = rankInBlock(block, key);
+        if (pos >= block.count || block.keys[pos] != key)
+            return false;
+
+        eraseAt(block, pos);
+        --keyCount;
+        if (block.count < kMergeBelow)
+            mergeBlock(it);
+        return true;
+    }
+
+    /**
+     * @brief Searches for a key.
+     * @note Time Complexity: O(log(n / kBlockKeys)) plus one block compare.
+     */
+    bool search(int key) const {
+        if (index.empty())
+            return false;
+        const Block &block = blockFor(key)->second;
+        int pos = rankInBlock(block, key);
+        return pos < block.count && block.keys[pos] == key;
+    }
+
+    size_t size() const {
+        return keyCount;
+    }
+
+    bool empty() const {
+        return keyCount == 0;
+    }
+
+    /**
+     * @brief Returns the number of blocks.
+     */
+    size_t blocks() const {
+        return index.size();
+    }
+
+    /**
+     * @brief Calls fn on every key in increasing order.
+     * @note Time Complexity: O(n).
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const {
+        for (const auto &entry : index)
+            for (int i = 0; i < entry.second.count; ++i)
+                fn(entry.second.keys[i]);
+    }
+
+    /**
+     * @brief Checks the index, the fences and the contents of every block.
+     * @note Time Complexity: O(n). Intended for tests.
+     */
+    bool isValid() const {
+        if (!index.isValid())
+            return false;
+        if (index.empty())
+            return keyCount == 0;
+        if (index.begin()->first != numeric_limits<int>::min())
+            return false;
+
+        size_t total = 0;
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            const Block &block = it->second;
+            auto next = std::next(it);
+            if (block.count < 1 || block.count > kBlockKeys)
+                return false;
+            for (int i = 0; i < kBlockKeys; ++i) {
+                int key = block.keys[i];
+                if (i >= block.count) {
+                    if (key != kPadding)
+                        return false;
+                    continue;
+                }
+                if (key < it->first || (i > 0 && block.keys[i - 1] >= key) ||
+                    (next != index.end() && key >= next->first))
+                    return false;
+            }
+            total += block.count;
+        }
+        return total == keyCount;
+    }
+};
+
+// Aggregate policy of IntervalTree: the largest interval end in a subtree
+template <typename Point>
+struct IntervalEndAggregate {
+    using type = Point;
+
+    // Infinities where Point has them, since an interval may end at one
+    static type identity() {
+        if constexpr (numeric_limits<Point>::has_infinity)
+            return -numeric_limits<Point>::infinity();
+        return numeric_limits<Point>::lowest();
+    }
+
+    static type highest() {
+        if constexpr (numeric_limits<Point>::has_infinity)
+            return numeric_limits<Point>::infinity();
+        return numeric_limits<Point>::max();
+    }
+
+    static type lift(const pair<Point, Point> &interval) {
+        return interval.second;
+    }
+
+    template <typename V>
+    static type lift(const pair<const pair<Point, Point>, V> &value) {
+        return value.first.second;
+    }
+
+    static type combine(const type &a, const type &b) {
+        return a < b ? b : a;
+    }
+};
+
+template <typename Point>
+struct IntervalTreeOptions : AVLTreeOptions {
+    using aggregate = IntervalEndAggregate<Point>;
+};
+
+/**
+ * @brief Set of closed intervals [start, end], or map from such intervals to
+ *        values when Value is not void. It is an AVLTree keyed by (start, end)
+ *        whose nodes also hold the largest end in their subtree; the field is
+ *        maintained by the same hook as subtree sizes, rotations included.
+ *        Queries skip every subtree whose largest end lies before the query
+ *        and stop at the first start after it.
+ */
+template <typename Point = int, typename Value = void>
+class IntervalTree {
+public:
+    using interval_type = pair<Point, Point>;
+    using Tree = AVLTree<interval_type, Value, less<interval_type>, IntervalTreeOptions<Point>>;
+    using value_type = typename Tree::value_type;
+
+private:
+    Tree items;
+
+    // Sorts after every stored interval that starts at b
+    static interval_type upperProbe(const Point &b) {
+        return {b, IntervalEndAggregate<Point>::highest()};
+    }
+
+    static interval_type checked(const Point &start, const Point &end) {
+        if (end < start)
+            throw invalid_argument("IntervalTree: interval ends before it starts");
+        return {start, end};
+    }
+
+public:
+    /**
+     * @brief Inserts the interval [start, end] unless it is already present.
+     * @throws std::invalid_argument if end < start.
+     * @note Time Complexity: O(log n).
+     */
+    template <typename V = Value, typename enable_if<is_void<V>::value, int>::type = 0>
+    bool insert(const Point &start, const Point &end) {
+        return items.insert(checked(start, end));
+    }
+
+    /**
+     * @brief Inserts the interval [start, end] mapped to value, or assigns
+     *        value to the interval if it is already present.
+     * @return True if the interval was inserted.
+     * @throws std::invalid_argument if end < start.
+     * @note Time Complexity: O(log n).
+     */
+    template <typename M, typename V = Value, typename enable_if<!is_void<V>::value, int>::type = 0>
+    bool insert_or_assign(const Point &start, const Point &end, M &&value) {
+        return items.insert_or_assign(checked(start, end), std::forward<M>(value)).second;
+    }
+
+    /**
+     * @brief Removes the interval [start, end] if present.
+     * @note Time Complexity: O(log n).
+     */
+    bool remove(const Point &start, const Point &end) {
+        return items.remove({start, end});
+    }
+
+    /**
+     * @brief Calls fn on every stored interval that shares a point with
+     *        [a, b], in order of (start, end). Pass a == b to stab at a point.
+     * @note Time Complexity: O(log n + k log n) for k reported intervals,
+     *       and never more than O(n).
+     */
+    template <typename Fn>
+    void find_overlapping(const Point &a, const Point &b, Fn &&fn) const {
+        if (b < a)
+            return;
+        items.for_each_pruned(upperProbe(b), [&](const Point &end) { return !(end < a); },
+                              std::forward<Fn>(fn));
+    }
+
+    /**
+     * @brief Tells whether any stored interval shares a point with [a, b].
+     * @note Time Complexity: O(log n).
+     */
+    bool overlaps(const Point &a, const Point &b) const {
+        bool found = false;
+        if (!(b < a))
+            items.for_each_pruned(upperProbe(b), [&](const Point &end) { return !found && !(end < a); },
+                                  [&](const value_type &) { found = true; });
+        return found;
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    bool empty() const {
+        return items.empty();
+    }
+
+    bool isValid() const {
+        return items.isValid();
+    }
+
+    /**
+     * @brief Read-only access to the underlying tree.
+     */
+    const Tree &tree() const {
+        return items;
+    }
+};
+
+// Epoch-based reclamation for memory unlinked from a concurrent structure.
+// Every operation runs inside a Guard, which announces the global epoch it
+// started in. Retired objects are freed once the epoch has advanced twice
+// since the retirement, when no Guard that could still reach them remains.
+class EpochReclaimer {
+private:
+    static constexpr uint64_t kIdle = ~uint64_t(0);
+    // Retirements between attempts to advance the epoch and free memory
+    static constexpr size_t kCollectInterval = 64;
+
+    struct Retired {
+        void *object;
+        void (*dispose)(void *);
+        uint64_t epoch;
+    };
+
+    // Records are claimed by one Guard at a time and never freed before the
+    // reclaimer, so threads may come and go freely
+    struct alignas(64) Record {
+        atomic<bool> claimed{false};
+        atomic<uint64_t> epoch{kIdle};
+        Record *next = nullptr;
+        // Only touched by the Guard holding the claim
+        vector<Retired> limbo;
+        size_t sinceCollect = 0;
+    };
+
+    atomic<uint64_t> globalEpoch{0};
+    atomic<Record *> records{nullptr};
+    uint64_t id;
+
+    // The record this thread claimed last, and the reclaimer it belongs to
+    static inline thread_local uint64_t hintId = 0;
+    static inline thread_local Record *hintRecord = nullptr;
+
+    static uint64_t nextId() {
+        static atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+
+    static bool tryClaim(Record *record) {
+        bool expected = false;
+        return !record->claimed.load(memory_order_relaxed) &&
+               record->claimed.compare_exchange_strong(expected, true, memory_order_acquire);
+    }
+
+    Record *claim() {
+        if (hintId == id && tryClaim(hintRecord))
+            return hintRecord;
+
+        Record *record = records.load(memory_order_acquire);
+        while (record != nullptr && !tryClaim(record))
+            record = record->next;
+        if (record == nullptr) {
+            record = new Record;
+            record->claimed.store(true, memory_order_relaxed);
+            record->next = records.load(memory_order_relaxed);
+            while (!records.compare_exchange_weak(record->next, record, memory_order_release, memory_order_relaxed)) {
+            }
+        }
+        hintId = id;
+        hintRecord = record;
+        return record;
+    }
+
+    // Advances the global epoch if every active Guard has seen the current one
+    void tryAdvance() {
+        uint64_t current = globalEpoch.load();
+        for (Record *record = records.load(memory_order_acquire); record != nullptr; record = record->next) {
+            uint64_t epoch = record->epoch.load();
+            if (epoch != kIdle && epoch != current)
+                return;
+        }
+        globalEpoch.compare_exchange_strong(current, current + 1);
+    }
+
+    // Frees the retired objects of record that no Guard can reach any more
+    void collect(Record &record) {
+        uint64_t now = globalEpoch.load();
+        vector<Retired> &limbo = record.limbo;
+        auto kept = partition(limbo.begin(), limbo.end(), [&](const Retired &r) { return r.epoch + 2 > now; });
+        for (auto it = kept; it != limbo.end(); ++it)
+            it->dispose(it->object);
+        limbo.erase(kept, limbo.end());
+    }
+
+public:
+    EpochReclaimer() : id(nextId()) {}
+
+    EpochReclaimer(const EpochReclaimer &) = delete;
+    EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+    /**
+     * @brief Frees everything still retired. No Guard may be active.
+     */
+    ~EpochReclaimer() {
+        Record *record = records.load();
+        while (record != nullptr) {
+            for (Retired &r : record->limbo)
+                r.dispose(r.object);
+            Record *next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+    /**
+     * @brief Marks the current thread as possibly holding pointers into the
+     *        structure until the Guard is destroyed. Guards may nest.
+     */
+    class Guard {
+    public:
+        explicit Guard(EpochReclaimer &owner) : owner(owner), record(owner.claim()), outer(active) {
+            record->epoch.store(owner.globalEpoch.load());
+            active = this;
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+        ~Guard() {
+            active = outer;
+            record->epoch.store(kIdle, memory_order_release);
+            record->claimed.store(false, memory_order_release);
+        }
+
+    private:
+        friend class EpochReclaimer;
+
+        EpochReclaimer &owner;
+        Record *record;
+        Guard *outer;
+    };
+
+    /**
+     * @brief Schedules object for deletion once no Guard can reach it. Must be
+     *        called inside a Guard of this reclaimer, after the object was
+     *        made unreachable.
+     */
+    template <typename T>
+    void retire(T *object) {
+        Guard *guard = active;
+        while (guard != nullptr && &guard->owner != this)
+            guard = guard->outer;
+        assert(guard != nullptr && "retire called outside a Guard");
+
+        Record &record = *guard->record;
+        record.limbo.push_back({object, [](void *p) { delete static_cast<T *>(p); }, globalEpoch.load()});
+        if (++record.sinceCollect >= kCollectInterval) {
+            record.sinceCollect = 0;
+            tryAdvance();
+            collect(record);
+        }
+    }
+
+private:
+    static inline thread_local Guard *active = nullptr;
+};
+
+/**
+ * @brief Concurrent AVL set after Bronson, Casper, Chafi and Olukotun, "A
+ *        Practical Concurrent Binary Search Tree" (PPoPP 2010).
+ *
+ * Readers take no locks: they validate each step of their descent against the
+ * version of the node they came from and retry the step if the node was
+ * rotated away meanwhile. Writers lock the node they link into or unlink
+ * from, and rebalancing locks only the nodes a rotation rearranges, parent
+ * before child. Removing a key whose node has two children just marks the
+ * node as a routing node; routing nodes are unlinked once they have at most
+ * one child. Unlinked nodes are reclaimed through an EpochReclaimer.
+ *
+ * Balance is relaxed while operations are in flight and restored once they
+ * complete. Every member except isValid and the destructor may be called
+ * concurrently.
+ */
+template <typename Key = int, typename Compare = std::less<Key>>
+class ConcurrentAVLTree {
+private:
+    // Version bits. A rotation marks the node losing part of its key range
+    // as shrinking, then bumps its shrink count; readers that passed through
+    // it retry from its parent.
+    static constexpr uint64_t kUnlinked = 1;
+    static constexpr uint64_t kShrinking = 2;
+    static constexpr uint64_t kShrinkStep = 4;
+
+    static constexpr int kSpinCount = 100;
+    static constexpr int kYieldCount = 10;
+
+    struct Node {
+        // The root holder has no key, so the key lives in a union
+        union {
+            Key key;
+        };
+        const bool hasKey;
+        atomic<Node *> left{nullptr};
+        atomic<Node *> right{nullptr};
+        atomic<Node *> parent;
+        atomic<uint64_t> version{0};
+        atomic<int> height;
+        atomic<bool> present;
+        atomic<bool> locked{false};
+
+        Node() : hasKey(false), parent(nullptr), height(0), present(false) {}
+
+        Node(const Key &key, Node *parent) : key(key), hasKey(true), parent(parent), height(1), present(true) {}
+
+        ~Node() {
+            if (hasKey)
+                key.~Key();
+        }
+
+        void lock() {
+            while (locked.exchange(true, memory_order_acquire)) {
+                while (locked.load(memory_order_relaxed))
+                    this_thread::yield();
+            }
+        }
+
+        void unlock() {
+            locked.store(false, memory_order_release);
+        }
+    };
+
+    // Operation results; kRetry means the caller must retry from its parent
+    enum Result { kRetry, kUnchanged, kChanged };
+
+    // fixHeight/nodeCondition results besides a new height
+    static constexpr int kUnlinkRequired = -1;
+    static constexpr int kRebalanceRequired = -2;
+    static constexpr int kNothingRequired = -3;
+
+    // The root is the right child of holder, which never moves
+    Node holder;
+    atomic<size_t> count{0};
+    Compare comp;
+    // Mutable so that const searches can enter a Guard
+    mutable EpochReclaimer reclaimer;
+
+    static bool isShrinkingOrUnlinked(uint64_t version) {
+        return (version & (kShrinking | kUnlinked)) != 0;
+    }
+
+    static int height(const Node *node) {
+        return node ? node->height.load() : 0;
+    }
+
+    static Node *child(const Node *node, bool right) {
+        return right ? node->right.load() : node->left.load();
+    }
+
+    static void setChild(Node *node, bool right, Node *target) {
+        (right ? node->right : node->left).store(target);
+    }
+
+    // Returns once a shrink of node seen at version is over
+    static void waitUntilShrinkCompleted(Node *node, uint64_t version) {
+        if ((version & kShrinking) == 0)
+            return;
+        for (int i = 0; i < kSpinCount; ++i) {
+            if (node->version.load() != version)
+                return;
+        }
+        for (int i = 0; i < kYieldCount; ++i) {
+            this_thread::yield();
+            if (node->version.load() != version)
+                return;
+        }
+        // Rotations hold the node lock while it shrinks
+        lock_guard<Node> guard(*node);
+    }
+
+    // Descends from node, which was valid at nodeVersion, towards key in the
+    // direction given by right. Returns kChanged if key is present.
+    Result attemptGet(const Key &key, Node *node, bool right, uint64_t nodeVersion) const {
+        while (true) {
+            Node *next = child(node, right);
+            if (next == nullptr)
+                return node->version.load() != nodeVersion ? kRetry : kUnchanged;
+
+            bool goRight = comp(next->key, key);
+            if (!goRight && !comp(key, next->key))
+                return next->present.load() ? kChanged : kUnchanged;
+
+            uint64_t nextVersion = next->version.load();
+            if (isShrinkingOrUnlinked(nextVersion)) {
+                waitUntilShrinkCompleted(next, nextVersion);
+                if (node->version.load() != nodeVersion)
+                    return kRetry;
+            } else if (next != child(node, right)) {
+                if (node->version.load() != nodeVersion)
+                    return kRetry;
+            } else {
+                if (node->version.load() != nodeVersion)
+                    return kRetry;
+                Result result = attemptGet(key, next, goRight, nextVersion);
+                if (result != kRetry)
+                    return result;
+            }
+        }
+    }
+
+    // Inserts key if insert is set, else removes it
+    bool update(const Key &key, bool insert) {
+        EpochReclaimer::Guard guard(reclaimer);
+        while (true) {
+            Node *root = holder.right.load();
+            if (root == nullptr) {
+                if (!insert)
+                    return false;
+                lock_guard<Node> lock(holder);
+                if (holder.right.load() == nullptr) {
+                    holder.right.store(new Node(key, &holder));
+                    count.fetch_add(1, memory_order_relaxed);
+                    return true;
+                }
+                continue;
+            }
+
+            uint64_t rootVersion = root->version.load();
+            if (isShrinkingOrUnlinked(rootVersion)) {
+                waitUntilShrinkCompleted(root, rootVersion);
+            } else if (root == holder.right.load()) {
+                Result result = attemptUpdate(key, insert, &holder, root, rootVersion);
+                if (result != kRetry) {
+                    if (result == kUnchanged)
+                        return false;
+                    if (insert)
+                        count.fetch_add(1, memory_order_relaxed);
+                    else
+                        count.fetch_sub(1, memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+    }
+
+    // Descends from node, which was valid at nodeVersion, and applies the
+    // update where key belongs. Parent is only used to unlink node.
+    Result attemptUpdate(const Key &key, bool insert, Node *parent, Node *node, uint64_t nodeVersion) {
+        bool right = comp(node->key, key);
+        if (!right && !comp(key, node->key))
+            return attemptNodeUpdate(insert, parent, node);
+
+        while (true) {
+            Node *next = child(node, right);
+            if (node->version.load() != nodeVersion)
+                return kRetry;
+
+            if (next == nullptr) {
+                if (!insert)
+                    return kUnchanged;
+
+                Node *damaged;
+                {
+                    lock_guard<Node> lock(*node);
+                    // Holding the lock, no rotation can move node any more
+                    if (node->version.load() != nodeVersion)
+                        return kRetry;
+                    if (child(node, right) != nullptr)
+                        continue;
+                    setChild(node, right, new Node(key, node));
+                    damaged = fixHeightLocked(node);
+                }
+                fixHeightAndRebalance(damaged);
+                return kChanged;
+            }
+
+            uint64_t nextVersion = next->version.load();
+            if (isShrinkingOrUnlinked(nextVersion)) {
+                waitUntilShrinkCompleted(next, nextVersion);
+            } else if (next == child(node, right)) {
+                if (node->version.load() != nodeVersion)
+                    return kRetry;
+                Result result = attemptUpdate(key, insert, node, next, nextVersion);
+                if (result != kRetry)
+                    return result;
+            }
+        }
+    }
+
+    // Applies the update to node, whose key is the one being updated
+    Result attemptNodeUpdate(bool insert, Node *parent, Node *node) {
+        if (!insert) {
+            if (!node->present.load())
+                return kUnchanged;
+
+            if (node->left.load() == nullptr || node->right.load() == nullptr) {
+                // Removal will unlink node, which needs the parent locked too
+                Node *damaged;
+                {
+                    lock_guard<Node> parentLock(*parent);
+                    if ((parent->version.load() & kUnlinked) || node->parent.load() != parent)
+                        return kRetry;
+                    {
+                        lock_guard<Node> lock(*node);
+                        if (!node->present.load())
+                            return kUnchanged;
+                        if (!attemptUnlinkLocked(parent, node))
+                            return kRetry;
+                    }
+                    damaged = fixHeightLocked(parent);
+                }
+                fixHeightAndRebalance(damaged);
+                return kChanged;
+            }
+        }
+
+        lock_guard<Node> lock(*node);
+        if (node->version.load() & kUnlinked)
+            return kRetry;
+        if (node->present.load() == insert)
+            return kUnchanged;
+        // Node lost a child meanwhile and must be unlinked instead
+        if (!insert && (node->left.load() == nullptr || node->right.load() == nullptr))
+            return kRetry;
+        node->present.store(insert);
+        return kChanged;
+    }
+
+    // Splices out node, which has at most one child. Both parent and node
+    // are locked. Heights are left to the caller.
+    bool attemptUnlinkLocked(Node *parent, Node *node) {
+        Node *parentLeft = parent->left.load();
+        Node *parentRight = parent->right.load();
+        if (parentLeft != node && parentRight != node)
+            return false;
+
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if (left != nullptr && right != nullptr)
+            return false;
+
+        Node *splice = left ? left : right;
+        if (parentLeft == node)
+            parent->left.store(splice);
+        else
+            parent->right.store(splice);
+        if (splice != nullptr)
+            splice->parent.store(parent);
+
+        node->version.store(kUnlinked);
+        node->present.store(false);
+        reclaimer.retire(node);
+        return true;
+    }
+
+    // Returns the repair node needs: one of the sentinels above, or its
+    // correct height if only that is off
+    int nodeCondition(Node *node) {
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if ((left == nullptr || right == nullptr) && !node->present.load())
+            return kUnlinkRequired;
+
+        int h = node->height.load();
+        int hl = height(left), hr = height(right);
+        int fixed = 1 + max(hl, hr);
+        if (hl - hr < -1 || hl - hr > 1)
+            return kRebalanceRequired;
+        return h != fixed ? fixed : kNothingRequired;
+    }
+
+    // Repairs the height of the locked node if that is all it needs. Returns
+    // the next node this thread must repair, or nullptr if none.
+    Node *fixHeightLocked(Node *node) {
+        int condition = nodeCondition(node);
+        switch (condition) {
+        case kRebalanceRequired:
+        case kUnlinkRequired:
+            return node;
+        case kNothingRequired:
+            return nullptr;
+        default:
+            node->height.store(condition);
+            return node->parent.load();
+        }
+    }
+
+    // Parents of rotations that left damage further down. The rotation
+    // changed the height of their subtree, so they are revisited once the
+    // deeper damage is repaired. Overflow only costs balance, not order.
+    struct RepairStack {
+        static constexpr int kCapacity = 64;
+        Node *nodes[kCapacity];
+        int size = 0;
+
+        void push(Node *node) {
+            if (size < kCapacity && (size == 0 || nodes[size - 1] != node))
+                nodes[size++] = node;
+        }
+    };
+
+    // Repairs heights, balance and routing nodes from node up to the root
+    void fixHeightAndRebalance(Node *node) {
+        RepairStack pending;
+        while (true) {
+            while (node != nullptr && node->parent.load() != nullptr) {
+                int condition = nodeCondition(node);
+                if (condition == kNothingRequired || (node->version.load() & kUnlinked))
+                    break;
+
+                if (condition != kUnlinkRequired && condition != kRebalanceRequired) {
+                    lock_guard<Node> lock(*node);
+                    node = fixHeightLocked(node);
+                } else {
+                    Node *parent = node->parent.load();
+                    lock_guard<Node> parentLock(*parent);
+                    if (!(parent->version.load() & kUnlinked) && node->parent.load() == parent) {
+                        lock_guard<Node> lock(*node);
+                        node = rebalanceLocked(parent, node, pending);
+                    }
+                }
+            }
+            if (pending.size == 0)
+                return;
+            node = pending.nodes[--pending.size];
+        }
+    }
+
+    // Rebalances node under its locked parent. Returns the next node to
+    // repair.
+    Node *rebalanceLocked(Node *parent, Node *node, RepairStack &pending) {
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if ((left == nullptr || right == nullptr) && !node->present.load())
+            return attemptUnlinkLocked(parent, node) ? fixHeightLocked(parent) : node;
+
+        int h = node->height.load();
+        int hl = height(left), hr = height(right);
+        int fixed = 1 + max(hl, hr);
+        int balance = hl - hr;
+        if (balance > 1)
+            return rebalanceToRightLocked(parent, node, left, hr, pending);
+        if (balance < -1)
+            return rebalanceToLeftLocked(parent, node, right, hl, pending);
+        if (fixed != h) {
+            node->height.store(fixed);
+            return fixHeightLocked(parent);
+        }
+        return nullptr;
+    }
+
+    // Node is left-heavy: rotates right, first rotating its left child left
+    // if that child is right-heavy
+    Node *rebalanceToRightLocked(Node *parent, Node *node, Node *left, int hr, RepairStack &pending) {
+        lock_guard<Node> leftLock(*left);
+        int hl = left->height.load();
+        // Heights moved since node was inspected; look at it again
+        if (hl - hr <= 1)
+            return node;
+
+        Node *leftRight = left->right.load();
+        int hll = height(left->left.load());
+        int hlr = height(leftRight);
+        if (hll >= hlr)
+            return rotateRightLocked(parent, node, left, hr, hll, leftRight, hlr, pending);
+
+        lock_guard<Node> leftRightLock(*leftRight);
+        hlr = leftRight->height.load();
+        if (hll >= hlr)
+            return rotateRightLocked(parent, node, left, hr, hll, leftRight, hlr, pending);
+        return rotateRightOverLeftLocked(parent, node, left, hr, hll, leftRight, pending);
+    }
+
+    // Mirror image of rebalanceToRightLocked
+    Node *rebalanceToLeftLocked(Node *parent, Node *node, Node *right, int hl, RepairStack &pending) {
+        lock_guard<Node> rightLock(*right);
+        int hr = right->height.load();
+        if (hl - hr >= -1)
+            return node;
+
+        Node *rightLeft = right->left.load();
+        int hrl = height(rightLeft);
+        int hrr = height(right->right.load());
+        if (hrr >= hrl)
+            return rotateLeftLocked(parent, node, hl, right, rightLeft, hrl, hrr, pending);
+
+        lock_guard<Node> rightLeftLock(*rightLeft);
+        hrl = rightLeft->height.load();
+        if (hrr >= hrl)
+            return rotateLeftLocked(parent, node, hl, right, rightLeft, hrl, hrr, pending);
+        return rotateLeftOverRightLocked(parent, node, hl, right, rightLeft, hrr, pending);
+    }
+
+    // Replaces node by replacement as the child of parent
+    static void replaceChild(Node *parent, Node *node, Node *replacement) {
+        if (parent->left.load() == node)
+            parent->left.store(replacement);
+        else
+            parent->right.store(replacement);
+        replacement->parent.store(parent);
+    }
+
+    // Returns the next node to repair after a rotation under parent that
+    // left lower and, for a double rotation, other below top. Heights can be
+    // stale under concurrency, and the rotated nodes may be unbalanced or
+    // routing nodes with a missing child. The deepest damaged node is
+    // returned; the rest, and parent, whose subtree height may have changed,
+    // are queued to be revisited after it.
+    Node *damageAfterRotation(Node *parent, Node *lower, Node *other, Node *top, RepairStack &pending) {
+        bool lowerDamaged = nodeCondition(lower) != kNothingRequired;
+        bool otherDamaged = other != nullptr && nodeCondition(other) != kNothingRequired;
+        bool topDamaged = nodeCondition(top) != kNothingRequired;
+        if (!lowerDamaged && !otherDamaged && !topDamaged)
+            return fixHeightLocked(parent);
+
+        pending.push(parent);
+        if (topDamaged && (lowerDamaged || otherDamaged))
+            pending.push(top);
+        if (otherDamaged && lowerDamaged)
+            pending.push(other);
+        return lowerDamaged ? lower : otherDamaged ? other : top;
+    }
+
+    // Rotates node right: left takes its place under parent, node becomes
+    // left's right child and adopts leftRight as its new left subtree
+    Node *rotateRightLocked(Node *parent, Node *node, Node *left, int hr, int hll, Node *leftRight, int hlr,
+                            RepairStack &pending) {
+        uint64_t version = node->version.load();
+        node->version.store(version | kShrinking);
+
+        node->left.store(leftRight);
+        if (leftRight != nullptr)
+            leftRight->parent.store(node);
+        left->right.store(node);
+        node->parent.store(left);
+        replaceChild(parent, node, left);
+
+        int hn = 1 + max(hlr, hr);
+        node->height.store(hn);
+        left->height.store(1 + max(hll, hn));
+
+        node->version.store(version + kShrinkStep);
+        return damageAfterRotation(parent, node, nullptr, left, pending);
+    }
+
+    // Mirror image of rotateRightLocked
+    Node *rotateLeftLocked(Node *parent, Node *node, int hl, Node *right, Node *rightLeft, int hrl, int hrr,
+                           RepairStack &pending) {
+        uint64_t version = node->version.load();
+        node->version.store(version | kShrinking);
+
+        node->right.store(rightLeft);
+        if (rightLeft != nullptr)
+            rightLeft->parent.store(node);
+        right->left.store(node);
+        node->parent.store(right);
+        replaceChild(parent, node, right);
+
+        int hn = 1 + max(hl, hrl);
+        node->height.store(hn);
+        right->height.store(1 + max(hn, hrr));
+
+        node->version.store(version + kShrinkStep);
+        return damageAfterRotation(parent, node, nullptr, right, pending);
+    }
+
+    // Double rotation lifting leftRight above both left and node; both of
+    // them shrink
+    Node *rotateRightOverLeftLocked(Node *parent, Node *node, Node *left, int hr, int hll, Node *leftRight,
+                                    RepairStack &pending) {
+        uint64_t nodeVersion = node->version.load();
+        uint64_t leftVersion = left->version.load();
+        node->version.store(nodeVersion | kShrinking);
+        left->version.store(leftVersion | kShrinking);
+
+        Node *lrl = leftRight->left.load();
+        Node *lrr = leftRight->right.load();
+        int hlrl = height(lrl);
+        int hlrr = height(lrr);
+
+        node->left.store(lrr);
+        if (lrr != nullptr)
+            lrr->parent.store(node);
+        left->right.store(lrl);
+        if (lrl != nullptr)
+            lrl->parent.store(left);
+        leftRight->left.store(left);
+        left->parent.store(leftRight);
+        leftRight->right.store(node);
+        node->parent.store(leftRight);
+        replaceChild(parent, node, leftRight);
+
+        int hn = 1 + max(hlrr, hr);
+        node->height.store(hn);
+        int hLeft = 1 + max(hll, hlrl);
+        left->height.store(hLeft);
+        leftRight->height.store(1 + max(hLeft, hn));
+
+        node->version.store(nodeVersion + kShrinkStep);
+        left->version.store(leftVersion + kShrinkStep);
+        return damageAfterRotation(parent, node, left, leftRight, pending);
+    }
+
+    // Mirror image of rotateRightOverLeftLocked
+    Node *rotateLeftOverRightLocked(Node *parent, Node *node, int hl, Node *right, Node *rightLeft, int hrr,
+                                    RepairStack &pending) {
+        uint64_t nodeVersion = node->version.load();
+        uint64_t rightVersion = right->version.load();
+        node->version.store(nodeVersion | kShrinking);
+        right->version.store(rightVersion | kShrinking);
+
+        Node *rll = rightLeft->left.load();
+        Node *rlr = rightLeft->right.load();
+        int hrll = height(rll);
+        int hrlr = height(rlr);
+
+        node->right.store(rll);
+        if (rll != nullptr)
+            rll->parent.store(node);
+        right->left.store(rlr);
+        if (rlr != nullptr)
+            rlr->parent.store(right);
+        rightLeft->right.store(right);
+        right->parent.store(rightLeft);
+        rightLeft->left.store(node);
+        node->parent.store(rightLeft);
+        replaceChild(parent, node, rightLeft);
+
+        int hn = 1 + max(hl, hrll);
+        node->height.store(hn);
+        int hRight = 1 + max(hrlr, hrr);
+        right->height.store(hRight);
+        rightLeft->height.store(1 + max(hn, hRight));
+
+        node->version.store(nodeVersion + kShrinkStep);
+        right->version.store(rightVersion + kShrinkStep);
+        return damageAfterRotation(parent, node, right, rightLeft, pending);
+    }
+
+    // Recursive helper for isValid. Returns the height of the subtree, or -1
+    // if an invariant is broken.
+    int checkSubtree(const Node *node, const Node *parent, const Key *lower, const Key *upper) const {
+        if (node == nullptr)
+            return 0;
+        if (node->parent.load() != parent || (node->version.load() & (kShrinking | kUnlinked)))
+            return -1;
+        if ((lower && !comp(*lower, node->key)) || (upper && !comp(node->key, *upper)))
+            return -1;
+        // Routing nodes with fewer than two children are unlinked eagerly
+        if (!node->present.load() && (!node->left.load() || !node->right.load()))
+            return -1;
+
+        int hl = checkSubtree(node->left.load(), node, lower, &node->key);
+        int hr = checkSubtree(node->right.load(), node, &node->key, upper);
+        if (hl < 0 || hr < 0 || hl - hr < -1 || hl - hr > 1 || node->height.load() != 1 + max(hl, hr))
+            return -1;
+        return 1 + max(hl, hr);
+    }
+
+public:
+    /**
+     * @brief Constructs an empty concurrent tree.
+     */
+    explicit ConcurrentAVLTree(const Compare &comp = Compare()) : comp(comp) {}
+
+    ConcurrentAVLTree(const ConcurrentAVLTree &) = delete;
+    ConcurrentAVLTree &operator=(const ConcurrentAVLTree &) = delete;
+
+    /**
+     * @brief Destroys the tree. No other thread may be using it.
+     */
+    ~ConcurrentAVLTree() {
+        vector<Node *> pending;
+        if (Node *root = holder.right.load())
+            pending.push_back(root);
+        while (!pending.empty()) {
+            Node *node = pending.back();
+            pending.pop_back();
+            if (Node *left = node->left.load())
+                pending.push_back(left);
+            if (Node *right = node->right.load())
+                pending.push_back(right);
+            delete node;
+        }
+    }
+
+    /**
+     * @brief Inserts a key.
+     * @return True if the key was not present.
+     * @note Time Complexity: O(log n) without contention.
+     */
+    bool insert(const Key &key) {
+        return update(key, true);
+    }
+
+    /**
+     * @brief Removes a key.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log n) without contention.
+     */
+    bool remove(const Key &key) {
+        return update(key, false);
+    }
+
+    /**
+     * @brief Searches for a key without taking any lock.
+     * @return True if the key is found.
+     * @note Time Complexity: O(log n) without contention.
+     */
+    bool search(const Key &key) const {
+        EpochReclaimer::Guard guard(reclaimer);
+        Node *holderNode = const_cast<Node *>(&holder);
+        while (true) {
+            Result result = attemptGet(key, holderNode, true, 0);
+            if (result != kRetry)
+                return result == kChanged;
+        }
+    }
+
+    /**
+     * @brief Returns the number of keys. Exact only while no update runs.
+     */
+    size_t size() const {
+        return count.load(memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * @brief Checks order, parent links, heights and strict balance.
+     * @note Time Complexity: O(n). Only meaningful while no update runs.
+     */
+    bool isValid() const {
+        return checkSubtree(holder.right.load(), &holder, nullptr, nullptr) >= 0;
+    }
+};
+
+/**
+ * @brief Ordered set or map range-partitioned over independent AVLTree
+ *        shards, so that writers to different key ranges never contend. Each
+ *        shard has its own reader-writer lock and its own node pool, drawn
+ *        from the memory resource given for it; pass a NUMA-local resource
+ *        per shard to keep each arena on its node.
+ *
+ * Shard i holds the keys from fence i - 1 up to fence i. These fences live
+ * in a routing table that operations read without locking inside an
+ * EpochReclaimer guard. When a shard outgrows twice the average, its
+ * boundary with the smaller neighbour moves so that the two even out. The
+ * elements that cross are rebuilt in the receiving shard's arena and joined
+ * in, and a new routing table is published while both shards are locked.
+ * An operation that locked a shard under an outdated table retries.
+ *
+ * Every member except isValid may be called concurrently. Callbacks of
+ * the for_each functions run under shard read locks and must not modify
+ * the tree.
+ */
+template <typename Key = int, typename Value = void, typename Compare = std::less<Key>,
+          typename Options = AVLTreeOptions>
+class ShardedAVLTree {
+public:
+    using Tree = AVLTree<Key, Value, Compare, Options>;
+    using value_type = typename Tree::value_type;
+
+private:
+    using Values = AVLTreeValue<Key, Value>;
+
+    // Shards smaller than this are never rebalanced
+    static constexpr size_t kMinRebalance = 1024;
+
+    struct alignas(64) Shard {
+        mutable shared_mutex lock;
+        Tree items;
+        std::pmr::memory_resource *arena;
+        // Written under the lock, read without it by the rebalancing checks
+        atomic<size_t> count{0};
+
+        Shard(std::pmr::memory_resource *arena, const Compare &comp) : items(arena, comp), arena(arena) {}
+    };
+
+    struct Routing {
+        vector<Key> fences;
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    atomic<Routing *> routing;
+    atomic<size_t> total{0};
+    mutable EpochReclaimer reclaimer;
+    Compare comp;
+
+    size_t shardIndex(const Routing &table, const Key &key) const {
+        return static_cast<size_t>(upper_bound(table.fences.begin(), table.fences.end(), key, comp) -
+                                   table.fences.begin());
+    }
+
+    // Locks the shard whose range holds key and returns its index. A
+    // rebalance replaces the routing table while it holds the locks of both
+    // shards it changes, so an unchanged table once the lock is held means
+    // the shard is still the right one.
+    template <typename Lock>
+    size_t lockShardOf(const Key &key, Lock &lock) const {
+        EpochReclaimer::Guard guard(reclaimer);
+        while (true) {
+            Routing *table = routing.load(memory_order_acquire);
+            size_t i = shardIndex(*table, key);
+            lock = Lock(shards[i]->lock);
+            if (routing.load(memory_order_acquire) == table)
+                return i;
+            lock.unlock();
+        }
+    }
+
+    bool oversized(size_t i) const {
+        size_t count = shards[i]->count.load(memory_order_relaxed);
+        return count > kMinRebalance && count > 2 * (total.load(memory_order_relaxed) / shards.size() + 1);
+    }
+
+    // Rebuilds the elements of from, in order, in the arena of shard to
+    Tree transfer(Tree &from, Shard &to) {
+        Tree moved(to.arena, comp);
+        for (auto &value : from) {
+            if constexpr (is_void<Value>::value)
+                moved.append(value);
+            else
+                moved.append(value.first, std::move(value.second));
+        }
+        from.clear();
+        return moved;
+    }
+
+    // Evens out shards i and i + 1 by moving their common fence. Returns
+    // true if any element moved.
+    bool balancePair(size_t i) {
+        EpochReclaimer::Guard guard(reclaimer);
+        Shard &left = *shards[i], &right = *shards[i + 1];
+        unique_lock<shared_mutex> leftLock(left.lock), rightLock(right.lock);
+        size_t a = left.count.load(memory_order_relaxed), b = right.count.load(memory_order_relaxed);
+        if ((a > b ? a - b : b - a) <= kMinRebalance)
+            return false;
+
+        size_t move = (a > b ? a - b : b - a) / 2;
+        optional<Key> fence;
+        if (a > b) {
+            auto it = left.items.end();
+            std::advance(it, -static_cast<ptrdiff_t>(move));
+            fence = Values::key(*it);
+            Tree tail = left.items.split(*fence);
+            Tree moved = transfer(tail, right);
+            right.items = Tree::join(std::move(moved), std::move(right.items));
+        } else {
+            auto it = right.items.begin();
+            std::advance(it, static_cast<ptrdiff_t>(move));
+            fence = Values::key(*it);
+            Tree rest = right.items.split(*fence);
+            Tree moved = transfer(right.items, left);
+            right.items = std::move(rest);
+            left.items = Tree::join(std::move(left.items), std::move(moved));
+        }
+        left.count.store(a > b ? a - move : a + move, memory_order_relaxed);
+        right.count.store(a > b ? b + move : b - move, memory_order_relaxed);
+
+        // Rebalances of other pairs may publish tables meanwhile; each only
+        // changes fences whose shards it has locked
+        Routing *old = routing.load(memory_order_acquire);
+        Routing *table = new Routing(*old);
+        table->fences[i] = *fence;
+        while (!routing.compare_exchange_weak(old, table, memory_order_acq_rel, memory_order_acquire)) {
+            table->fences = old->fences;
+            table->fences[i] = *fence;
+        }
+        reclaimer.retire(old);
+        return true;
+    }
+
+    // Passes load from an oversized shard i towards its smaller neighbours
+    void rebalanceFrom(size_t i) {
+        for (size_t steps = 0; steps < shards.size() && oversized(i); ++steps) {
+            size_t n = shards.size();
+            size_t below = i > 0 ? shards[i - 1]->count.load(memory_order_relaxed) : SIZE_MAX;
+            size_t above = i + 1 < n ? shards[i + 1]->count.load(memory_order_relaxed) : SIZE_MAX;
+            size_t j = below < above ? i - 1 : i + 1;
+            if (j >= n || !balancePair(min(i, j)))
+                return;
+            i = j;
+        }
+    }
+
+    void added(size_t i) {
+        total.fetch_add(1, memory_order_relaxed);
+        if (oversized(i))
+            rebalanceFrom(i);
+    }
+
+    // Runs fn under read locks on the shards that may hold keys in [lo, hi),
+    // or from lo upwards when hi is null. The next shard is locked before
+    // the current one is released, so no element can cross the scan.
+    template <typename Fn>
+    void scan(const Key &lo, const Key *hi, Fn &&fn) const {
+        EpochReclaimer::Guard guard(reclaimer);
+        shared_lock<shared_mutex> lock;
+        size_t i = lockShardOf(lo, lock);
+        while (true) {
+            fn(shards[i]->items);
+            const Routing *table = routing.load(memory_order_acquire);
+            if (i + 1 == shards.size() || (hi != nullptr && !comp(table->fences[i], *hi)))
+                return;
+            shared_lock<shared_mutex> next(shards[++i]->lock);
+            lock.swap(next);
+        }
+    }
+
+public:
+    /**
+     * @brief Creates fences.size() + 1 empty shards split at the given sorted
+     *        fences. arenas optionally names the memory resource of each shard.
+     * @throws std::invalid_argument if the fences are unsorted or arenas has
+     *         the wrong length.
+     */
+    explicit ShardedAVLTree(vector<Key> fences, const vector<std::pmr::memory_resource *> &arenas = {},
+                            const Compare &comp = Compare())
+        : routing(nullptr), comp(comp) {
+        for (size_t i = 1; i < fences.size(); ++i)
+            if (!comp(fences[i - 1], fences[i]))
+                throw invalid_argument("ShardedAVLTree: fences must be strictly increasing");
+        if (!arenas.empty() && arenas.size() != fences.size() + 1)
+            throw invalid_argument("ShardedAVLTree: need one arena per shard");
+
+        for (size_t i = 0; i <= fences.size(); ++i)
+            shards.push_back(make_unique<Shard>(arenas.empty() ? std::pmr::get_default_resource() : arenas[i], comp));
+        routing.store(new Routing{std::move(fences)});
+    }
+
+    ShardedAVLTree(const ShardedAVLTree &) = delete;
+    ShardedAVLTree &operator=(const ShardedAVLTree &) = delete;
+
+    ~ShardedAVLTree() {
+        delete routing.load();
+    }
+
+    /**
+     * @brief Inserts value unless its key is present. Set mode only.
+     * @note Time Complexity: O(log n), plus amortized rebalancing.
+     */
+    template <typename V = Value, typename enable_if<is_void<V>::value, int>::type = 0>
+    bool insert(const Key &key) {
+        unique_lock<shared_mutex> lock;
+        size_t i = lockShardOf(key, lock);
+        bool inserted = shards[i]->items.insert(key);
+        if (inserted)
+            shards[i]->count.fetch_add(1, memory_order_relaxed);
+        lock.unlock();
+        if (inserted)
+            added(i);
+        return inserted;
+    }
+
+    /**
+     * @brief Inserts key with mapped, or assigns mapped to the existing element.
+     * @return True if the element was inserted. Map mode only.
+     * @note Time Complexity: O(log n), plus amortized rebalancing.
+     */
+    template <typename M, typename V = Value, typename enable_if<!is_void<V>::value, int>::type = 0>
+    bool insert_or_assign(const Key &key, M &&mapped) {
+        unique_lock<shared_mutex> lock;
+        size_t i = lockShardOf(key, lock);
+        bool inserted = shards[i]->items.insert_or_assign(key, std::forward<M>(mapped)).second;
+        if (inserted)
+            shards[i]->count.fetch_add(1, memory_order_relaxed);
+        lock.unlock();
+        if (inserted)
+            added(i);
+        return inserted;
+    }
+
+    /**
+     * @brief Removes key if present.
+     * @note Time Complexity: O(log n).
+     */
+    bool remove(const Key &key) {
+        unique_lock<shared_mutex> lock;
+        size_t i = lockShardOf(key, lock);
+        bool removed = shards[i]->items.remove(key);
+        if (removed) {
+            shards[i]->count.fetch_sub(1, memory_order_relaxed);
+            total.fetch_sub(1, memory_order_relaxed);
+        }
+        return removed;
+    }
+
+    bool search(const Key &key) const {
+        shared_lock<shared_mutex> lock;
+        size_t i = lockShardOf(key, lock);
+        return shards[i]->items.search(key);
+    }
+
+    /**
+     * @brief Returns a copy of the value mapped to key, if present. Map mode only.
+     * @note Time Complexity: O(log n).
+     */
+    template <typename V = Value, typename enable_if<!is_void<V>::value, int>::type = 0>
+    optional<V> get(const Key &key) const {
+        shared_lock<shared_mutex> lock;
+        size_t i = lockShardOf(key, lock);
+        const value_type *found = shards[i]->items.find(key);
+        return found ? optional<V>(found->second) : nullopt;
+    }
+
+    /**
+     * @brief Calls fn on every element in global key order.
+     * @note Time Complexity: O(n).
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const {
+        shared_lock<shared_mutex> lock(shards[0]->lock);
+        for (size_t i = 0;; ++i) {
+            for (const value_type &value : shards[i]->items)
+                fn(value);
+            if (i + 1 == shards.size())
+                return;
+            shared_lock<shared_mutex> next(shards[i + 1]->lock);
+            lock.swap(next);
+        }
+    }
+
+    /**
+     * @brief Calls fn in key order on every element with a key in [lo, hi).
+     * @note Time Complexity: O(s log n + k) over the s shards the range spans.
+     */
+    template <typename Fn>
+    void for_each_in_range(const Key &lo, const Key &hi, Fn &&fn) const {
+        if (!comp(lo, hi))
+            return;
+        scan(lo, &hi, [&](const Tree &items) { items.for_each_in_range(lo, hi, fn); });
+    }
+
+    /**
+     * @brief Evens out every pair of neighbouring shards that differ by more
+     *        than the rebalancing threshold, sweeping up and then down.
+     */
+    void rebalance() {
+        for (size_t i = 0; i + 1 < shards.size(); ++i)
+            balancePair(i);
+        for (size_t i = shards.size() - 1; i-- > 0;)
+            balancePair(i);
+    }
+
+    size_t size() const {
+        return total.load(memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t shard_count() const {
+        return shards.size();
+    }
+
+    /**
+     * @brief Returns the number of elements in shard i.
+     */
+    size_t shard_size(size_t i) const {
+        return shards[i]->count.load(memory_order_relaxed);
+    }
 
-    Node(int val) : data(val), left(nullptr), right(nullptr), height(1) {}
+    /**
+     * @brief Checks every shard tree, that each key lies inside its shard's
+     *        fences, and the element counts.
+     * @note Time Complexity: O(n). Only meaningful while no update runs.
+     */
+    bool isValid() const {
+        const vector<Key> &fences = routing.load()->fences;
+        size_t sum = 0;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            const Tree &items = shards[i]->items;
+            if (!items.isValid() || items.size() != shards[i]->count.load())
+                return false;
+            if (!items.empty()) {
+                const Key &first = Values::key(*items.begin()), &last = Values::key(*prev(items.end()));
+                if ((i > 0 && comp(first, fences[i - 1])) || (i < fences.size() && !comp(last, fences[i])))
+                    return false;
+            }
+            sum += items.size();
+        }
+        return sum == total.load();
+    }
 };
 
-class AVLTree {
+/**
+ * @brief Persistent AVL tree. Updates copy the path from the root to the
+ *        change and share every untouched subtree with earlier versions, so
+ *        snapshot() and copying the tree are O(1).
+ *
+ * Nodes are reference counted; a version frees the nodes only it still
+ * references when it is destroyed. A node referenced by one version alone is
+ * updated in place, so a tree without snapshots mutates like a plain AVL
+ * tree. Snapshots are immutable and may be read from any thread while the
+ * tree they came from keeps changing; the tree itself needs external
+ * synchronization like AVLTree.
+ */
+template <typename Key = int, typename Value = void, typename Compare = std::less<Key>>
+class PersistentAVLTree {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = typename AVLTreeValue<Key, Value>::type;
+    using key_compare = Compare;
+    using size_type = size_t;
+
 private:
+    using Values = AVLTreeValue<Key, Value>;
+
+    // Same bound as AVLTree::kMaxHeight
+    static constexpr int kMaxHeight = 64;
+
+    struct Node {
+        Node *left;
+        Node *right;
+        value_type value;
+        // Versions and parent nodes referencing this node
+        atomic<uint32_t> refs;
+        int8_t height;
+
+        template <typename... Args>
+        explicit Node(in_place_t, Args &&...args)
+            : left(nullptr), right(nullptr), value(std::forward<Args>(args)...), refs(1), height(1) {}
+
+        // Copies node for path copying; the copy shares node's children
+        Node(const Node &other)
+            : left(acquire(other.left)), right(acquire(other.right)), value(other.value), refs(1),
+              height(other.height) {}
+    };
+
     Node *root;
+    size_t count;
+    Compare comp;
 
-    // Helper function to get the height of a node
-    int height(Node *N) {
-        if (N == nullptr)
-            return 0;
-        return N->height;
+    static const Key &keyOf(const Node *node) {
+        return Values::key(node->value);
+    }
+
+    static Node *acquire(Node *node) {
+        if (node != nullptr)
+            node->refs.fetch_add(1, memory_order_relaxed);
+        return node;
     }
 
-    // Helper function to update the height of a node
-    void updateHeight(Node* N) {
-        if (N != nullptr) {
-            N->height = 1 + max(height(N->left), height(N->right));
+    // Drops one reference to node, freeing it and the subtrees only it held
+    static void release(Node *node) {
+        while (node != nullptr && node->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            release(node->left);
+            Node *right = node->right;
+            delete node;
+            node = right;
         }
     }
 
-    // Get balance factor of a node N
-    int getBalance(Node *N) {
-        if (N == nullptr)
-            return 0;
-        return height(N->left) - height(N->right);
+    // Takes over a reference to node and returns a node this version may
+    // modify: node itself when nothing else references it, else a copy.
+    // Callers only own nodes reached through owned parents, so a count of
+    // one means no other version can reach the node.
+    static Node *own(Node *node) {
+        if (node->refs.load(memory_order_acquire) == 1)
+            return node;
+        Node *copy = new Node(*node);
+        release(node);
+        return copy;
     }
 
-    // Right rotate subtree rooted with y
-    //       y                               x
-    //      / \                             /   \
-    //     x   T3  -> Right Rotate (y) ->  T1    y
-    //    / \                                   / \
-    //   T1  T2                                T2  T3
-    // returns x, the new root of the subtree
-    Node *rightRotate(Node *y) {
-        Node *x = y->left;
-        Node *T2 = x->right;
+    static int height(const Node *node) {
+        return node ? node->height : 0;
+    }
 
-        x->right = y;
-        y->left = T2;
+    static void updateHeight(Node *node) {
+        node->height = static_cast<int8_t>(1 + max(height(node->left), height(node->right)));
+    }
 
+    // Rotations take over a reference to an owned subtree root and return
+    // the new one. The child moving up is owned before it is relinked.
+    static Node *rightRotate(Node *y) {
+        Node *x = own(y->left);
+        y->left = x->right;
+        x->right = y;
         updateHeight(y);
         updateHeight(x);
-
         return x;
     }
 
-    // Left rotate subtree rooted with x
-    //     x                               y
-    //    / \                             /   \
-    //   T1  y   -> Left Rotate (x) ->   x     T3
-    //      / \                         / \
-    //     T2  T3                      T1  T2
-    // returns y, the new root of the subtree
-    Node *leftRotate(Node *x) {
-        Node *y = x->right;
-        Node *T2 = y->left;
-
+    static Node *leftRotate(Node *x) {
+        Node *y = own(x->right);
+        x->right = y->left;
         y->left = x;
-        x->right = T2;
-
         updateHeight(x);
         updateHeight(y);
-
         return y;
     }
 
-    // Recursive function to insert a key in the subtree rooted
-    // with node and returns the new root of the subtree.
-    Node* insertNode(Node* node, int key) {
-        if (node == nullptr)
-            return(new Node(key));
-
-        if (key < node->data)
-            node->left = insertNode(node->left, key);
-        else if (key > node->data)
-            node->right = insertNode(node->right, key);
-        else
-            return node;
-
+    // Restores the AVL invariant at an owned node whose subtrees differ in
+    // height by at most two
+    static Node *rebalance(Node *node) {
         updateHeight(node);
-
-        int balance = getBalance(node);
-
-        if (balance > 1 && key < node->left->data)
+        int balance = height(node->left) - height(node->right);
+        if (balance > 1) {
+            if (height(node->left->left) < height(node->left->right))
+                node->left = leftRotate(own(node->left));
             return rightRotate(node);
-
-        if (balance < -1 && key > node->right->data)
+        }
+        if (balance < -1) {
+            if (height(node->right->right) < height(node->right->left))
+                node->right = rightRotate(own(node->right));
             return leftRotate(node);
+        }
+        return node;
+    }
 
-        if (balance > 1 && key > node->left->data) {
-            node->left = leftRotate(node->left);
-            return rightRotate(node);
+    // Recursive helpers for insertion and removal. Each takes over a
+    // reference to the subtree root and returns a reference to the root of
+    // the updated subtree.
+    template <typename... Args>
+    Node *insertNode(Node *node, const Key &key, bool &inserted, Args &&...args) {
+        if (node == nullptr) {
+            inserted = true;
+            return new Node(in_place, std::forward<Args>(args)...);
         }
+        node = own(node);
+        if (comp(key, keyOf(node)))
+            node->left = insertNode(node->left, key, inserted, std::forward<Args>(args)...);
+        else
+            node->right = insertNode(node->right, key, inserted, std::forward<Args>(args)...);
+        return rebalance(node);
+    }
 
-        if (balance < -1 && key < node->right->data) {
-            node->right = rightRotate(node->right);
-            return leftRotate(node);
+    // Unlinks the minimum of an owned subtree into min, which is owned too
+    Node *removeMin(Node *node, Node *&min) {
+        node = own(node);
+        if (node->left == nullptr) {
+            min = node;
+            Node *right = node->right;
+            node->right = nullptr;
+            return right;
         }
+        node->left = removeMin(node->left, min);
+        return rebalance(node);
+    }
 
-        return node;
+    Node *removeNode(Node *node, const Key &key) {
+        node = own(node);
+        if (comp(key, keyOf(node))) {
+            node->left = removeNode(node->left, key);
+        } else if (comp(keyOf(node), key)) {
+            node->right = removeNode(node->right, key);
+        } else {
+            Node *left = node->left, *right = node->right;
+            node->left = node->right = nullptr;
+            release(node);
+            if (right == nullptr)
+                return left;
+
+            Node *min;
+            right = removeMin(right, min);
+            min->left = left;
+            min->right = right;
+            node = min;
+        }
+        return rebalance(node);
+    }
+
+    static const Node *findNode(const Node *node, const Key &key, const Compare &comp) {
+        while (node != nullptr) {
+            if (comp(key, keyOf(node)))
+                node = node->left;
+            else if (comp(keyOf(node), key))
+                node = node->right;
+            else
+                return node;
+        }
+        return nullptr;
     }
 
-    // Helper function to find the node with minimum value
-    Node* minValueNode(Node* node) {
-        Node* current = node;
-        while (current && current->left != nullptr)
-            current = current->left;
-        return current;
-    }
-
-    // Recursive function to delete a node with given key
-    // from subtree with given root. It returns root of
-    // the modified subtree.
-    Node* deleteNode(Node* root, int key) {
-        if (root == nullptr)
-            return root;
-
-        if (key < root->data)
-            root->left = deleteNode(root->left, key);
-        else if (key > root->data)
-            root->right = deleteNode(root->right, key);
-        else {
-            if ((root->left == nullptr) || (root->right == nullptr)) {
-                Node *temp = root->left ? root->left : root->right;
-
-                if (temp == nullptr) {
-                    temp = root;
-                    root = nullptr;
+    // In-order walk over the keys in [lo, hi), or over everything when lo
+    // and hi are null, with a fixed-depth stack
+    template <typename Fn>
+    static void visit(const Node *node, const Key *lo, const Key *hi, const Compare &comp, Fn &fn) {
+        const Node *stack[kMaxHeight];
+        int depth = 0;
+        while (node != nullptr || depth > 0) {
+            while (node != nullptr) {
+                if (lo && comp(keyOf(node), *lo)) {
+                    node = node->right;
                 } else {
-                    *root = *temp; // Copy the contents of the non-empty child
+                    stack[depth++] = node;
+                    node = node->left;
                 }
-                delete temp;
-            } else {
-                Node* temp = minValueNode(root->right);
-
-                root->data = temp->data;
-
-                root->right = deleteNode(root->right, temp->data);
             }
+            node = stack[--depth];
+            if (hi && !comp(keyOf(node), *hi))
+                return;
+            fn(node->value);
+            node = node->right;
         }
+    }
 
-        if (root == nullptr)
-            return root;
+    // Recursive helper for isValid. Returns the height of the subtree, or -1
+    // if an invariant is broken.
+    int checkSubtree(const Node *node, const Key *lower, const Key *upper) const {
+        if (node == nullptr)
+            return 0;
+        if (node->refs.load() == 0)
+            return -1;
+        if ((lower && !comp(*lower, keyOf(node))) || (upper && !comp(keyOf(node), *upper)))
+            return -1;
+        int hl = checkSubtree(node->left, lower, &keyOf(node));
+        int hr = checkSubtree(node->right, &keyOf(node), upper);
+        if (hl < 0 || hr < 0 || hl - hr < -1 || hl - hr > 1 || node->height != 1 + max(hl, hr))
+            return -1;
+        return 1 + max(hl, hr);
+    }
+
+public:
+    /**
+     * @brief Immutable view of one version of a PersistentAVLTree. Copying a
+     *        snapshot is O(1); the version is freed with its last reference.
+     */
+    class Snapshot {
+    public:
+        Snapshot() : root(nullptr), count(0) {}
 
-        updateHeight(root);
+        Snapshot(const Snapshot &other) : root(acquire(other.root)), count(other.count), comp(other.comp) {}
 
-        int balance = getBalance(root);
+        Snapshot(Snapshot &&other) noexcept : root(other.root), count(other.count), comp(other.comp) {
+            other.root = nullptr;
+            other.count = 0;
+        }
 
-        if (balance > 1 && getBalance(root->left) >= 0)
-            return rightRotate(root);
+        Snapshot &operator=(Snapshot other) noexcept {
+            swap(root, other.root);
+            swap(count, other.count);
+            swap(comp, other.comp);
+            return *this;
+        }
 
-        if (balance > 1 && getBalance(root->left) < 0) {
-            root->left = leftRotate(root->left);
-            return rightRotate(root);
+        ~Snapshot() {
+            release(root);
         }
 
-        if (balance < -1 && getBalance(root->right) <= 0)
-            return leftRotate(root);
+        size_t size() const {
+            return count;
+        }
 
-        if (balance < -1 && getBalance(root->right) > 0) {
-            root->right = rightRotate(root->right);
-            return leftRotate(root);
+        bool empty() const {
+            return count == 0;
         }
 
-        return root;
-    }
+        /**
+         * @brief Searches for a key in this version.
+         * @note Time Complexity: O(log n).
+         */
+        bool search(const Key &key) const {
+            return findNode(root, key, comp) != nullptr;
+        }
 
-    // Recursive helper for destroying the tree (freeing memory)
-    void destroyRecursive(Node* node) {
-        if (node) {
-            destroyRecursive(node->left);
-            destroyRecursive(node->right);
-            delete node;
+        /**
+         * @brief Looks up the element with the given key in this version.
+         * @return A pointer to the element, or nullptr if the key is absent.
+         */
+        const value_type *find(const Key &key) const {
+            const Node *node = findNode(root, key, comp);
+            return node ? &node->value : nullptr;
         }
-    }
 
-    // Recursive helper for searching a key
-    Node* searchNodeUtil(Node* node, int key) {
-        if (node == nullptr || node->data == key) {
-            return node;
+        /**
+         * @brief Calls fn on every element in key order.
+         * @note Time Complexity: O(n).
+         */
+        template <typename Fn>
+        void for_each(Fn &&fn) const {
+            visit(root, nullptr, nullptr, comp, fn);
         }
-        if (key < node->data) {
-            return searchNodeUtil(node->left, key);
+
+        /**
+         * @brief Calls fn on every element whose key is in [lo, hi), in key
+         *        order.
+         * @note Time Complexity: O(log n + k) for k visited elements.
+         */
+        template <typename Fn>
+        void for_each_in_range(const Key &lo, const Key &hi, Fn &&fn) const {
+            visit(root, &lo, &hi, comp, fn);
         }
-        return searchNodeUtil(node->right, key);
+
+    private:
+        friend class PersistentAVLTree;
+
+        Snapshot(Node *root, size_t count, const Compare &comp) : root(acquire(root)), count(count), comp(comp) {}
+
+        Node *root;
+        size_t count;
+        Compare comp;
+    };
+
+    /**
+     * @brief Constructs an empty tree.
+     */
+    explicit PersistentAVLTree(const Compare &comp = Compare()) : root(nullptr), count(0), comp(comp) {}
+
+    /**
+     * @brief Copies other in O(1); both trees share nodes until they change.
+     */
+    PersistentAVLTree(const PersistentAVLTree &other)
+        : root(acquire(other.root)), count(other.count), comp(other.comp) {}
+
+    PersistentAVLTree(PersistentAVLTree &&other) noexcept : root(other.root), count(other.count), comp(other.comp) {
+        other.root = nullptr;
+        other.count = 0;
+    }
+
+    PersistentAVLTree &operator=(PersistentAVLTree other) noexcept {
+        swap(root, other.root);
+        swap(count, other.count);
+        swap(comp, other.comp);
+        return *this;
+    }
+
+    ~PersistentAVLTree() {
+        release(root);
     }
 
-public:
     /**
-     * @brief Constructs an empty AVLTree.
-     * @note Space Complexity: O(n), where n is the number of nodes in the tree.
+     * @brief Returns an immutable view of the current version.
+     * @note Time Complexity: O(1).
      */
-    AVLTree() : root(nullptr) {}
+    Snapshot snapshot() const {
+        return Snapshot(root, count, comp);
+    }
 
     /**
-     * @brief Destroys the AVLTree, freeing all allocated memory.
+     * @brief Inserts a value unless its key is present.
+     * @return True if the value was inserted.
+     * @note Time Complexity: O(log n); nodes shared with snapshots along the
+     *       search path are copied.
      */
-    ~AVLTree() {
-        destroyRecursive(root);
-        root = nullptr;
+    bool insert(const value_type &value) {
+        const Key &key = Values::key(value);
+        if (findNode(root, key, comp) != nullptr)
+            return false;
+        bool inserted = false;
+        root = insertNode(root, key, inserted, value);
+        ++count;
+        return true;
     }
 
     /**
-     * @brief Inserts a new key into the AVL tree.
-     * @param key The integer key to insert.
-     * @note Time Complexity: O(log n) due to tree traversal and rebalancing operations.
+     * @brief Removes a key.
+     * @return True if the key was present.
+     * @note Time Complexity: O(log n); nodes shared with snapshots along the
+     *       search path are copied.
      */
-    void insert(int key) {
-        root = insertNode(root, key);
+    bool remove(const Key &key) {
+        if (findNode(root, key, comp) == nullptr)
+            return false;
+        root = removeNode(root, key);
+        --count;
+        return true;
     }
 
     /**
-     * @brief Removes a key from the AVL tree.
-     * @param key The integer key to remove.
-     * @note Time Complexity: O(log n) due to tree traversal and rebalancing operations.
+     * @brief Removes every element. Snapshots keep their nodes alive.
      */
-    void remove(int key) {
-        root = deleteNode(root, key);
+    void clear() {
+        release(root);
+        root = nullptr;
+        count = 0;
+    }
+
+    bool search(const Key &key) const {
+        return findNode(root, key, comp) != nullptr;
+    }
+
+    const value_type *find(const Key &key) const {
+        const Node *node = findNode(root, key, comp);
+        return node ? &node->value : nullptr;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
     }
 
     /**
-     * @brief Searches for a key in the AVL tree.
-     * @param key The integer key to search for.
-     * @return True if the key is found, false otherwise.
-     * @note Time Complexity: O(log n) due to tree traversal.
+     * @brief Checks the search-order, height and balance invariants.
+     * @note Time Complexity: O(n). Intended for tests.
      */
-    bool search(int key) {
-        return searchNodeUtil(root, key) != nullptr;
+    bool isValid() const {
+        return checkSubtree(root, nullptr, nullptr) >= 0;
     }
 };
 
+// Multiset mode together with order statistics, for the tests
+struct CountedOptions : OrderStatisticsOptions {
+    static constexpr bool multiset = true;
+};
+
+// Programs that reuse the tree, such as avl_tree_benchmark.cc, define
+// AVL_TREE_NO_MAIN before including this file, which leaves out the tests
+// and main()
+#ifndef AVL_TREE_NO_MAIN
 void runAssertTests() {
     cout << "Running AVLTree Assert Tests..." << endl;
 
@@ -326,6 +6673,766 @@ void runAssertTests() {
     assert(tree_non_exist.search(10));
     cout << "Test 7 (Deleting Non-Existent) PASSED" << endl;
 
+    // Test 8: Node pool reuse and user-supplied upstream resource
+    AVLTree tree_pool;
+    for (int i = 0; i < 1000; ++i) tree_pool.insert(i);
+    for (int i = 0; i < 1000; ++i) tree_pool.remove(i);
+    for (int i = 1000; i < 2000; ++i) tree_pool.insert(i);
+    assert(!tree_pool.search(500) && tree_pool.search(1000) && tree_pool.search(1999));
+
+    unsigned char buffer[4096];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+    AVLTree tree_arena(&arena);
+    for (int i = 0; i < 100; ++i) tree_arena.insert(i * 3);
+    assert(tree_arena.search(0) && tree_arena.search(297) && !tree_arena.search(298));
+    cout << "Test 8 (Node Pool Reuse and Custom Upstream) PASSED" << endl;
+
+    // Test 9: Invariants hold through long insert/delete sequences
+    AVLTree tree_long;
+    for (int i = 0; i < 2000; ++i) tree_long.insert((i * 7919) % 2000);
+    assert(tree_long.isValid());
+    for (int i = 0; i < 2000; i += 2) tree_long.remove(i);
+    assert(tree_long.isValid());
+    for (int i = 0; i < 2000; ++i) assert(tree_long.search(i) == (i % 2 == 1));
+    for (int i = 1999; i >= 0; --i) tree_long.remove(i);
+    assert(tree_long.isValid() && !tree_long.search(1));
+    cout << "Test 9 (Invariants After Long Sequences) PASSED" << endl;
+
+    // Test 10: Map mode with in-place, move-only payloads
+    AVLTree<int, unique_ptr<string>> tree_map;
+    assert(tree_map.try_emplace(2, make_unique<string>("two")).second);
+    assert(tree_map.try_emplace(1, make_unique<string>("one")).second);
+    assert(tree_map.try_emplace(3, make_unique<string>("three")).second);
+    assert(!tree_map.try_emplace(2, make_unique<string>("dup")).second);
+    assert(*tree_map.at(2) == "two");
+    assert(!tree_map.insert_or_assign(2, make_unique<string>("deux")).second);
+    assert(*tree_map.find(2)->second == "deux");
+    assert(tree_map.emplace(4, make_unique<string>("four")).second);
+    assert(tree_map.remove(2) && tree_map.find(2) == nullptr);
+    assert(*tree_map.at(1) == "one" && *tree_map.at(3) == "three" && *tree_map.at(4) == "four");
+    assert(tree_map.size() == 3 && tree_map.isValid());
+    bool threw = false;
+    try {
+        tree_map.at(2);
+    } catch (const out_of_range &) {
+        threw = true;
+    }
+    assert(threw);
+
+    AVLTree<string> tree_str;
+    for (int i = 0; i < 200; ++i) tree_str.insert(to_string(i));
+    for (int i = 0; i < 200; i += 3) tree_str.remove(to_string(i));
+    assert(tree_str.search("1") && !tree_str.search("3") && tree_str.isValid());
+    cout << "Test 10 (Map Mode and Move-Only Payloads) PASSED" << endl;
+
+    // Test 11: Order statistics
+    AVLTree<int, void, less<int>, OrderStatisticsOptions> tree_os;
+    for (int i = 0; i < 1000; ++i) tree_os.insert((i * 7) % 1000);
+    for (int i = 0; i < 1000; i += 4) tree_os.remove(i);
+    assert(tree_os.isValid() && tree_os.size() == 750);
+    assert(tree_os.rank(0) == 0 && tree_os.rank(4) == 3 && tree_os.rank(1000) == 750);
+    assert(*tree_os.select(0) == 1 && *tree_os.select(3) == 5 && tree_os.select(750) == nullptr);
+    assert(tree_os.count_range(10, 20) == 8 && tree_os.count_range(20, 10) == 0);
+    for (size_t k = 0; k < tree_os.size(); k += 37) assert(tree_os.rank(*tree_os.select(k)) == k);
+    cout << "Test 11 (Rank, Select and Range Counts) PASSED" << endl;
+
+    // Test 12: Linear-time construction from sorted input
+    vector<int> sorted_keys;
+    for (int i = 0; i < 10000; ++i) sorted_keys.push_back(i * 2);
+    auto tree_built = AVLTree<>::build_from_sorted(sorted_keys.begin(), sorted_keys.end());
+    assert(tree_built.isValid() && tree_built.size() == 10000);
+    assert(tree_built.search(0) && tree_built.search(19998) && !tree_built.search(7));
+    tree_built.insert(7);
+    tree_built.remove(0);
+    assert(tree_built.isValid() && tree_built.search(7) && !tree_built.search(0));
+
+    vector<int> many_keys(200000);
+    for (int i = 0; i < 200000; ++i) many_keys[i] = i;
+    auto tree_parallel = AVLTree<int, void, less<int>, OrderStatisticsOptions>::build_from_sorted(
+        many_keys.begin(), many_keys.end(), true);
+    assert(tree_parallel.isValid() && tree_parallel.rank(150000) == 150000);
+
+    vector<pair<int, unique_ptr<string>>> sorted_pairs;
+    for (int i = 0; i < 100; ++i) sorted_pairs.emplace_back(i, make_unique<string>(to_string(i)));
+    auto tree_moved = AVLTree<int, unique_ptr<string>>::build_from_sorted(
+        make_move_iterator(sorted_pairs.begin()), make_move_iterator(sorted_pairs.end()));
+    assert(tree_moved.isValid() && *tree_moved.at(42) == "42");
+
+    auto tree_none = AVLTree<>::build_from_sorted(sorted_keys.begin(), sorted_keys.begin());
+    assert(tree_none.empty() && tree_none.isValid());
+    cout << "Test 12 (Build From Sorted Input) PASSED" << endl;
+
+    // Test 13: Batched insert and erase
+    AVLTree<int, void, less<int>, OrderStatisticsOptions> tree_batch;
+    for (int i = 0; i < 10000; i += 2) tree_batch.insert(i);
+    vector<int> small_batch = {5, 1, 3, 5, 4, 9999, 20001};
+    assert(tree_batch.insert_batch(small_batch.begin(), small_batch.end()) == 5);
+    assert(tree_batch.isValid() && tree_batch.size() == 5005 && tree_batch.search(9999) && tree_batch.search(20001));
+    assert(tree_batch.rank(6) == 6);
+    vector<int> small_erase = {4, 3, 3, 7, 20001};
+    assert(tree_batch.erase_batch(small_erase.begin(), small_erase.end()) == 3);
+    assert(tree_batch.isValid() && tree_batch.size() == 5002 && !tree_batch.search(4) && tree_batch.search(5));
+
+    vector<int> large_batch;
+    for (int i = 0; i < 20000; i += 3) large_batch.push_back(i);
+    size_t added = tree_batch.insert_batch(large_batch.begin(), large_batch.end());
+    assert(tree_batch.isValid() && tree_batch.size() == 5002 + added);
+    for (int i = 0; i < 20000; i += 3) assert(tree_batch.search(i));
+    assert(tree_batch.erase_batch(large_batch.begin(), large_batch.end()) == large_batch.size());
+    assert(tree_batch.isValid() && !tree_batch.search(3) && tree_batch.search(2) && tree_batch.rank(3) == 2);
+
+    AVLTree<int, string> tree_batch_map;
+    vector<pair<int, string>> map_batch = {{2, "b"}, {1, "a"}, {2, "dup"}};
+    assert(tree_batch_map.insert_batch(map_batch.begin(), map_batch.end()) == 2);
+    assert(tree_batch_map.at(2) == "b" && tree_batch_map.isValid());
+
+    // A copy that throws midway through a batch leaves the tree unchanged
+    struct FragileCopy {
+        int id;
+        explicit FragileCopy(int id) : id(id) {}
+        FragileCopy(const FragileCopy &other) : id(other.id) {
+            if (id < 0)
+                throw runtime_error("FragileCopy");
+        }
+    };
+    AVLTree<int, FragileCopy> tree_fragile;
+    for (int i = 0; i < 1000; i += 10) tree_fragile.try_emplace(i, i);
+    vector<pair<int, FragileCopy>> fragile_batch;
+    fragile_batch.reserve(4);
+    for (int i : {5, 255, 505, 995}) fragile_batch.emplace_back(piecewise_construct, forward_as_tuple(i), forward_as_tuple(i == 995 ? -1 : i));
+    threw = false;
+    try {
+        tree_fragile.insert_batch(fragile_batch.begin(), fragile_batch.end());
+    } catch (const runtime_error &) {
+        threw = true;
+    }
+    assert(threw && tree_fragile.size() == 100 && !tree_fragile.search(5) && !tree_fragile.search(505));
+    assert(tree_fragile.isValid() && tree_fragile.at(990).id == 990);
+    cout << "Test 13 (Batched Insert and Erase) PASSED" << endl;
+
+    // Test 14: Split, join and set algebra
+    AVLTree<> tree_split;
+    for (int i = 0; i < 1000; ++i) tree_split.insert(i);
+    AVLTree<> upper = tree_split.split(600);
+    assert(tree_split.isValid() && upper.isValid());
+    assert(tree_split.size() == 600 && upper.size() == 400);
+    assert(tree_split.search(599) && !tree_split.search(600) && upper.search(600) && !upper.search(599));
+    AVLTree<> rejoined = AVLTree<>::join(std::move(tree_split), std::move(upper));
+    assert(rejoined.isValid() && rejoined.size() == 1000 && tree_split.empty());
+
+    AVLTree<> low, high;
+    for (int i = 0; i < 300; ++i) low.insert(i);
+    for (int i = 301; i < 320; ++i) high.insert(i);
+    AVLTree<> joined = AVLTree<>::join(std::move(low), 300, std::move(high));
+    assert(joined.isValid() && joined.size() == 320 && joined.search(300));
+
+    AVLTree<int, string> evens, threes;
+    for (int i = 0; i < 3000; i += 2) evens.try_emplace(i, "even");
+    for (int i = 0; i < 3000; i += 3) threes.try_emplace(i, "three");
+    evens.union_with(std::move(threes));
+    assert(evens.isValid() && evens.size() == 2000 && threes.empty());
+    assert(evens.at(6) == "even" && evens.at(9) == "three");
+
+    AVLTree<int, void, less<int>, OrderStatisticsOptions> a, b, c;
+    for (int i = 0; i < 2000; ++i) a.insert(i);
+    for (int i = 0; i < 4000; i += 4) b.insert(i);
+    for (int i = 0; i < 2000; i += 5) c.insert(i);
+    a.intersect_with(std::move(b));
+    assert(a.isValid() && a.size() == 500 && a.search(4) && !a.search(2));
+    a.difference_with(std::move(c));
+    assert(a.isValid() && a.size() == 400 && !a.search(20) && a.search(4));
+    cout << "Test 14 (Split, Join and Set Operations) PASSED" << endl;
+
+    // Test 15: Parallel set operations
+    WorkStealingPool workers(4);
+    AVLTree<> par_a, par_b, par_c, seq_a, seq_b;
+    vector<int> par_keys_a, par_keys_b;
+    for (int i = 0; i < 60000; i += 2) par_keys_a.push_back(i);
+    for (int i = 0; i < 60000; i += 3) par_keys_b.push_back(i);
+    par_a.insert_batch(par_keys_a.begin(), par_keys_a.end());
+    par_b.insert_batch(par_keys_b.begin(), par_keys_b.end());
+    seq_a.insert_batch(par_keys_a.begin(), par_keys_a.end());
+    seq_b.insert_batch(par_keys_b.begin(), par_keys_b.end());
+    par_a.parallel_union(std::move(par_b), workers);
+    seq_a.union_with(std::move(seq_b));
+    assert(par_a.isValid() && par_a.size() == seq_a.size() && par_a.size() == 40000);
+
+    for (int i = 0; i < 60000; i += 5) par_c.insert(i);
+    par_a.parallel_difference(std::move(par_c), workers);
+    assert(par_a.isValid() && par_a.size() == 32000 && !par_a.search(10) && par_a.search(2));
+
+    AVLTree<> par_d;
+    for (int i = 0; i < 60000; i += 7) par_d.insert(i);
+    par_a.parallel_intersect(std::move(par_d), workers);
+    assert(par_a.isValid() && par_a.size() == 4571 && par_a.search(14) && !par_a.search(35));
+    cout << "Test 15 (Parallel Set Operations) PASSED" << endl;
+
+    // Test 16: Iterators and range scans
+    AVLTree<> iter_tree;
+    for (int i = 1; i <= 100; ++i) iter_tree.insert(i * 10);
+    int expected = 10;
+    for (int key : iter_tree) {
+        assert(key == expected);
+        expected += 10;
+    }
+    assert(expected == 1010);
+    assert(distance(iter_tree.begin(), iter_tree.end()) == 100);
+    assert(*iter_tree.rbegin() == 1000 && *prev(iter_tree.end()) == 1000);
+    assert(*iter_tree.lower_bound(55) == 60 && *iter_tree.lower_bound(60) == 60);
+    assert(*iter_tree.upper_bound(60) == 70 && iter_tree.upper_bound(1000) == iter_tree.end());
+    assert(*iter_tree.lower_bound(-5) == 10 && iter_tree.lower_bound(1001) == iter_tree.end());
+    auto range = iter_tree.equal_range(500);
+    assert(*range.first == 500 && *range.second == 510);
+    auto back = iter_tree.end();
+    for (int key = 1000; key >= 10; key -= 10) assert(*--back == key);
+    assert(back == iter_tree.begin());
+    int visited = 0, range_sum = 0;
+    iter_tree.for_each_in_range(95, 150, [&](int key) { ++visited; range_sum += key; });
+    assert(visited == 5 && range_sum == 600);
+    iter_tree.for_each_in_range(150, 95, [&](int) { assert(false); });
+
+    AVLTree<int, string> iter_map;
+    iter_map.insert_or_assign(2, string("b"));
+    iter_map.insert_or_assign(1, string("a"));
+    for (auto &entry : iter_map) entry.second += "!";
+    AVLTree<int, string>::const_iterator first = iter_map.begin();
+    assert(first->first == 1 && first->second == "a!" && next(first)->second == "b!");
+    cout << "Test 16 (Iterators and Range Scans) PASSED" << endl;
+
+    // Test 17: Concurrent tree
+    ConcurrentAVLTree<> shared_tree;
+    for (int i = 0; i < 4000; i += 2) shared_tree.insert(i);
+    vector<thread> writers;
+    atomic<bool> reader_failed(false);
+    for (int w = 0; w < 4; ++w) {
+        writers.emplace_back([&shared_tree, w] {
+            for (int round = 0; round < 3; ++round) {
+                for (int i = w; i < 4000; i += 4) shared_tree.insert(i);
+                for (int i = w; i < 4000; i += 4)
+                    if (i % 3 == 0) shared_tree.remove(i);
+            }
+        });
+    }
+    thread reader([&] {
+        // Keys that are never removed must stay visible throughout
+        for (int round = 0; round < 20; ++round)
+            for (int i = 2; i < 4000; i += 6)
+                if (i % 3 != 0 && !shared_tree.search(i)) reader_failed = true;
+    });
+    for (thread &writer : writers) writer.join();
+    reader.join();
+    assert(!reader_failed && shared_tree.isValid());
+    assert(shared_tree.size() == 4000 - 1334);
+    for (int i = 0; i < 4000; ++i) assert(shared_tree.search(i) == (i % 3 != 0));
+    cout << "Test 17 (Concurrent Tree) PASSED" << endl;
+
+    // Test 18: Persistent snapshots
+    PersistentAVLTree<> versioned;
+    for (int i = 1; i <= 1000; ++i) versioned.insert(i);
+    PersistentAVLTree<>::Snapshot before = versioned.snapshot();
+    for (int i = 2; i <= 1000; i += 2) assert(versioned.remove(i));
+    for (int i = 2000; i < 2100; ++i) versioned.insert(i);
+    assert(versioned.isValid() && versioned.size() == 600 && !versioned.search(500));
+    assert(before.size() == 1000 && before.search(500) && !before.search(2000));
+    long long before_sum = 0;
+    int last = 0;
+    before.for_each([&](int key) { assert(key > last); last = key; before_sum += key; });
+    assert(before_sum == 500500);
+    int in_range = 0;
+    before.for_each_in_range(10, 20, [&](int) { ++in_range; });
+    assert(in_range == 10);
+
+    PersistentAVLTree<> fork = versioned;
+    fork.insert(500);
+    assert(fork.search(500) && !versioned.search(500) && fork.isValid());
+    before = PersistentAVLTree<>::Snapshot();
+
+    PersistentAVLTree<int, string> versioned_map;
+    versioned_map.insert({1, "one"});
+    auto map_view = versioned_map.snapshot();
+    versioned_map.remove(1);
+    versioned_map.insert({1, "uno"});
+    assert(map_view.find(1)->second == "one" && versioned_map.find(1)->second == "uno");
+
+    PersistentAVLTree<>::Snapshot frozen = versioned.snapshot();
+    thread snapshot_reader([frozen] {
+        for (int round = 0; round < 50; ++round)
+            for (int i = 1; i <= 1000; i += 2) assert(frozen.search(i));
+    });
+    for (int i = 1; i <= 1000; i += 2) versioned.remove(i);
+    snapshot_reader.join();
+    assert(versioned.size() == 100 && versioned.isValid());
+    cout << "Test 18 (Persistent Snapshots) PASSED" << endl;
+
+    // Test 19: Frozen van Emde Boas layout
+    AVLTree<> to_freeze;
+    for (int i = 0; i < 5000; ++i) to_freeze.insert(i * 3);
+    auto frozen_set = to_freeze.freeze();
+    assert(to_freeze.empty() && frozen_set.size() == 5000);
+    assert(frozen_set.search(0) && frozen_set.search(14997) && !frozen_set.search(1) && !frozen_set.search(15000));
+    assert(*frozen_set.lower_bound(1) == 3 && *frozen_set.lower_bound(-1) == 0 && frozen_set.lower_bound(14998) == nullptr);
+    int frozen_next = 0;
+    frozen_set.for_each([&](int key) { assert(key == frozen_next); frozen_next += 3; });
+    assert(frozen_next == 15000);
+    auto thawed = frozen_set.thaw();
+    assert(frozen_set.empty() && thawed.isValid() && thawed.size() == 5000 && thawed.search(300));
+
+    AVLTree<int, string> map_to_freeze;
+    for (int i = 0; i < 10; ++i) map_to_freeze.insert_or_assign(i, to_string(i));
+    auto frozen_map = map_to_freeze.freeze();
+    assert(frozen_map.find(7)->second == "7" && frozen_map.find(10) == nullptr);
+    struct Directed {
+        bool descending = false;
+        bool operator()(int a, int b) const {
+            return descending ? b < a : a < b;
+        }
+    };
+    AVLTree<int, void, Directed> descending_tree(std::pmr::new_delete_resource(), Directed{true});
+    for (int i = 0; i < 100; ++i) descending_tree.insert(i);
+    auto frozen_descending = descending_tree.freeze();
+    assert(frozen_descending.search(42) && *frozen_descending.lower_bound(200) == 99);
+    auto thawed_descending = frozen_descending.thaw();
+    assert(thawed_descending.insert(-1) && thawed_descending.insert(100) && thawed_descending.isValid());
+    assert(*thawed_descending.begin() == 100 && thawed_descending.search(42) && !thawed_descending.insert(7));
+    auto frozen_empty = AVLTree<>().freeze();
+    assert(frozen_empty.empty() && !frozen_empty.search(0) && frozen_empty.lower_bound(0) == nullptr);
+    cout << "Test 19 (Frozen Layout) PASSED" << endl;
+
+    // Test 20: Batched lookups
+    AVLTree<> batch_lookup;
+    for (int i = 0; i < 3000; i += 3) batch_lookup.insert(i);
+    vector<int> probes;
+    for (int i = -5; i < 3010; ++i) probes.push_back(i);
+    unique_ptr<bool[]> probe_found(new bool[probes.size()]);
+    vector<const int *> probe_bounds(probes.size());
+    batch_lookup.search_many(probes.data(), probes.size(), probe_found.get());
+    batch_lookup.lower_bound_many(probes.data(), probes.size(), probe_bounds.data());
+    for (size_t i = 0; i < probes.size(); ++i) {
+        int key = probes[i];
+        assert(probe_found[i] == batch_lookup.search(key));
+        auto bound = batch_lookup.lower_bound(key);
+        assert(bound == batch_lookup.end() ? probe_bounds[i] == nullptr : probe_bounds[i] && *probe_bounds[i] == *bound);
+    }
+    AVLTree<>().search_many(probes.data(), probes.size(), probe_found.get());
+    assert(!probe_found[0] && !probe_found[probes.size() - 1]);
+    cout << "Test 20 (Batched Lookups) PASSED" << endl;
+
+    // Test 21: Blocked leaves
+    BlockedAVLTree blocked;
+    vector<int> blocked_keys;
+    for (int i = 0; i < 20000; ++i) blocked_keys.push_back((i * 7919) % 20000 - 10000);
+    for (int key : blocked_keys) assert(blocked.insert(key));
+    assert(!blocked.insert(0) && blocked.size() == 20000 && blocked.isValid());
+    assert(blocked.blocks() < 20000 / 8 + 1);
+    for (int key = -10000; key < 10000; key += 2) assert(blocked.remove(key));
+    assert(!blocked.remove(-10000) && blocked.size() == 10000 && blocked.isValid());
+    assert(blocked.search(-9999) && !blocked.search(-9998) && !blocked.search(10001));
+    int blocked_next = -9999;
+    blocked.for_each([&](int key) { assert(key == blocked_next); blocked_next += 2; });
+    assert(blocked_next == 10001);
+    assert(blocked.insert(numeric_limits<int>::min()) && blocked.insert(numeric_limits<int>::max()));
+    assert(blocked.search(numeric_limits<int>::min()) && blocked.search(numeric_limits<int>::max()));
+    for (int key = -9999; key < 10000; key += 2) assert(blocked.remove(key));
+    assert(blocked.remove(numeric_limits<int>::min()) && blocked.remove(numeric_limits<int>::max()));
+    assert(blocked.empty() && blocked.blocks() == 0 && blocked.isValid() && !blocked.search(5));
+    cout << "Test 21 (Blocked Leaves) PASSED" << endl;
+
+    // Test 22: Binary snapshots
+    const string snapshot_path = "avl_tree_test.snapshot";
+    AVLTree<int, double, less<int>, OrderStatisticsOptions> saved;
+    for (int i = 0; i < 5000; ++i) saved.insert_or_assign((i * 37) % 5000, i * 0.5);
+    saved.save(snapshot_path);
+    auto loaded = AVLTree<int, double, less<int>, OrderStatisticsOptions>::load(snapshot_path);
+    assert(loaded.isValid() && loaded.size() == 5000 && loaded.rank(2500) == 2500);
+    assert(equal(saved.begin(), saved.end(), loaded.begin(), loaded.end()));
+    {
+        auto mapped = AVLTree<int, double, less<int>, OrderStatisticsOptions>::open_mmap(snapshot_path);
+        assert(mapped.size() == 5000 && mapped.search(4999) && !mapped.search(5000) && !mapped.search(-1));
+        assert(mapped.find(37)->mapped == 0.5);
+    }
+    FILE *snapshot_file = fopen(snapshot_path.c_str(), "r+b");
+    fseek(snapshot_file, -20, SEEK_END);
+    fputc(fgetc(snapshot_file) ^ 1, snapshot_file);
+    fclose(snapshot_file);
+    bool snapshot_rejected = false;
+    try {
+        AVLTree<int, double, less<int>, OrderStatisticsOptions>::load(snapshot_path);
+    } catch (const runtime_error &) {
+        snapshot_rejected = true;
+    }
+    assert(snapshot_rejected);
+    AVLTree<> unsaved;
+    unsaved.save(snapshot_path);
+    assert(AVLTree<>::load(snapshot_path).empty() && AVLTree<>::open_mmap(snapshot_path).empty());
+    snapshot_rejected = false;
+    try {
+        AVLTree<long>::open_mmap(snapshot_path);
+    } catch (const runtime_error &) {
+        snapshot_rejected = true;
+    }
+    assert(snapshot_rejected);
+    remove(snapshot_path.c_str());
+    cout << "Test 22 (Binary Snapshots) PASSED" << endl;
+
+    // Test 23: Write-ahead log
+    const string durable_path = "avl_tree_test.durable";
+    {
+        DurableAVLTree<> durable(durable_path, 16);
+        for (int i = -500; i < 500; ++i) assert(durable.insert(i));
+        for (int i = -500; i < 500; i += 3) assert(durable.remove(i));
+        assert(!durable.remove(-500) && durable.size() == 666 && durable.tree().isValid());
+    }
+    {
+        DurableAVLTree<> durable(durable_path);
+        assert(durable.size() == 666 && durable.search(-499) && !durable.search(-500) && durable.tree().isValid());
+        durable.compact();
+        assert(durable.log_bytes() == 0);
+        assert(durable.insert(-500) && durable.remove(498));
+        durable.commit();
+    }
+    snapshot_file = fopen((durable_path + ".wal").c_str(), "ab");
+    fputc(7, snapshot_file);
+    fclose(snapshot_file);
+    {
+        DurableAVLTree<> durable(durable_path);
+        assert(durable.size() == 666 && durable.search(-500) && !durable.search(498));
+    }
+    // A corrupt length close to 2^64 must not wrap past the bounds check
+    snapshot_file = fopen((durable_path + ".wal").c_str(), "ab");
+    for (int i = 0; i < 9; ++i) fputc(0xff, snapshot_file);
+    fputs("\x01torn", snapshot_file);
+    fclose(snapshot_file);
+    {
+        DurableAVLTree<> durable(durable_path);
+        assert(durable.size() == 666 && durable.search(-500) && durable.insert(498));
+    }
+    {
+        DurableAVLTree<> durable(durable_path);
+        assert(durable.size() == 667 && durable.search(498));
+    }
+    {
+        DurableAVLTree<long, double> durable_map(durable_path + ".map", 1);
+        durable_map.insert_or_assign(1L << 40, 2.5);
+        durable_map.insert_or_assign(1L << 40, 3.5);
+        durable_map.insert_or_assign(-7, 1.0);
+    }
+    {
+        DurableAVLTree<long, double> durable_map(durable_path + ".map");
+        assert(durable_map.size() == 2 && durable_map.tree().find(1L << 40)->second == 3.5);
+    }
+    for (const char *suffix : {".snapshot", ".wal", ".map.wal"}) remove((durable_path + suffix).c_str());
+    cout << "Test 23 (Write-Ahead Log) PASSED" << endl;
+
+    // Test 24: Hot-path counters
+#if AVL_TREE_STATS
+    AVLTree<>::reset_stats();
+    AVLTree<> counted;
+    for (int i = 0; i < 1023; ++i) counted.insert(i);
+    AVLTreeStats ascending = AVLTree<>::stats();
+    assert(ascending.inserts == 1023 && ascending.rotations() == ascending.rotations_rr);
+    assert(ascending.rotations_rr == 1013 && ascending.retraces == 1023);
+    assert(counted.search(0) && !counted.remove(5000));
+    AVLTreeStats after = AVLTree<>::stats();
+    assert(after.searches == 1 && after.removes == 1 && after.depth[9] == ascending.depth[9] + 1 && after.depth[10] == ascending.depth[10] + 1);
+    thread([] { AVLTree<> other; other.insert(1); }).join();
+    assert(AVLTree<>::stats().inserts == 1024);
+    cout << "Test 24 (Hot-Path Counters) PASSED" << endl;
+#else
+    cout << "Test 24 (Hot-Path Counters) skipped: build with -DAVL_TREE_STATS=1" << endl;
+#endif
+
+    // Test 25: Iterative and background teardown
+    auto teardown_token = make_shared<int>(0);
+    AVLTree<int, shared_ptr<int>> async_tree;
+    for (int i = 0; i < 100000; ++i) async_tree.try_emplace(i, teardown_token);
+    async_tree.clear_async();
+    assert(async_tree.empty() && async_tree.memory_usage() == 0);
+    assert(async_tree.insert_or_assign(7, teardown_token).second && async_tree.find(7)->second == teardown_token);
+    BackgroundReclaimer::shared().drain();
+    assert(teardown_token.use_count() == 2);
+    async_tree.try_emplace(3, teardown_token);
+    AVLTree<int, shared_ptr<int>> split_tail = async_tree.split(7);
+    split_tail.clear_async();
+    assert(teardown_token.use_count() == 2 && async_tree.size() == 1);
+    async_tree.clear();
+    assert(teardown_token.use_count() == 1);
+    AVLTree<> sorted_chain;
+    for (int i = 0; i < 100000; ++i) sorted_chain.insert(i);
+    sorted_chain.clear_async();
+    assert(sorted_chain.empty() && sorted_chain.insert(1));
+    BackgroundReclaimer::shared().drain();
+    cout << "Test 25 (Iterative and Background Teardown) PASSED" << endl;
+
+    // Test 26: Finger search
+    AVLTree<int, int> fingered;
+    auto finger = fingered.cursor();
+    for (int i = 0; i < 20000; ++i) assert(finger.insert_near(i, -i).second);
+    for (int i = 19999; i >= 0; i -= 2) assert(finger.insert_near(i, 0).first->second == -i);
+    assert(fingered.isValid() && fingered.size() == 20000);
+    for (int i = 0; i < 20000; i += 7) assert(finger.seek(i)->second == -i && !finger.seek(i + 20000));
+    fingered.remove(100);
+    assert(!finger.seek(100) && finger.seek(101) && finger.insert_near(100, 1).second);
+    auto second_finger = fingered.cursor();
+    for (int i = -1; i > -1000; --i) assert(second_finger.insert_near(i, i).second);
+    for (int i = 50000; i > 20000; i -= 3) assert(finger.insert_near(i, i).second);
+    assert(fingered.isValid() && fingered.size() == 20000 + 999 + 10000 && finger.seek(-500)->second == -500);
+    cout << "Test 26 (Finger Search) PASSED" << endl;
+
+    // Test 27: Append mode
+    AVLTree<int, int> appended;
+    for (int i = 0; i < 30000; i += 3) assert(appended.append(i, i).second);
+    assert(appended.isValid() && appended.size() == 10000);
+    assert(!appended.append(300, 0).second && appended.append(301, 1).second && appended.isValid());
+    appended.remove(29997);
+    assert(appended.insert_hint(appended.cend(), 29997, 2).second && appended.append(40000, 3).second);
+    assert(appended.insert_hint(appended.cbegin(), -1, 4).second && !appended.insert_hint(appended.cend(), 0, 5).second);
+    assert(appended.isValid() && appended.size() == 10003 && prev(appended.end())->first == 40000);
+    assert(appended.find(29997)->second == 2 && appended.find(0)->second == 0);
+    cout << "Test 27 (Append Mode) PASSED" << endl;
+
+    // Test 28: Range extract and erase
+    AVLTree<int, int, less<int>, OrderStatisticsOptions> ranged;
+    for (int i = 0; i < 10000; ++i) ranged.insert_or_assign(i, i);
+    auto extracted = ranged.extract_range(2000, 3000);
+    assert(extracted.size() == 1000 && extracted.begin()->first == 2000 && prev(extracted.end())->first == 2999);
+    assert(ranged.size() == 9000 && ranged.isValid() && extracted.isValid() && !ranged.search(2500));
+    ranged.erase_range(0, 1000);
+    ranged.erase_range(9500, 20000);
+    ranged.erase_range(5, 5);
+    assert(ranged.size() == 7500 && ranged.isValid() && ranged.begin()->first == 1000 && ranged.rank(5000) == 3000);
+    size_t ranged_bytes = ranged.memory_usage();
+    for (int i = 0; i < 1000; ++i) ranged.insert_or_assign(i, -i);
+    assert(ranged.memory_usage() == ranged_bytes && ranged.size() == 8500 && ranged.isValid());
+    AVLTree<int, string> ranged_strings;
+    for (int i = 0; i < 100; ++i) ranged_strings.insert_or_assign(i, to_string(i));
+    ranged_strings.erase_range(10, 90);
+    assert(ranged_strings.size() == 20 && ranged_strings.find(90)->second == "90" && ranged_strings.isValid());
+    cout << "Test 28 (Range Extract and Erase) PASSED" << endl;
+
+    // Test 29: Subtree aggregates
+    struct SumOptions : OrderStatisticsOptions {
+        using aggregate = SumAggregate<long long>;
+    };
+    AVLTree<int, long long, less<int>, SumOptions> sums;
+    for (int i = 0; i < 5000; ++i) sums.insert_or_assign((i * 7919) % 5000, i % 100);
+    for (int i = 0; i < 5000; i += 3) sums.remove(i);
+    for (int i = 1; i < 5000; i += 6) sums.insert_or_assign(i, 1000);
+    auto sum_between = [&](int lo, int hi) {
+        long long total = 0;
+        sums.for_each_in_range(lo, hi, [&](const pair<const int, long long> &kv) { total += kv.second; });
+        return total;
+    };
+    for (int lo = -10; lo < 5010; lo += 97)
+        for (int hi = lo; hi < 5020; hi += 389) assert(sums.aggregate(lo, hi) == sum_between(lo, hi));
+    sums.erase_range(1000, 2000);
+    auto sums_tail = sums.split(3000);
+    assert(sums.aggregate(0, 5000) == sum_between(0, 5000) && sums_tail.aggregate(0, 5000) > 0);
+    assert(sums.isValid() && sums_tail.isValid() && sums.aggregate(1000, 2000) == 0);
+    struct ConcatOptions : AVLTreeOptions {
+        struct aggregate {
+            using type = string;
+            static string identity() { return string(); }
+            static string lift(const pair<const int, string> &kv) { return kv.second; }
+            static string combine(const string &a, const string &b) { return a + b; }
+        };
+    };
+    AVLTree<int, string, less<int>, ConcatOptions> words;
+    for (int i = 25; i >= 0; --i) words.insert_or_assign(i, string(1, static_cast<char>('a' + i)));
+    assert(words.aggregate(0, 26) == "abcdefghijklmnopqrstuvwxyz" && words.aggregate(3, 7) == "defg");
+    words.insert_or_assign(4, string("E"));
+    words.remove(5);
+    assert(words.aggregate(2, 8) == "cdEgh" && words.aggregate(8, 2).empty());
+    // Values of an aggregated map are read-only and change through modify()
+    static_assert(is_const<remove_reference_t<decltype(*words.begin())>>::value, "");
+    static_assert(is_const<remove_reference_t<decltype(words.at(0))>>::value, "");
+    assert(words.modify(6, [](string &word) { word = "G"; }) && !words.modify(5, [](string &) {}));
+    assert(words.aggregate(2, 8) == "cdEGh" && words.aggregate(0, 26).size() == 25);
+    struct MaxOptions : AVLTreeOptions {
+        using aggregate = MaxAggregate<int>;
+    };
+    AVLTree<int, int, less<int>, MaxOptions> peaks;
+    for (int i = 0; i < 1000; ++i) peaks.insert_or_assign(i, (i * 37) % 1000);
+    assert(peaks.aggregate(0, 1000) == 999 && peaks.aggregate(0, 27) == 962 && peaks.aggregate(5, 5) == numeric_limits<int>::lowest());
+    cout << "Test 29 (Subtree Aggregates) PASSED" << endl;
+
+    // Test 30: Interval tree
+    IntervalTree<int> reservations;
+    vector<pair<int, int>> reserved;
+    for (int i = 0; i < 3000; ++i) {
+        int start = (i * 7919) % 10000, end = start + (i * 31) % 200;
+        if (reservations.insert(start, end)) reserved.push_back({start, end});
+    }
+    assert(!reservations.insert(reserved[0].first, reserved[0].second) && reservations.isValid());
+    for (int i = 0; i < 1000; i += 2) {
+        assert(reservations.remove(reserved[i].first, reserved[i].second));
+        reserved[i] = {1, 0};
+    }
+    for (int a = -50; a < 10300; a += 173) {
+        for (int b : {a, a + 5, a + 400}) {
+            vector<pair<int, int>> expected, found;
+            for (const auto &r : reserved)
+                if (r.first <= r.second && r.first <= b && a <= r.second) expected.push_back(r);
+            sort(expected.begin(), expected.end());
+            reservations.find_overlapping(a, b, [&](const pair<int, int> &r) { found.push_back(r); });
+            assert(found == expected && reservations.overlaps(a, b) == !expected.empty());
+        }
+    }
+    IntervalTree<double, string> bookings;
+    assert(bookings.insert_or_assign(1.0, 2.5, string("morning")) && bookings.insert_or_assign(2.0, 4.0, string("noon")));
+    assert(!bookings.insert_or_assign(1.0, 2.5, string("early")) && bookings.size() == 2);
+    vector<string> booked;
+    bookings.find_overlapping(2.25, 2.25, [&](const pair<const pair<double, double>, string> &b) { booked.push_back(b.second); });
+    assert(booked == vector<string>({"early", "noon"}) && !bookings.overlaps(4.5, 9.0));
+    bool rejected = false;
+    try {
+        bookings.insert_or_assign(3.0, 1.0, string("backwards"));
+    } catch (const invalid_argument &) {
+        rejected = true;
+    }
+    assert(rejected);
+    const double infinity = numeric_limits<double>::infinity();
+    IntervalTree<double> open_ended;
+    assert(open_ended.insert(5.0, infinity) && open_ended.insert(-infinity, -1.0) && open_ended.insert(0.5, 1.5));
+    vector<pair<double, double>> touching;
+    open_ended.find_overlapping(0.0, 5.0, [&](const pair<double, double> &r) { touching.push_back(r); });
+    vector<pair<double, double>> expected_touching = {{0.5, 1.5}, {5.0, infinity}};
+    assert(touching == expected_touching);
+    assert(open_ended.overlaps(5.0, 5.0) && open_ended.overlaps(infinity, infinity) && open_ended.overlaps(-infinity, -3.0));
+    assert(!open_ended.overlaps(-0.5, 0.25) && open_ended.isValid());
+    cout << "Test 30 (Interval Tree) PASSED" << endl;
+
+    // Test 31: Sharded tree
+    ShardedAVLTree<int> sharded({1000000, 2000000, 3000000});
+    vector<thread> ingest;
+    atomic<bool> sharded_reader_failed(false);
+    for (int w = 0; w < 4; ++w) {
+        // Every key falls into the first shard's initial range
+        ingest.emplace_back([&sharded, w] {
+            for (int i = w; i < 40000; i += 4) sharded.insert(i * 7);
+            for (int i = w; i < 40000; i += 4)
+                if (i % 5 == 0) sharded.remove(i * 7);
+        });
+    }
+    thread sharded_reader([&] {
+        for (int round = 0; round < 5; ++round)
+            for (int i = 1; i < 40000; i += 97)
+                if (i % 5 != 0 && sharded.search(i * 7) && !sharded.search(i * 7)) sharded_reader_failed = true;
+    });
+    for (thread &writer : ingest) writer.join();
+    sharded_reader.join();
+    assert(!sharded_reader_failed && sharded.isValid() && sharded.size() == 32000);
+    sharded.rebalance();
+    assert(sharded.isValid() && sharded.shard_size(0) < 32000 && sharded.shard_size(3) > 0);
+    int sharded_last = -1;
+    size_t sharded_seen = 0;
+    sharded.for_each([&](int key) {
+        assert(key > sharded_last && key % 35 != 0);
+        sharded_last = key;
+        ++sharded_seen;
+    });
+    assert(sharded_seen == 32000);
+    vector<int> sharded_range;
+    sharded.for_each_in_range(700, 1400, [&](int key) { sharded_range.push_back(key); });
+    assert(sharded_range.size() == 80 && sharded_range.front() == 707 && sharded_range.back() == 1393);
+    ShardedAVLTree<string, int> sharded_map({"m"});
+    assert(sharded_map.insert_or_assign("apple", 1) && sharded_map.insert_or_assign("zebra", 2));
+    assert(!sharded_map.insert_or_assign("apple", 3) && sharded_map.get("apple") == 3 && !sharded_map.get("kiwi"));
+    assert(sharded_map.shard_size(0) == 1 && sharded_map.remove("zebra") && sharded_map.isValid());
+    cout << "Test 31 (Sharded Tree) PASSED" << endl;
+
+    // Test 32: Compile-time tree
+    static constexpr StaticAVLTree config(array<int, 9>{{42, 7, 19, 3, 88, 64, 11, 25, 5}});
+    static_assert(config.size() == 9 && config.search(64) && !config.search(63), "constexpr search");
+    static_assert(*config.lower_bound(20) == 25 && *config.lower_bound(3) == 3 && *config.find(88) == 88,
+                  "constexpr lower_bound");
+    static constexpr StaticAVLTree<int, 0> no_config(array<int, 0>{});
+    static_assert(!no_config.search(1) && no_config.empty(), "empty table");
+    assert(!config.lower_bound(89) && !no_config.lower_bound(0) && !config.find(4));
+    constexpr auto squares = [] {
+        array<long long, 100> keys{};
+        for (size_t i = 0; i < keys.size(); ++i) keys[i] = static_cast<long long>((i * 37) % 100) * ((i * 37) % 100);
+        return StaticAVLTree(keys);
+    }();
+    for (long long probe = -1; probe < 10001; ++probe) {
+        long long root = 0;
+        while (root * root < probe) ++root;
+        const long long *bound = squares.lower_bound(probe);
+        assert(root < 100 ? bound && *bound == root * root : !bound);
+        assert(squares.search(probe) == (root < 100 && root * root == probe));
+    }
+    long long previous_square = -1;
+    squares.for_each([&](long long key) {
+        assert(key > previous_square);
+        previous_square = key;
+    });
+    cout << "Test 32 (Compile-Time Tree) PASSED" << endl;
+
+    // Test 33: Multiset mode
+    AVLTree<int, void, less<int>, CountedOptions> multiset_counted;
+    for (int i = 0; i < 3000; ++i) assert(multiset_counted.insert(i % 1000));
+    for (int i = 0; i < 1000; i += 2) assert(multiset_counted.remove(i));
+    assert(multiset_counted.size() == 2500 && multiset_counted.count(0) == 2 && multiset_counted.count(1) == 3 && multiset_counted.count(1000) == 0);
+    assert(multiset_counted.rank(10) == 25 && *multiset_counted.select(25) == 10 && *multiset_counted.select(27) == 11 && multiset_counted.isValid());
+    assert(multiset_counted.count_range(0, 4) == 10);
+    for (int i = 0; i < 1000; i += 2) assert(multiset_counted.remove(i) && multiset_counted.remove(i));
+    assert(!multiset_counted.remove(0) && multiset_counted.count(0) == 0 && multiset_counted.size() == 1500 && multiset_counted.isValid());
+    assert(multiset_counted.emplace(7).second && multiset_counted.append(999).second && multiset_counted.cursor().insert_near(5).second);
+    assert(multiset_counted.count(7) == 4 && multiset_counted.count(999) == 4 && multiset_counted.count(5) == 4 && multiset_counted.size() == 1503);
+    auto multiset_finger = multiset_counted.cursor();
+    for (int round = 0; round < 3; ++round)
+        for (int k = 101; k < 121; k += 2) assert(multiset_finger.insert_near(k).second);
+    assert(multiset_counted.count(101) == 6 && multiset_counted.size() == 1533 && multiset_counted.isValid());
+    assert(multiset_counted.rank(101) == 152 && multiset_counted.count_range(101, 121) == 60);
+    for (int round = 0; round < 3; ++round)
+        for (int k = 101; k < 121; k += 2) assert(multiset_counted.remove(k));
+    auto multiset_counted_tail = multiset_counted.split(500);
+    assert(multiset_counted.size() == 752 && multiset_counted_tail.size() == 751 && multiset_counted_tail.rank(503) == 3);
+    vector<int> doomed = {501, 503, 504};
+    assert(multiset_counted_tail.erase_batch(doomed.begin(), doomed.end()) == 6 && multiset_counted_tail.size() == 745);
+    // remove() drops one occurrence, erase_batch every occurrence of a key
+    assert(multiset_counted_tail.remove(505) && multiset_counted_tail.count(505) == 2);
+    vector<int> doomed_all;
+    for (int i = 500; i < 1000; ++i) doomed_all.push_back(i);
+    size_t tail_size = multiset_counted_tail.size();
+    assert(multiset_counted_tail.erase_batch(doomed_all.begin(), doomed_all.end()) == tail_size);
+    assert(multiset_counted_tail.empty() && multiset_counted_tail.isValid());
+    AVLTree<int, void, less<int>, MultisetOptions> plain_counted;
+    for (int i = 0; i < 100; ++i) plain_counted.insert(i % 10);
+    plain_counted.erase_range(0, 5);
+    assert(plain_counted.size() == 50 && plain_counted.count(7) == 10 && plain_counted.isValid());
+    cout << "Test 33 (Multiset Mode) PASSED" << endl;
+
+    // Test 34: Heterogeneous lookup and key prefixes
+    AVLTree<string, int, less<>> by_name;
+    for (int i = 0; i < 1000; ++i) by_name.insert_or_assign("user-" + to_string(i), i);
+    string_view probe_name = "user-421";
+    assert(by_name.search(probe_name) && by_name.find(probe_name)->second == 421 && !by_name.search("user-1000"));
+    assert(by_name.count("user-7") == 1 && by_name.lower_bound(string_view("user-42"))->first == "user-42");
+    assert(by_name.upper_bound("user-999") == by_name.end() && by_name.equal_range("user-5").first->second == 5);
+    AVLTree<string, void, less<string>, KeyPrefixOptions> prefixed;
+    vector<string> reference_names;
+    for (int i = 0; i < 3000; ++i) {
+        // Long shared prefixes, short keys, embedded zero bytes and high bytes
+        string name = i % 3 == 0 ? "customer/" + to_string(i * 7919 % 3000) : to_string(i);
+        if (i % 7 == 0) name += string(1, '\0') + "x";
+        if (i % 11 == 0) name = string(1, static_cast<char>(0xF0 + i % 16)) + name;
+        if (prefixed.insert(name)) reference_names.push_back(name);
+    }
+    sort(reference_names.begin(), reference_names.end());
+    reference_names.erase(unique(reference_names.begin(), reference_names.end()), reference_names.end());
+    assert(prefixed.size() == reference_names.size() && prefixed.isValid());
+    assert(equal(prefixed.begin(), prefixed.end(), reference_names.begin()));
+    for (size_t i = 0; i < reference_names.size(); i += 2) assert(prefixed.remove(reference_names[i]));
+    for (size_t i = 0; i < reference_names.size(); ++i) {
+        const string &name = reference_names[i];
+        assert(prefixed.search(name) == (i % 2 == 1));
+        auto bound = prefixed.lower_bound(name);
+        assert(bound != prefixed.end() || i + 1 >= reference_names.size());
+        if (bound != prefixed.end()) assert(*bound == reference_names[i % 2 == 1 ? i : i + 1]);
+    }
+    assert(prefixed.isValid() && prefixed.lower_bound(string("\xff\xff")) == prefixed.end());
+    cout << "Test 34 (Heterogeneous Lookup and Key Prefixes) PASSED" << endl;
+
     cout << "All AVLTree assert tests completed successfully!" << endl;
 }
 
@@ -349,9 +7456,9 @@ void runAVLTreeSample() {
     tree.remove(10);
 }
 
-
 int main() {
     runAssertTests();
     runAVLTreeSample();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
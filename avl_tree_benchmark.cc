@@ -0,0 +1,395 @@
+// Benchmarks for AVLTree against std::set, absl::btree_set (when its headers
+// are available) and a sorted std::vector.
+//
+// Build: g++ -std=c++17 -O2 -DNDEBUG avl_tree_benchmark.cc -o avl_tree_benchmark -lbenchmark -lpthread
+// Run:   ./avl_tree_benchmark [--max_size=N] [--benchmark_filter=...]
+//
+// Sizes run from 1K up to --max_size (default 2^20; pass 100000000 for the
+// largest runs). Steady-state benchmarks report the time of one operation as
+// the benchmark time; insert benchmarks build a whole container per iteration
+// and report time/op. Every benchmark also reports bytes/key, counted
+// through an allocator for the standard containers and from the node pool for
+// AVLTree. Add -DAVL_TREE_STATS=1 to also report rotations/op for AVLTree;
+// the counters cost a few percent, so leave them out for timing runs.
+#define AVL_TREE_NO_MAIN
+#include "avl_tree.cc"
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <random>
+#include <set>
+
+#if __has_include(<absl/container/btree_set.h>)
+#include <absl/container/btree_set.h>
+#define AVL_BENCHMARK_HAVE_ABSL 1
+#endif
+
+namespace {
+
+// Bytes currently allocated through CountingAllocator
+size_t allocatedBytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        allocatedBytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+        allocatedBytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U> &) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const CountingAllocator<U> &) const {
+        return false;
+    }
+};
+
+// Uniform interface over the containers under test
+struct AVLTreeSet {
+    static constexpr const char *kName = "AVLTree";
+    AVLTree<> tree;
+
+    bool insert(int key) { return tree.insert(key); }
+    bool erase(int key) { return tree.remove(key); }
+    bool contains(int key) const { return tree.search(key); }
+    size_t size() const { return tree.size(); }
+    size_t bytes() const { return tree.memory_usage(); }
+};
+
+struct StdSet {
+    static constexpr const char *kName = "std::set";
+    set<int, less<int>, CountingAllocator<int>> items;
+
+    bool insert(int key) { return items.insert(key).second; }
+    bool erase(int key) { return items.erase(key) != 0; }
+    bool contains(int key) const { return items.count(key) != 0; }
+    size_t size() const { return items.size(); }
+    size_t bytes() const { return allocatedBytes; }
+};
+
+#ifdef AVL_BENCHMARK_HAVE_ABSL
+struct BtreeSet {
+    static constexpr const char *kName = "absl::btree_set";
+    absl::btree_set<int, less<int>, CountingAllocator<int>> items;
+
+    bool insert(int key) { return items.insert(key).second; }
+    bool erase(int key) { return items.erase(key) != 0; }
+    bool contains(int key) const { return items.contains(key); }
+    size_t size() const { return items.size(); }
+    size_t bytes() const { return allocatedBytes; }
+};
+#endif
+
+// Inserts and erases cost O(n), so it only runs writes at small sizes
+struct SortedVector {
+    static constexpr const char *kName = "sorted vector";
+    static constexpr size_t kMaxWriteSize = 1 << 16;
+    vector<int> items;
+
+    bool insert(int key) {
+        auto it = std::lower_bound(items.begin(), items.end(), key);
+        if (it != items.end() && *it == key)
+            return false;
+        items.insert(it, key);
+        return true;
+    }
+
+    bool erase(int key) {
+        auto it = std::lower_bound(items.begin(), items.end(), key);
+        if (it == items.end() || *it != key)
+            return false;
+        items.erase(it);
+        return true;
+    }
+
+    bool contains(int key) const { return binary_search(items.begin(), items.end(), key); }
+    size_t size() const { return items.size(); }
+    size_t bytes() const { return items.capacity() * sizeof(int); }
+};
+
+template <typename Set>
+constexpr size_t maxWriteSize() {
+    if constexpr (is_same<Set, SortedVector>::value)
+        return SortedVector::kMaxWriteSize;
+    else
+        return numeric_limits<size_t>::max();
+}
+
+// Zipfian ranks in [0, n) with skew theta, following Gray et al., "Quickly
+// generating billion-record synthetic databases"
+class ZipfGenerator {
+private:
+    double theta, alpha, zetan, eta;
+    size_t n;
+
+public:
+    ZipfGenerator(size_t n, double theta = 0.99) : theta(theta), n(n) {
+        zetan = 0;
+        for (size_t i = 1; i <= n; ++i)
+            zetan += 1 / pow(double(i), theta);
+        double zeta2 = 1 + 1 / pow(2.0, theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng &rng) {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + pow(0.5, theta))
+            return 1;
+        return min(n - 1, static_cast<size_t>(n * pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+enum class Stream { Sequential, Random, Zipfian, Adversarial };
+
+const char *streamName(Stream stream) {
+    switch (stream) {
+    case Stream::Sequential:
+        return "sequential";
+    case Stream::Random:
+        return "random";
+    case Stream::Zipfian:
+        return "zipfian";
+    default:
+        return "adversarial";
+    }
+}
+
+// Returns count keys drawn from [0, range) in the given pattern. Zipfian
+// ranks are scattered over the range so that hot keys are not neighbours;
+// the adversarial stream alternates between the smallest and the largest
+// remaining key.
+vector<int> makeKeys(Stream stream, size_t count, size_t range, uint64_t seed) {
+    mt19937_64 rng(seed);
+    vector<int> keys(count);
+    switch (stream) {
+    case Stream::Sequential:
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = static_cast<int>(i % range);
+        break;
+    case Stream::Random:
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = static_cast<int>(rng() % range);
+        break;
+    case Stream::Zipfian: {
+        ZipfGenerator zipf(range);
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = static_cast<int>((zipf(rng) * 2654435761u) % range);
+        break;
+    }
+    case Stream::Adversarial:
+        for (size_t i = 0; i < count; ++i) {
+            size_t step = (i / 2) % ((range + 1) / 2);
+            keys[i] = static_cast<int>(i % 2 == 0 ? step : range - 1 - step);
+        }
+        break;
+    }
+    return keys;
+}
+
+// Fills set with the even keys below 2n in random order, so every stream
+// over [0, 2n) hits about half the time
+template <typename Set>
+void prefill(Set &set, size_t n) {
+    vector<int> keys(n);
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = static_cast<int>(2 * i);
+    shuffle(keys.begin(), keys.end(), mt19937_64(42));
+    if constexpr (is_same<Set, SortedVector>::value) {
+        sort(keys.begin(), keys.end());
+        set.items = std::move(keys);
+    } else {
+        for (int key : keys)
+            set.insert(key);
+    }
+}
+
+template <typename Set>
+void reportBytes(benchmark::State &state, const Set &set) {
+    state.counters["bytes/key"] = set.size() ? double(set.bytes()) / set.size() : 0;
+}
+
+// Starts counting rotations for a benchmark of Set
+template <typename Set>
+void startRotations() {
+#if AVL_TREE_STATS
+    if constexpr (is_same<Set, AVLTreeSet>::value)
+        AVLTree<>::reset_stats();
+#endif
+}
+
+// Reports the rotations per operation since startRotations(), for AVLTree
+// built with AVL_TREE_STATS
+template <typename Set>
+void reportRotations(benchmark::State &state, double operations) {
+#if AVL_TREE_STATS
+    if constexpr (is_same<Set, AVLTreeSet>::value)
+        state.counters["rotations/op"] = double(AVLTree<>::stats().rotations()) / operations;
+#else
+    (void)state;
+    (void)operations;
+#endif
+}
+
+// Length of the precomputed operation streams; a power of two
+constexpr size_t kStreamLength = 1 << 20;
+
+// Builds a container of n keys from an empty one, one insert at a time
+template <typename Set>
+void benchInsert(benchmark::State &state, Stream stream) {
+    size_t n = static_cast<size_t>(state.range(0));
+    vector<int> keys = makeKeys(stream, n, stream == Stream::Random ? numeric_limits<int>::max() : n, 1);
+    startRotations<Set>();
+    for (auto _ : state) {
+        Set set;
+        for (int key : keys)
+            benchmark::DoNotOptimize(set.insert(key));
+        benchmark::ClobberMemory();
+        state.PauseTiming();
+        reportBytes(state, set);
+        {
+            Set discard = std::move(set);
+        }
+        state.ResumeTiming();
+    }
+    state.counters["time/op"] =
+        benchmark::Counter(double(n), benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+    reportRotations<Set>(state, double(n) * state.iterations());
+}
+
+// Looks up keys of the given stream in a container of n keys
+template <typename Set>
+void benchSearch(benchmark::State &state, Stream stream) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Set set;
+    prefill(set, n);
+    vector<int> keys = makeKeys(stream, kStreamLength, 2 * n, 2);
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(set.contains(keys[i++ & (kStreamLength - 1)]));
+    reportBytes(state, set);
+}
+
+// Mixes lookups with writes; a write inserts its key or, if already present,
+// erases it, which keeps the size near n
+template <typename Set>
+void benchMixed(benchmark::State &state, Stream stream, int readPercent) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Set set;
+    prefill(set, n);
+    vector<int> keys = makeKeys(stream, kStreamLength, 2 * n, 3);
+    vector<bool> reads(kStreamLength);
+    mt19937_64 rng(4);
+    for (size_t i = 0; i < kStreamLength; ++i)
+        reads[i] = static_cast<int>(rng() % 100) < readPercent;
+    size_t i = 0;
+    startRotations<Set>();
+    for (auto _ : state) {
+        size_t at = i++ & (kStreamLength - 1);
+        int key = keys[at];
+        if (reads[at])
+            benchmark::DoNotOptimize(set.contains(key));
+        else if (!set.insert(key))
+            set.erase(key);
+    }
+    reportBytes(state, set);
+    reportRotations<Set>(state, double(state.iterations()));
+}
+
+// Delete-heavy churn: a window of n keys slides forward, so every step
+// erases the oldest key and inserts a new largest one, as TTL expiry does
+template <typename Set>
+void benchChurn(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Set set;
+    for (size_t i = 0; i < n; ++i)
+        set.insert(static_cast<int>(i));
+    uint32_t oldest = 0;
+    startRotations<Set>();
+    for (auto _ : state) {
+        set.erase(static_cast<int>(oldest & 0x7fffffff));
+        set.insert(static_cast<int>((oldest + n) & 0x7fffffff));
+        ++oldest;
+    }
+    reportBytes(state, set);
+    reportRotations<Set>(state, 2.0 * state.iterations());
+}
+
+const Stream kStreams[] = {Stream::Sequential, Stream::Random, Stream::Zipfian, Stream::Adversarial};
+
+template <typename Set>
+void registerContainer(const vector<size_t> &sizes) {
+    string name = Set::kName;
+    auto withSizes = [&](benchmark::internal::Benchmark *bench, bool writes) {
+        for (size_t n : sizes)
+            if (!writes || n <= maxWriteSize<Set>())
+                bench->Arg(static_cast<int64_t>(n));
+        return bench;
+    };
+
+    for (Stream stream : kStreams) {
+        string suffix = string("/") + streamName(stream) + "/" + name;
+        withSizes(benchmark::RegisterBenchmark(("insert" + suffix).c_str(), benchInsert<Set>, stream), true)
+            ->Unit(benchmark::kMillisecond);
+        withSizes(benchmark::RegisterBenchmark(("search" + suffix).c_str(), benchSearch<Set>, stream), false);
+        for (int readPercent : {95, 50}) {
+            string mixed = "mixed" + to_string(readPercent) + suffix;
+            withSizes(benchmark::RegisterBenchmark(mixed.c_str(), benchMixed<Set>, stream, readPercent), true);
+        }
+    }
+    withSizes(benchmark::RegisterBenchmark(("churn/" + name).c_str(), benchChurn<Set>), true);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t maxSize = 1 << 20;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--max_size=", 0) == 0)
+            maxSize = stoull(arg.substr(strlen("--max_size=")));
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+
+    vector<size_t> sizes;
+    for (size_t n = 1 << 10; n <= maxSize && n < 100000000; n <<= 5)
+        sizes.push_back(n);
+    if (maxSize >= 100000000)
+        sizes.push_back(100000000);
+
+    registerContainer<AVLTreeSet>(sizes);
+    registerContainer<StdSet>(sizes);
+#ifdef AVL_BENCHMARK_HAVE_ABSL
+    registerContainer<BtreeSet>(sizes);
+#endif
+    registerContainer<SortedVector>(sizes);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
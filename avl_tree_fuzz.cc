@@ -0,0 +1,652 @@
+// Differential fuzz and stress harness. Every input is an operation script
+// that is applied to each tree variant and to std::set, std::multiset or
+// std::map alongside; after every operation each variant's invariants (key
+// order, heights, balance factors, stored sizes) are checked and its
+// contents compared with the reference. Scripts also reopen the durable tree
+// from its files, search a memory-mapped snapshot, round-trip through the
+// frozen layout and probe a compile-time tree. File-backed variants live
+// under $TMPDIR (or /tmp) as avl_tree_fuzz.<pid>.*.
+//
+// Build: g++ -std=c++17 -O1 -g -fsanitize=address,undefined -pthread avl_tree_fuzz.cc -o avl_tree_fuzz
+//        g++ -std=c++17 -O1 -g -fsanitize=thread -pthread avl_tree_fuzz.cc -o avl_tree_fuzz_tsan
+//        clang++ -std=c++17 -O1 -g -fsanitize=fuzzer,address,undefined -DAVL_TREE_LIBFUZZER avl_tree_fuzz.cc
+// Run:   ./avl_tree_fuzz [--runs=N] [--ops=N] [--seed=N]    randomized scripts
+//        ./avl_tree_fuzz --threads=N [--ops=N]               concurrent stress
+//        ./avl_tree_fuzz --perf                              performance gates
+//        ./avl_tree_fuzz FILE...                             replay inputs
+//
+// The performance gates time AVLTree against std::set on the random-stream
+// insert and search workloads of avl_tree_benchmark.cc and fail when the
+// ratio exceeds its threshold. Ratios rather than absolute times keep the
+// gates meaningful across machines; build them with -O2 -DNDEBUG.
+#define AVL_TREE_NO_MAIN
+#include "avl_tree.cc"
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+
+namespace {
+
+// Keys are drawn from a small domain so that scripts hit duplicates,
+// removals of present keys and rebalancing at every size
+constexpr int kKeyDomain = 512;
+
+// Reports the failed check with the operation that exposed it and aborts,
+// so that sanitizers and libFuzzer record the input
+void check(bool ok, const char *what, size_t op) {
+    if (!ok) {
+        fprintf(stderr, "avl_tree_fuzz: %s failed at operation %zu\n", what, op);
+        abort();
+    }
+}
+
+// Operation script decoded from fuzzer bytes; exhausted input reads as zeros
+class Script {
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+
+public:
+    Script(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+    bool done() const {
+        return pos >= size;
+    }
+
+    uint8_t byte() {
+        return pos < size ? data[pos++] : 0;
+    }
+
+    int key() {
+        int high = byte();
+        return (high << 8 | byte()) % kKeyDomain;
+    }
+};
+
+struct SumOptions : OrderStatisticsOptions {
+    using aggregate = SumAggregate<long long>;
+};
+
+// Keys of the compile-time tree: 64 distinct keys spread over the domain
+constexpr array<int, 64> staticKeys() {
+    array<int, 64> keys{};
+    for (size_t i = 0; i < keys.size(); ++i)
+        keys[i] = static_cast<int>(i * 37 % kKeyDomain);
+    return keys;
+}
+
+constexpr array<int, 64> kStaticKeys = staticKeys();
+constexpr StaticAVLTree<int, 64> kStaticTree(kStaticKeys);
+
+// Removes the files a script's file-backed variants may have left
+void removeFiles(const string &path) {
+    for (const char *suffix : {".snapshot", ".snapshot.tmp", ".wal", ".mmap", ".mmap.tmp"})
+        ::remove((path + suffix).c_str());
+}
+
+string freshFilePath() {
+    const char *directory = getenv("TMPDIR");
+    string path = string(directory && *directory ? directory : "/tmp") + "/avl_tree_fuzz." + to_string(getpid());
+    removeFiles(path);
+    return path;
+}
+
+template <typename Tree, typename Reference>
+bool sameKeys(const Tree &tree, const Reference &reference) {
+    return tree.size() == reference.size() && equal(tree.begin(), tree.end(), reference.begin());
+}
+
+// Every variant of the ordered set, driven by the same script
+class Variants {
+private:
+    set<int> reference;
+    multiset<int> counts;
+    map<int, long long> values;
+
+    AVLTree<> plain;
+    AVLTree<int, void, less<int>, OrderStatisticsOptions> ranked;
+    AVLTree<int, void, less<int>, CountedOptions> counted;
+    AVLTree<int, long long, less<int>, SumOptions> summed;
+    BlockedAVLTree blocked;
+    ConcurrentAVLTree<> concurrent;
+    PersistentAVLTree<> persistent;
+    PersistentAVLTree<>::Snapshot snapshot;
+    set<int> snapshotReference;
+    ShardedAVLTree<int> sharded{vector<int>{kKeyDomain / 4, kKeyDomain / 2, 3 * kKeyDomain / 4}};
+    IntervalTree<double> intervals;
+    set<pair<double, double>> intervalReference;
+
+    // Small groups, so that reopening finds both committed and pending
+    // records
+    static constexpr size_t kDurableGroup = 16;
+    string filePath = freshFilePath();
+    unique_ptr<DurableAVLTree<>> durable = make_unique<DurableAVLTree<>>(filePath, kDurableGroup);
+
+    size_t op = 0;
+
+    // The interval a key and a shape byte stand for; some shapes have an
+    // infinite start or end
+    static pair<double, double> intervalOf(int key, uint8_t shape) {
+        const double infinity = numeric_limits<double>::infinity();
+        double start = key * 0.5;
+        switch (shape / 16) {
+        case 0:
+            return {-infinity, start};
+        case 1:
+            return {start, infinity};
+        default:
+            return {start, start + (shape / 16 - 2) * 0.25};
+        }
+    }
+
+    void insert(int key, long long value) {
+        bool inserted = reference.insert(key).second;
+        check(plain.insert(key) == inserted, "AVLTree insert", op);
+        check(ranked.insert(key) == inserted, "order statistics insert", op);
+        check(blocked.insert(key) == inserted, "BlockedAVLTree insert", op);
+        check(concurrent.insert(key) == inserted, "ConcurrentAVLTree insert", op);
+        check(persistent.insert(key) == inserted, "PersistentAVLTree insert", op);
+        check(sharded.insert(key) == inserted, "ShardedAVLTree insert", op);
+        check(durable->insert(key) == inserted, "DurableAVLTree insert", op);
+        pair<double, double> interval = intervalOf(key, static_cast<uint8_t>(value));
+        check(intervals.insert(interval.first, interval.second) == intervalReference.insert(interval).second,
+              "IntervalTree insert", op);
+        counted.insert(key);
+        counts.insert(key);
+        check(summed.insert_or_assign(key, value).second == inserted, "aggregate insert", op);
+        values[key] = value;
+    }
+
+    void remove(int key, uint8_t shape) {
+        bool removed = reference.erase(key) != 0;
+        check(plain.remove(key) == removed, "AVLTree remove", op);
+        check(ranked.remove(key) == removed, "order statistics remove", op);
+        check(blocked.remove(key) == removed, "BlockedAVLTree remove", op);
+        check(concurrent.remove(key) == removed, "ConcurrentAVLTree remove", op);
+        check(persistent.remove(key) == removed, "PersistentAVLTree remove", op);
+        check(sharded.remove(key) == removed, "ShardedAVLTree remove", op);
+        check(durable->remove(key) == removed, "DurableAVLTree remove", op);
+        pair<double, double> interval = intervalOf(key, shape);
+        check(intervals.remove(interval.first, interval.second) == (intervalReference.erase(interval) != 0),
+              "IntervalTree remove", op);
+        check(summed.remove(key) == removed, "aggregate remove", op);
+        values.erase(key);
+        auto it = counts.find(key);
+        check(counted.remove(key) == (it != counts.end()), "multiset remove", op);
+        if (it != counts.end())
+            counts.erase(it);
+    }
+
+    // Bulk operations exist only on AVLTree; the result is mirrored into the
+    // other variants through single-key updates
+    void bulk(Script &script) {
+        int lo = script.key(), hi = script.key();
+        switch (script.byte() % 6) {
+        case 0: {
+            vector<int> batch;
+            for (int n = script.byte() % 32; n > 0; --n)
+                batch.push_back(script.key());
+            set<int> fresh;
+            for (int key : batch)
+                if (!reference.count(key))
+                    fresh.insert(key);
+            check(plain.insert_batch(batch.begin(), batch.end()) == fresh.size(), "insert_batch", op);
+            for (int key : fresh)
+                mirrorInsert(key);
+            break;
+        }
+        case 1: {
+            vector<int> batch;
+            for (int n = script.byte() % 32; n > 0; --n)
+                batch.push_back(script.key());
+            set<int> present;
+            for (int key : batch)
+                if (reference.count(key))
+                    present.insert(key);
+            check(plain.erase_batch(batch.begin(), batch.end()) == present.size(), "erase_batch", op);
+            for (int key : present)
+                mirrorRemove(key);
+            break;
+        }
+        case 2: {
+            AVLTree<> tail = plain.split(lo);
+            check(plain.isValid() && tail.isValid(), "split", op);
+            check(plain.empty() || *prev(plain.end()) < lo, "split lower part", op);
+            check(tail.empty() || *tail.begin() >= lo, "split upper part", op);
+            plain = AVLTree<>::join(std::move(plain), std::move(tail));
+            break;
+        }
+        case 3: {
+            vector<int> doomed(reference.lower_bound(lo), lo < hi ? reference.lower_bound(hi) : reference.lower_bound(lo));
+            plain.erase_range(lo, hi);
+            for (int key : doomed)
+                mirrorRemove(key);
+            break;
+        }
+        case 4: {
+            AVLTree<> middle = plain.extract_range(lo, hi);
+            check(middle.isValid() && (lo >= hi || middle.size() == static_cast<size_t>(distance(
+                                                                  reference.lower_bound(lo), reference.lower_bound(hi)))),
+                  "extract_range", op);
+            plain.union_with(std::move(middle));
+            break;
+        }
+        default: {
+            // Appends above the maximum and finger inserts near lo
+            int top = reference.empty() ? 0 : *reference.rbegin();
+            for (int key = top + 1; key < kKeyDomain && key <= top + 8; ++key) {
+                check(plain.append(key).second, "append", op);
+                mirrorInsert(key);
+            }
+            auto cursor = plain.cursor();
+            for (int key = lo; key < kKeyDomain && key < lo + 8; ++key) {
+                bool inserted = cursor.insert_near(key).second;
+                check(inserted == (reference.count(key) == 0), "insert_near", op);
+                if (inserted)
+                    mirrorInsert(key);
+            }
+            break;
+        }
+        }
+    }
+
+    // Applies to every variant but plain, which already holds the change
+    void mirrorInsert(int key) {
+        reference.insert(key);
+        ranked.insert(key);
+        blocked.insert(key);
+        concurrent.insert(key);
+        persistent.insert(key);
+        sharded.insert(key);
+        durable->insert(key);
+        counted.insert(key);
+        counts.insert(key);
+        summed.insert_or_assign(key, key);
+        values[key] = key;
+    }
+
+    void mirrorRemove(int key) {
+        reference.erase(key);
+        ranked.remove(key);
+        blocked.remove(key);
+        concurrent.remove(key);
+        persistent.remove(key);
+        sharded.remove(key);
+        durable->remove(key);
+        summed.remove(key);
+        values.erase(key);
+        auto it = counts.find(key);
+        if (it != counts.end()) {
+            counted.remove(key);
+            counts.erase(it);
+        }
+    }
+
+    void query(int key, int hi) {
+        bool present = reference.count(key) != 0;
+        check(plain.search(key) == present && ranked.search(key) == present && blocked.search(key) == present &&
+                  concurrent.search(key) == present && persistent.search(key) == present &&
+                  sharded.search(key) == present,
+              "search", op);
+        check(counted.count(key) == counts.count(key), "multiset count", op);
+
+        auto bound = reference.lower_bound(key);
+        auto found = plain.lower_bound(key);
+        check(bound == reference.end() ? found == plain.end() : found != plain.end() && *found == *bound,
+              "lower_bound", op);
+
+        size_t rank = static_cast<size_t>(distance(reference.begin(), bound));
+        check(ranked.rank(key) == rank, "rank", op);
+        const int *selected = ranked.select(rank);
+        check(rank == reference.size() ? selected == nullptr : selected && *selected == *bound, "select", op);
+        check(counted.rank(key) == static_cast<size_t>(distance(counts.begin(), counts.lower_bound(key))),
+              "multiset rank", op);
+        if (!counts.empty()) {
+            size_t k = static_cast<size_t>(hi) % counts.size();
+            const int *occurrence = counted.select(k);
+            check(occurrence && *occurrence == *next(counts.begin(), static_cast<ptrdiff_t>(k)), "multiset select", op);
+        }
+
+        long long sum = 0;
+        if (key < hi)
+            for (auto it = values.lower_bound(key); it != values.end() && it->first < hi; ++it)
+                sum += it->second;
+        check(summed.aggregate(key, hi) == sum, "aggregate", op);
+
+        static const set<int> staticReference(kStaticKeys.begin(), kStaticKeys.end());
+        auto staticBound = staticReference.lower_bound(key);
+        const int *staticFound = kStaticTree.lower_bound(key);
+        check(kStaticTree.search(key) == (staticReference.count(key) != 0) &&
+                  (staticBound == staticReference.end() ? !staticFound : staticFound && *staticFound == *staticBound),
+              "StaticAVLTree lookup", op);
+
+        // Query bounds are occasionally infinite
+        const double infinity = numeric_limits<double>::infinity();
+        double a = min(key, hi) * 0.5, b = max(key, hi) * 0.5;
+        if (key % 16 == 0)
+            a = -infinity;
+        if (hi % 16 == 0)
+            b = infinity;
+        vector<pair<double, double>> expected, overlapping;
+        for (const auto &interval : intervalReference)
+            if (interval.first <= b && a <= interval.second)
+                expected.push_back(interval);
+        intervals.find_overlapping(a, b, [&](const pair<double, double> &interval) { overlapping.push_back(interval); });
+        check(overlapping == expected && intervals.overlaps(a, b) == !expected.empty(), "IntervalTree overlaps", op);
+    }
+
+    // Reopens the durable tree from its files, after compacting it or after
+    // tearing a frame onto its log when asked, then checks a memory-mapped
+    // snapshot of plain and round-trips plain through the frozen layout
+    void persist(uint8_t mode) {
+        if (mode % 3 == 0)
+            durable->compact();
+        durable->commit();
+        durable.reset();
+        if (mode % 3 == 1) {
+            // Declares 100 payload bytes but supplies three, like a write cut
+            // short by a crash
+            FILE *log = fopen((filePath + ".wal").c_str(), "ab");
+            check(log != nullptr, "DurableAVLTree log", op);
+            fputs("\x64tor", log);
+            fclose(log);
+        }
+        durable = make_unique<DurableAVLTree<>>(filePath, kDurableGroup);
+        check(durable->tree().isValid() && sameKeys(durable->tree(), reference), "DurableAVLTree reopen", op);
+
+        plain.save(filePath + ".mmap");
+        MappedAVLTree<int, void, less<int>> mapped = AVLTree<>::open_mmap(filePath + ".mmap");
+        check(mapped.size() == reference.size(), "open_mmap size", op);
+        for (int key = 0; key < kKeyDomain; ++key)
+            check(mapped.search(key) == (reference.count(key) != 0), "open_mmap search", op);
+
+        roundTripFrozen();
+    }
+
+    void roundTripFrozen() {
+        FrozenAVLTree<int, void, less<int>> frozen = plain.freeze();
+        check(frozen.size() == reference.size(), "freeze", op);
+        for (int key = 0; key < kKeyDomain; ++key)
+            check(frozen.search(key) == (reference.count(key) != 0), "frozen search", op);
+        plain = frozen.thaw();
+        check(plain.isValid() && sameKeys(plain, reference), "thaw", op);
+    }
+
+    void checkAll() {
+        check(plain.isValid() && sameKeys(plain, reference), "AVLTree invariants", op);
+        check(ranked.isValid() && sameKeys(ranked, reference), "order statistics invariants", op);
+        check(counted.isValid() && counted.size() == counts.size(), "multiset invariants", op);
+        check(summed.isValid() && summed.size() == values.size(), "aggregate invariants", op);
+        check(blocked.isValid() && blocked.size() == reference.size(), "BlockedAVLTree invariants", op);
+        check(concurrent.isValid() && concurrent.size() == reference.size(), "ConcurrentAVLTree invariants", op);
+        check(persistent.isValid() && persistent.size() == reference.size(), "PersistentAVLTree invariants", op);
+        check(sharded.isValid() && sharded.size() == reference.size(), "ShardedAVLTree invariants", op);
+        check(durable->size() == reference.size(), "DurableAVLTree size", op);
+        check(intervals.isValid() && intervals.size() == intervalReference.size(), "IntervalTree invariants", op);
+    }
+
+public:
+    Variants() = default;
+    Variants(const Variants &) = delete;
+    Variants &operator=(const Variants &) = delete;
+
+    ~Variants() {
+        durable.reset();
+        removeFiles(filePath);
+    }
+
+    void run(Script &script) {
+        for (; !script.done(); ++op) {
+            uint8_t code = script.byte();
+            int key = script.key();
+            switch (code % 16) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+                insert(key, code);
+                break;
+            case 6:
+            case 7:
+            case 8:
+                remove(key, code);
+                break;
+            case 9:
+            case 10:
+            case 11:
+                query(key, script.key());
+                break;
+            case 12:
+            case 13:
+                bulk(script);
+                break;
+            case 14:
+                snapshot = persistent.snapshot();
+                snapshotReference = reference;
+                break;
+            default:
+                // File-backed checks sync to disk, so they run less often
+                if (key % 4 == 0) {
+                    persist(script.byte());
+                    break;
+                }
+                check(snapshot.size() == snapshotReference.size() &&
+                          snapshot.search(key) == (snapshotReference.count(key) != 0),
+                      "persistent snapshot", op);
+                break;
+            }
+            checkAll();
+        }
+
+        roundTripFrozen();
+    }
+};
+
+void runScript(const uint8_t *data, size_t size) {
+    Script script(data, size);
+    Variants variants;
+    variants.run(script);
+}
+
+// Writers own the keys congruent to their index, so each can keep an exact
+// reference of its own keys while the others run concurrently
+void runConcurrentStress(int threads, size_t ops, uint64_t seed) {
+    ConcurrentAVLTree<> concurrent;
+    ShardedAVLTree<int> sharded{vector<int>{1 << 14, 1 << 15, 3 << 14}};
+    vector<set<int>> owned(threads);
+    atomic<bool> stop(false), readerFailed(false);
+
+    // Keys below 1024 that are multiples of threads are inserted up front
+    // and never removed, so readers may always expect them
+    for (int key = 0; key < 1024; key += threads) {
+        concurrent.insert(key);
+        sharded.insert(key);
+        owned[0].insert(key);
+    }
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            mt19937_64 rng(seed + t);
+            for (size_t i = 0; i < ops; ++i) {
+                int key = static_cast<int>(rng() % (1 << 16)) / threads * threads + t;
+                if (key < 1024 && t == 0)
+                    continue;
+                if (rng() % 3 == 0) {
+                    bool removed = owned[t].erase(key) != 0;
+                    check(concurrent.remove(key) == removed, "concurrent remove", i);
+                    check(sharded.remove(key) == removed, "sharded remove", i);
+                } else {
+                    bool inserted = owned[t].insert(key).second;
+                    check(concurrent.insert(key) == inserted, "concurrent insert", i);
+                    check(sharded.insert(key) == inserted, "sharded insert", i);
+                }
+            }
+        });
+    }
+    thread reader([&] {
+        while (!stop.load()) {
+            for (int key = 0; key < 1024; key += threads)
+                if (!concurrent.search(key) || !sharded.search(key))
+                    readerFailed = true;
+            int last = -1;
+            sharded.for_each([&](int key) {
+                if (key <= last)
+                    readerFailed = true;
+                last = key;
+            });
+        }
+    });
+    for (thread &worker : workers)
+        worker.join();
+    stop = true;
+    reader.join();
+
+    set<int> all;
+    for (const set<int> &keys : owned)
+        all.insert(keys.begin(), keys.end());
+    check(!readerFailed, "concurrent readers", ops);
+    check(concurrent.isValid() && concurrent.size() == all.size(), "concurrent invariants", ops);
+    check(sharded.isValid() && sharded.size() == all.size(), "sharded invariants", ops);
+    vector<int> keys;
+    sharded.for_each([&](int key) { keys.push_back(key); });
+    check(equal(keys.begin(), keys.end(), all.begin(), all.end()), "sharded contents", ops);
+    for (int key : all)
+        check(concurrent.search(key), "concurrent contents", ops);
+}
+
+// Largest accepted ratio of AVLTree time to std::set time per workload. When
+// the gates were added the ratios measured 0.60-0.85 for inserts and
+// 0.77-0.83 for searches; the limits leave room for noise, not regressions.
+struct PerfGate {
+    const char *name;
+    double maxRatio;
+};
+
+const PerfGate kPerfGates[] = {{"insert/random", 1.00}, {"search/random", 1.00}};
+
+template <typename Fn>
+double bestOf(int repeats, Fn &&fn) {
+    double best = numeric_limits<double>::infinity();
+    for (int i = 0; i < repeats; ++i) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int runPerfGates() {
+    constexpr size_t kSize = 1 << 20;
+    mt19937 rng(42);
+    vector<int> keys(kSize);
+    for (int &key : keys)
+        key = static_cast<int>(rng() & 0x7fffffff);
+
+    size_t sink = 0;
+    double times[2][2];
+    times[0][0] = bestOf(3, [&] {
+        AVLTree<> tree;
+        for (int key : keys)
+            tree.insert(key);
+        sink += tree.size();
+    });
+    times[0][1] = bestOf(3, [&] {
+        set<int> items;
+        for (int key : keys)
+            items.insert(key);
+        sink += items.size();
+    });
+
+    AVLTree<> tree;
+    set<int> items;
+    for (int key : keys) {
+        tree.insert(key);
+        items.insert(key);
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    times[1][0] = bestOf(3, [&] {
+        for (int key : keys)
+            sink += tree.search(key);
+    });
+    times[1][1] = bestOf(3, [&] {
+        for (int key : keys)
+            sink += items.count(key);
+    });
+
+    int failed = 0;
+    for (int i = 0; i < 2; ++i) {
+        double ratio = times[i][0] / times[i][1];
+        bool ok = ratio <= kPerfGates[i].maxRatio;
+        printf("%-14s AVLTree %.3fs std::set %.3fs ratio %.2f (limit %.2f) %s\n", kPerfGates[i].name, times[i][0],
+               times[i][1], ratio, kPerfGates[i].maxRatio, ok ? "ok" : "REGRESSED");
+        failed += !ok;
+    }
+    return (failed != 0 || sink == 0) ? 1 : 0;
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    runScript(data, size);
+    return 0;
+}
+
+#ifndef AVL_TREE_LIBFUZZER
+int main(int argc, char **argv) {
+    size_t runs = 200, ops = 2000;
+    uint64_t seed = 1;
+    int threads = 0;
+    vector<string> files;
+    bool perf = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--runs=", 0) == 0)
+            runs = stoull(arg.substr(strlen("--runs=")));
+        else if (arg.rfind("--ops=", 0) == 0)
+            ops = stoull(arg.substr(strlen("--ops=")));
+        else if (arg.rfind("--seed=", 0) == 0)
+            seed = stoull(arg.substr(strlen("--seed=")));
+        else if (arg.rfind("--threads=", 0) == 0)
+            threads = stoi(arg.substr(strlen("--threads=")));
+        else if (arg == "--perf")
+            perf = true;
+        else
+            files.push_back(arg);
+    }
+
+    if (perf)
+        return runPerfGates();
+    if (threads > 0) {
+        runConcurrentStress(threads, ops * 50, seed);
+        printf("concurrent stress with %d threads passed\n", threads);
+        return 0;
+    }
+    if (!files.empty()) {
+        for (const string &file : files) {
+            ifstream in(file, ios::binary);
+            vector<uint8_t> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            runScript(data.data(), data.size());
+        }
+        printf("%zu inputs replayed\n", files.size());
+        return 0;
+    }
+
+    mt19937_64 rng(seed);
+    for (size_t run = 0; run < runs; ++run) {
+        // Scripts take about four bytes per operation
+        vector<uint8_t> data(ops * 4);
+        for (uint8_t &byte : data)
+            byte = static_cast<uint8_t>(rng());
+        runScript(data.data(), data.size());
+    }
+    printf("%zu randomized runs of %zu operations passed\n", runs, ops);
+    return 0;
+}
+#endif